@@ -0,0 +1,75 @@
+#include "AsciiCharStream.h"
+
+void AsciiCharStream::Load(std::string_view text) {
+    text_ = text;
+    pos_ = 0;
+}
+
+bool AsciiCharStream::IsAscii(std::string_view text) {
+    unsigned char high_bits = 0;
+    for (char c : text) {
+        high_bits |= static_cast<unsigned char>(c);
+    }
+    return (high_bits & 0x80) == 0;
+}
+
+void AsciiCharStream::consume() {
+    if (pos_ >= text_.size()) {
+        throw antlr4::IllegalStateException("cannot consume EOF");
+    }
+    pos_++;
+}
+
+size_t AsciiCharStream::LA(ssize_t i) {
+    if (i == 0) {
+        return 0; // undefined
+    }
+    auto position = static_cast<ssize_t>(pos_);
+    if (i < 0) {
+        i++; // LA(-1) is the previous char
+        if (position + i - 1 < 0) return antlr4::IntStream::EOF;
+    }
+    if (position + i - 1 >= static_cast<ssize_t>(text_.size())) {
+        return antlr4::IntStream::EOF;
+    }
+    return static_cast<unsigned char>(text_[static_cast<size_t>(position + i - 1)]);
+}
+
+ssize_t AsciiCharStream::mark() {
+    return -1; // whole input is always available
+}
+
+void AsciiCharStream::release(ssize_t /* marker */) {
+}
+
+size_t AsciiCharStream::index() {
+    return pos_;
+}
+
+void AsciiCharStream::seek(size_t index) {
+    pos_ = std::min(index, text_.size());
+}
+
+size_t AsciiCharStream::size() {
+    return text_.size();
+}
+
+std::string AsciiCharStream::getSourceName() const {
+    return antlr4::IntStream::UNKNOWN_SOURCE_NAME;
+}
+
+std::string AsciiCharStream::getText(const antlr4::misc::Interval& interval) {
+    if (interval.a < 0 || interval.b < 0) {
+        return "";
+    }
+    auto start = static_cast<size_t>(interval.a);
+    auto stop = std::min(static_cast<size_t>(interval.b), text_.size() - 1);
+    if (start >= text_.size() || start > stop) {
+        return "";
+    }
+    return std::string(text_.substr(start, stop - start + 1));
+}
+
+std::string AsciiCharStream::toString() const {
+    return std::string(text_);
+}
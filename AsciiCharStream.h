@@ -0,0 +1,38 @@
+#pragma once
+#include "antlr4-runtime.h"
+#include <string_view>
+
+//// CharStream over the caller's bytes for pure ASCII input --Formula.g4 tokens are ASCII only.
+//// Unlike ANTLRInputStream nothing is copied or transcoded to UTF-32; the text must outlive the parse
+class AsciiCharStream : public antlr4::CharStream {
+public:
+    AsciiCharStream() = default;
+
+    void Load(std::string_view text); // Rewinds to the start of the new text
+
+    static bool IsAscii(std::string_view text);
+
+    void consume() override;
+
+    size_t LA(ssize_t i) override;
+
+    ssize_t mark() override;
+
+    void release(ssize_t marker) override;
+
+    size_t index() override;
+
+    void seek(size_t index) override;
+
+    size_t size() override;
+
+    [[nodiscard]] std::string getSourceName() const override;
+
+    std::string getText(const antlr4::misc::Interval& interval) override;
+
+    [[nodiscard]] std::string toString() const override;
+
+private:
+    std::string_view text_;
+    size_t pos_ = 0;
+};
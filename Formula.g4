@@ -9,8 +9,19 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' (arg (',' arg)*)? ')'  # Function
         | CELL  # Cell
         | NUMBER  # Literal
+        | STRING  # String
+        ;
+
+arg
+        : range
+        | expr
+        ;
+
+range
+        : CELL ':' CELL
         ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -27,4 +38,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+FUNCTION: [A-Z]+ ;
+STRING: '"' ~["]* '"' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
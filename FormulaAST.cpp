@@ -1,11 +1,20 @@
 #include "FormulaAST.h"
 
+#include "AsciiCharStream.h"
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "criteria_index.h"
+#include "lookup_index.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -68,257 +77,625 @@ namespace ASTImpl {
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        [[nodiscard]] virtual CellInterface::Value Evaluate(const SheetInterface& sheet) const = 0;
+    namespace {
 
-        // higher is tighter
-        [[nodiscard]] virtual ExprPrecedence GetPrecedence() const = 0;
+        // Value of a referenced cell as a formula operand
+        CellInterface::Value EvaluateCell(const SheetInterface& sheet, Position pos) {
+            if (sheet.GetCell(pos) == nullptr) return 0.0;
+            auto value = sheet.GetCell(pos)->GetValue();
+            if (std::holds_alternative<std::string>(value)) {
+                // Whole text must be a number, see ReadNumberText(): "3D" is an error, not 3
+                auto number = ReadLookupKey(sheet.GetCell(pos));
+                if (!number) return FormulaError::Category::Value;
+                return *number;
+            } else if (std::holds_alternative<double>(value)) {
+                return std::get<double>(value);
+            } else {
+                return 0.0;
+            }
+        }
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-            auto precedence = GetPrecedence();
-            auto mask = right_child ? PR_RIGHT : PR_LEFT;
-            bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-            if (parens_needed) {
-                out << '(';
+        // Offset of the matching cell in a one-column or one-row range. Uses the shared index cache of the sheet if any
+        std::optional<int> FindInRange(const SheetInterface& sheet, Range range, double value, MatchMode mode) {
+            if (auto cache = sheet.GetLookupCache()) {
+                return cache->Get(range, sheet).Find(value, mode);
             }
+            return LookupIndex(range, sheet).Find(value, mode);
+        }
+
+        // Node::op of a function node
+        enum FunctionType : char {
+            FT_VLOOKUP,
+            FT_MATCH,
+            FT_XLOOKUP,
+            FT_SUMIF,
+            FT_COUNTIF,
+            FT_AVERAGEIF,
+            FT_END,
+        };
+
+        constexpr std::string_view FUNCTION_NAMES[FT_END] = {"VLOOKUP", "MATCH", "XLOOKUP", "SUMIF", "COUNTIF", "AVERAGEIF"};
+
+        constexpr size_t MAX_FUNCTION_ARGS = 4;
+
+        // {min args, max args, range args, text args: criteria and lookup values --bit per position}
+        struct Signature {
+            size_t min_args;
+            size_t max_args;
+            unsigned ranges;
+            unsigned texts;
+        };
 
-            DoPrintFormula(out, precedence);
+        constexpr Signature SIGNATURES[FT_END] = {
+            {3, 4, 0b0010, 0b0001},  // VLOOKUP(value, table, column, [approximate])
+            {2, 3, 0b0010, 0b0001},  // MATCH(value, range, [type])
+            {3, 4, 0b0110, 0b0001},  // XLOOKUP(value, lookup range, return range, [mode])
+            {2, 3, 0b101, 0b010},    // SUMIF(range, criterion, [sum range])
+            {2, 2, 0b01, 0b10},      // COUNTIF(range, criterion)
+            {2, 3, 0b101, 0b010},    // AVERAGEIF(range, criterion, [average range])
+        };
 
-            if (parens_needed) {
-                out << ')';
+        // higher is tighter
+        ExprPrecedence GetPrecedence(const Node& node) {
+            if (node.type == NodeType::UnaryOp) return EP_UNARY;
+            if (node.type != NodeType::BinaryOp) return EP_ATOM;
+            switch (node.op) {
+                case '+':
+                    return EP_ADD;
+                case '-':
+                    return EP_SUB;
+                case '*':
+                    return EP_MUL;
+                default:
+                    return EP_DIV;
             }
         }
-    };
-
-    namespace {
 
-        class CellExpr final : public Expr {
+        //// Appends nodes of a formula in post order and collects the referenced cells.
+        //// Shared by ParseASTListener and PrattParser so both build identical arrays
+        class NodeBuilder {
         public:
-            explicit CellExpr(Position *pos_ptr):  pos_ptr_(*pos_ptr){
-                if (!pos_ptr->IsValid()) throw FormulaError(FormulaError::Category::Ref);
+            NodeBuilder(size_t max_nodes, size_t max_range_area)
+                : max_nodes_(max_nodes)
+                , max_range_area_(max_range_area) {
+            }
+
+            uint32_t AddNumber(double value) {
+                Node node;
+                node.type = NodeType::Number;
+                node.number = value;
+                return Add(node);
+            }
+
+            uint32_t AddCell(Position pos) {
+                if (!pos.IsValid()) throw FormulaError(FormulaError::Category::Ref);
+                cells_.push_back(pos);
+                Node node;
+                node.type = NodeType::Cell;
+                node.range = {pos, pos};
+                return Add(node);
             }
 
-            void Print(std::ostream& out) const override {
-                if (!pos_ptr_.IsValid()) {
-                    //out << FormulaError::Category::Ref;
-                } else {
-                    out << pos_ptr_.ToString();
+            uint32_t AddRange(Position from, Position to) {
+                Range range = Range::FromPositions(from, to);
+                if (!range.IsValid()) throw FormulaError(FormulaError::Category::Ref);
+                Size size = range.GetSize();
+                if (static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols) > max_range_area_) {
+                    throw ParsingError("Range is too big: more than " + std::to_string(max_range_area_) + " cells");
                 }
+                ranges_.push_back(range);
+                Node node;
+                node.type = NodeType::Range;
+                node.range = range;
+                return Add(node);
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            uint32_t AddString(std::string_view text) {
+                Node node;
+                node.type = NodeType::String;
+                node.text_offset = static_cast<uint32_t>(strings_.size());
+                node.text_size = static_cast<uint32_t>(text.size());
+                strings_.append(text);
+                return Add(node);
             }
 
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override { return EP_ATOM; }
+            uint32_t AddUnaryOp(char op, uint32_t operand) {
+                Node node;
+                node.type = NodeType::UnaryOp;
+                node.op = op;
+                node.first = operand;
+                return Add(node);
+            }
+
+            uint32_t AddBinaryOp(char op, uint32_t lhs, uint32_t rhs) {
+                nodes_[lhs].next = rhs;
+                Node node;
+                node.type = NodeType::BinaryOp;
+                node.op = op;
+                node.first = lhs;
+                return Add(node);
+            }
 
-            [[nodiscard]] CellInterface::Value Evaluate(const SheetInterface& sheet) const override {
-                if (sheet.GetCell(pos_ptr_) == nullptr) return 0.0;
-                auto value = sheet.GetCell(pos_ptr_)->GetValue();
-                if (std::holds_alternative<std::string>(value)) {
-                    try {
-                        return std::stod(std::get<std::string>(value));
-                    } catch (...) {
-                        return FormulaError::Category::Value;
+            // Arguments are args[0] ... args[count - 1] in order
+            uint32_t AddFunction(std::string_view name, const uint32_t* args, size_t count) {
+                auto it = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), name);
+                if (it == std::end(FUNCTION_NAMES)) throw ParsingError("Unknown function: " + std::string(name));
+                auto type = static_cast<FunctionType>(it - std::begin(FUNCTION_NAMES));
+                const Signature& signature = SIGNATURES[type];
+                if (count < signature.min_args || count > signature.max_args) {
+                    throw ParsingError("Wrong number of arguments: " + std::string(name));
+                }
+                for (size_t i = 0; i < count; i++) {
+                    const Node& arg = nodes_[args[i]];
+                    bool is_range = signature.ranges & (1u << i);
+                    bool is_text = signature.texts & (1u << i);
+                    if (is_range != (arg.type == NodeType::Range) || (!is_text && arg.type == NodeType::String)) {
+                        throw ParsingError("Wrong argument type: " + std::string(name));
                     }
-                } else if (std::holds_alternative<double>(value)) {
-                    return std::get<double>(value);
-                } else {
-                    return 0.0;
                 }
+                for (size_t i = 0; i + 1 < count; i++) {
+                    nodes_[args[i]].next = args[i + 1];
+                }
+                Node node;
+                node.type = NodeType::Function;
+                node.op = type;
+                node.first = count > 0 ? args[0] : NO_NODE;
+                return Add(node);
+            }
+
+            FormulaAST Build() {
+                return FormulaAST(std::move(nodes_), std::move(strings_), std::move(cells_), std::move(ranges_));
             }
 
         private:
-            const Position pos_ptr_;
+            uint32_t Add(const Node& node) {
+                if (nodes_.size() == max_nodes_) throw ParsingError("Formula is too big: more than " + std::to_string(max_nodes_) + " nodes");
+                nodes_.push_back(node);
+                return static_cast<uint32_t>(nodes_.size() - 1);
+            }
+
+            size_t max_nodes_;
+            size_t max_range_area_;
+            std::vector<Node> nodes_;
+            std::string strings_;
+            std::vector<Position> cells_;
+            std::vector<Range> ranges_;
         };
 
-        // Begin Of %%%%%%%%%% %%%%%%%%%% BinaryOpExpr %%%%%%%%%% %%%%%%%%%%
-        class BinaryOpExpr final : public Expr {
+        // Nesting of subexpressions being parsed, fails once it goes over the limit
+        class DepthCounter {
         public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
+            explicit DepthCounter(size_t max_depth)
+                : max_depth_(max_depth) {
+            }
 
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-            : type_(type)
-            , lhs_(std::move(lhs))
-            , rhs_(std::move(rhs)) {}
-
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
-
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-            }
-
-            [[nodiscard]] ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                    case Add:
-                        return EP_ADD;
-                    case Subtract:
-                        return EP_SUB;
-                    case Multiply:
-                        return EP_MUL;
-                    case Divide:
-                        return EP_DIV;
-                    default:
-                        // have to do this because VC++ has a buggy warning
-                        assert(false);
-                        return static_cast<ExprPrecedence>(INT_MAX);
-                }
+            void Enter() {
+                if (++depth_ > max_depth_) throw ParsingError("Formula is nested too deep: more than " + std::to_string(max_depth_) + " levels");
             }
 
-            // Evaluate() for binary
-            [[nodiscard]] CellInterface::Value Evaluate(const SheetInterface& sheet) const override {
-                if (std::holds_alternative<FormulaError>(lhs_->Evaluate(sheet)) || std::holds_alternative<FormulaError>(rhs_->Evaluate(sheet))) {
-                    return FormulaError(FormulaError::Category::Div0);
-                }
-                double result;
-                switch (type_) {
-                    case Add:
-                        result = std::get<double>(lhs_->Evaluate(sheet)) + std::get<double>(rhs_->Evaluate(sheet));
-                        if (!std::isinf(result)) {return result;}
-                        else {return FormulaError(FormulaError::Category::Div0);}
-                    case Subtract:
-                        result = std::get<double>(lhs_->Evaluate(sheet)) - std::get<double>(rhs_->Evaluate(sheet));
-                        if (!std::isinf(result)) {return result;}
-                        else {return FormulaError(FormulaError::Category::Div0);}
-                    case Multiply:
-                        result = std::get<double>(lhs_->Evaluate(sheet)) * std::get<double>(rhs_->Evaluate(sheet));
-                        if (!std::isinf(result)) {return result;}
-                        else {return FormulaError(FormulaError::Category::Div0);}
-                    case Divide:
-                        if (std::get<double>(rhs_->Evaluate(sheet)) < 1e-199 && std::get<double>(rhs_->Evaluate(sheet)) > -1e-199) {
-                            return FormulaError(FormulaError::Category::Div0);
-                        }
-                        return std::get<double>(lhs_->Evaluate(sheet)) / std::get<double>(rhs_->Evaluate(sheet));
-                    default:
-                        // have to do this because VC++ has a buggy warning
-                        assert(false);
-                        return 0.0; //static_cast<ExprPrecedence>(INT_MAX);
-                }
+            void Exit() {
+                depth_--;
             }
 
         private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
+            size_t max_depth_;
+            size_t depth_ = 0;
         };
 
-class UnaryOpExpr final : public Expr {
-public:
-    enum Type : char {
-        UnaryPlus = '+',
-        UnaryMinus = '-',
-    };
+        // Arguments of a function call: nodes of ranges and texts, values of scalar arguments in order. A text
+        // argument --a string or a cell holding text where the signature allows one-- takes a number too, 0
+        struct FunctionArgs {
+            const Node* nodes[MAX_FUNCTION_ARGS] = {};
+            size_t count = 0;
+            double numbers[MAX_FUNCTION_ARGS] = {};
+            size_t number_count = 0;
+            std::string_view strings; // String pool of the formula
+            std::optional<std::string> text; // Value of the text argument
+        };
 
-public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-        : type_(type)
-        , operand_(std::move(operand)) {
-    }
+        // Offset of the cell holding the text in a one-column or one-row range --exact match only
+        std::optional<int> FindTextInRange(const SheetInterface& sheet, Range range, std::string_view text, MatchMode mode) {
+            if (mode != MatchMode::Exact) return std::nullopt;
+            if (auto cache = sheet.GetLookupCache()) {
+                return cache->Get(range, sheet).FindText(text);
+            }
+            return LookupIndex(range, sheet).FindText(text);
+        }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
-    }
+        std::optional<int> FindValueInRange(const SheetInterface& sheet, Range range, const FunctionArgs& args, MatchMode mode) {
+            if (args.text) return FindTextInRange(sheet, range, *args.text, mode);
+            return FindInRange(sheet, range, args.numbers[0], mode);
+        }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
-    }
+        // VLOOKUP(value, table, column, [approximate = 1])
+        CellInterface::Value EvaluateVLookup(const SheetInterface& sheet, const FunctionArgs& args) {
+            const Range& table = args.nodes[1]->range;
+            int column = static_cast<int>(args.numbers[1]);
+            if (column < 1 || column > table.GetSize().cols) return FormulaError(FormulaError::Category::Ref);
+            MatchMode mode = args.number_count < 3 || args.numbers[2] != 0 ? MatchMode::NextSmaller : MatchMode::Exact;
+            auto offset = FindValueInRange(sheet, {table.from, {table.to.row, table.from.col}}, args, mode);
+            if (!offset) return FormulaError(FormulaError::Category::NA);
+            return EvaluateCell(sheet, {table.from.row + *offset, table.from.col + column - 1});
+        }
 
-    [[nodiscard]] ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
-    }
+        // MATCH(value, range, [type = 1]) --1: largest <= value, 0: exact, -1: smallest >= value
+        CellInterface::Value EvaluateMatch(const SheetInterface& sheet, const FunctionArgs& args) {
+            const Range& range = args.nodes[1]->range;
+            if (range.GetSize().rows != 1 && range.GetSize().cols != 1) return FormulaError(FormulaError::Category::NA);
+            double type = args.number_count < 2 ? 1 : args.numbers[1];
+            MatchMode mode = type > 0 ? MatchMode::NextSmaller : type < 0 ? MatchMode::NextLarger : MatchMode::Exact;
+            auto offset = FindValueInRange(sheet, range, args, mode);
+            if (!offset) return FormulaError(FormulaError::Category::NA);
+            return static_cast<double>(*offset + 1);
+        }
 
-// Evaluate() UnaryMinus
-    [[nodiscard]] CellInterface::Value Evaluate(const SheetInterface& sheet) const override {
-        if (type_ == Type::UnaryMinus) {
-            return -1 * std::get<double>(operand_->Evaluate(sheet));
+        // XLOOKUP(value, lookup range, return range, [mode = 0]) --0: exact, -1: next smaller, 1: next larger
+        CellInterface::Value EvaluateXLookup(const SheetInterface& sheet, const FunctionArgs& args) {
+            const Range& lookup = args.nodes[1]->range;
+            const Range& result = args.nodes[2]->range;
+            if (lookup.GetSize().rows != 1 && lookup.GetSize().cols != 1) return FormulaError(FormulaError::Category::Value);
+            if (!(lookup.GetSize() == result.GetSize())) return FormulaError(FormulaError::Category::Value);
+            double type = args.number_count < 2 ? 0 : args.numbers[1];
+            MatchMode mode = type < 0 ? MatchMode::NextSmaller : type > 0 ? MatchMode::NextLarger : MatchMode::Exact;
+            auto offset = FindValueInRange(sheet, lookup, args, mode);
+            if (!offset) return FormulaError(FormulaError::Category::NA);
+            if (result.GetSize().cols == 1) return EvaluateCell(sheet, {result.from.row + *offset, result.from.col});
+            return EvaluateCell(sheet, {result.from.row, result.from.col + *offset});
         }
-        return std::get<double>(operand_->Evaluate(sheet));
-    }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
-};
+        // SUMIF(range, criterion, [sum range]), COUNTIF(range, criterion), AVERAGEIF(range, criterion, [average range]).
+        // Selection bitmap of the criterion and numbers of the summed range come from the shared cache of the sheet
+        CellInterface::Value EvaluateConditional(const SheetInterface& sheet, FunctionType type, const FunctionArgs& args) {
+            const Range& range = args.nodes[0]->range;
+            Criterion criterion = args.text ? Criterion::Parse(*args.text) : Criterion::Number(args.numbers[0]);
+            Range sum_range = args.count > 2 ? args.nodes[2]->range : range;
+            if (!(sum_range.GetSize() == range.GetSize())) return FormulaError(FormulaError::Category::Value);
+
+            CriteriaIndexCache local_cache;
+            CriteriaIndexCache& cache = sheet.GetCriteriaCache() ? *sheet.GetCriteriaCache() : local_cache;
+            const auto& selection = cache.GetSelection(range, criterion, sheet).GetWords();
+            if (type == FT_COUNTIF) return static_cast<double>(MaskedCount(selection.data(), nullptr, selection.size()));
+
+            const ValueColumn& column = cache.GetValues(sum_range, sheet);
+            const auto& numeric = column.GetNumericWords();
+            double sum = MaskedSum(column.GetValues().data(), selection.data(), numeric.data(), selection.size());
+            if (type == FT_SUMIF) return sum;
+            size_t count = MaskedCount(selection.data(), numeric.data(), selection.size());
+            if (count == 0) return FormulaError(FormulaError::Category::Div0);
+            return sum / static_cast<double>(count);
+        }
 
-class NumberExpr final : public Expr {
-public:
-    explicit NumberExpr(double value)
-        : value_(value) {
-    }
+        CellInterface::Value EvaluateFunction(const SheetInterface& sheet, FunctionType type, const FunctionArgs& args) {
+            switch (type) {
+                case FT_VLOOKUP:
+                    return EvaluateVLookup(sheet, args);
+                case FT_MATCH:
+                    return EvaluateMatch(sheet, args);
+                case FT_XLOOKUP:
+                    return EvaluateXLookup(sheet, args);
+                case FT_SUMIF:
+                case FT_COUNTIF:
+                case FT_AVERAGEIF:
+                    return EvaluateConditional(sheet, type, args);
+                default:
+                    // have to do this because VC++ has a buggy warning
+                    assert(false);
+                    return 0.0;
+            }
+        }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
-    }
+        // Any error of an operand is reported as #DIV/0!, so is an overflow
+        CellInterface::Value EvaluateBinaryOp(char op, const CellInterface::Value& lhs_value, const CellInterface::Value& rhs_value) {
+            if (std::holds_alternative<FormulaError>(lhs_value) || std::holds_alternative<FormulaError>(rhs_value)) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            double lhs = std::get<double>(lhs_value);
+            double rhs = std::get<double>(rhs_value);
+            double result;
+            switch (op) {
+                case '+':
+                    result = lhs + rhs;
+                    break;
+                case '-':
+                    result = lhs - rhs;
+                    break;
+                case '*':
+                    result = lhs * rhs;
+                    break;
+                default:
+                    if (rhs < 1e-199 && rhs > -1e-199) {
+                        return FormulaError(FormulaError::Category::Div0);
+                    }
+                    return lhs / rhs;
+            }
+            if (std::isinf(result)) return FormulaError(FormulaError::Category::Div0);
+            return result;
+        }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
-    }
+        //// Nodes are in post order, so one pass over the array with a stack of values evaluates the formula:
+        //// operands of a node are on top of the stack when the node is reached
+        CellInterface::Value Evaluate(const std::vector<Node>& nodes, std::string_view strings, const SheetInterface& sheet) {
+            std::vector<CellInterface::Value> stack;
+            stack.reserve(nodes.size());
+            for (const Node& node : nodes) {
+                switch (node.type) {
+                    case NodeType::Number:
+                        stack.emplace_back(node.number);
+                        break;
+                    case NodeType::Cell:
+                        stack.push_back(EvaluateCell(sheet, node.range.from));
+                        break;
+                    case NodeType::Range:
+                    case NodeType::String:
+                        // no scalar value --read by the function they are passed to
+                        stack.emplace_back(FormulaError(FormulaError::Category::Value));
+                        break;
+                    case NodeType::UnaryOp:
+                        if (node.op == '-' && std::holds_alternative<double>(stack.back())) {
+                            stack.back() = -std::get<double>(stack.back());
+                        }
+                        break;
+                    case NodeType::BinaryOp: {
+                        CellInterface::Value rhs = std::move(stack.back());
+                        stack.pop_back();
+                        stack.back() = EvaluateBinaryOp(node.op, stack.back(), rhs);
+                        break;
+                    }
+                    case NodeType::Function: {
+                        FunctionArgs args;
+                        args.strings = strings;
+                        for (uint32_t arg = node.first; arg != NO_NODE; arg = nodes[arg].next) {
+                            args.nodes[args.count++] = &nodes[arg];
+                        }
+                        size_t base = stack.size() - args.count;
+                        std::optional<CellInterface::Value> error;
+                        unsigned texts = SIGNATURES[static_cast<FunctionType>(node.op)].texts;
+                        for (size_t i = 0; i < args.count; i++) {
+                            const Node& arg = *args.nodes[i];
+                            if (arg.type == NodeType::Range) continue;
+                            const auto& value = stack[base + i];
+                            if (texts & (1u << i)) {
+                                if (arg.type == NodeType::String) {
+                                    args.text = std::string(strings.substr(arg.text_offset, arg.text_size));
+                                } else if (arg.type == NodeType::Cell && std::holds_alternative<FormulaError>(value)) {
+                                    args.text = ReadLookupText(sheet.GetCell(arg.range.from));
+                                }
+                                if (args.text) {
+                                    args.numbers[args.number_count++] = 0;
+                                    continue;
+                                }
+                            }
+                            if (std::holds_alternative<FormulaError>(value)) {
+                                error = value;
+                                break;
+                            }
+                            args.numbers[args.number_count++] = std::get<double>(value);
+                        }
+                        stack.resize(base);
+                        stack.push_back(error ? *error : EvaluateFunction(sheet, static_cast<FunctionType>(node.op), args));
+                        break;
+                    }
+                }
+            }
+            assert(stack.size() == 1);
+            return stack.back();
+        }
 
-    [[nodiscard]] ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
-    }
+        // Step of the iterative printers: print a node or put a piece of text
+        struct PrintStep {
+            uint32_t node = NO_NODE; // NO_NODE: put text
+            std::string_view text;
+            ExprPrecedence parent_precedence = EP_ATOM;
+            bool right_child = false;
+        };
 
-// If number the method returns its value.
-    [[nodiscard]] CellInterface::Value Evaluate(const SheetInterface& sheet) const override {
-        return value_;
-    }
+        PrintStep TextStep(std::string_view text) {
+            return {NO_NODE, text, EP_ATOM, false};
+        }
 
-private:
-    double value_;
-};
+        PrintStep NodeStep(uint32_t node, ExprPrecedence parent_precedence = EP_ATOM, bool right_child = false) {
+            return {node, {}, parent_precedence, right_child};
+        }
 
+        // Arguments of a function in order
+        size_t GetArgs(const std::vector<Node>& nodes, const Node& function, uint32_t (&args)[MAX_FUNCTION_ARGS]) {
+            size_t count = 0;
+            for (uint32_t arg = function.first; arg != NO_NODE; arg = nodes[arg].next) {
+                args[count++] = arg;
+            }
+            return count;
+        }
+
+        // Steps of the printers are kept per thread, so printing allocates only until the stack is warm
+        std::vector<PrintStep>& GetPrintStack() {
+            thread_local std::vector<PrintStep> stack;
+            stack.clear();
+            return stack;
+        }
+
+        // Prints the tree as an S-expression: (+ A1 (- 2)). Steps are on an explicit stack, so the depth of
+        // the tree is not bounded by the native stack
+        void PrintNode(const std::vector<Node>& nodes, std::string_view strings, uint32_t root, std::ostream& out) {
+            auto& stack = GetPrintStack();
+            stack.push_back(NodeStep(root));
+            while (!stack.empty()) {
+                PrintStep step = stack.back();
+                stack.pop_back();
+                if (step.node == NO_NODE) {
+                    out << step.text;
+                    continue;
+                }
+                const Node& node = nodes[step.node];
+                switch (node.type) {
+                    case NodeType::Number:
+                        out << node.number;
+                        break;
+                    case NodeType::Cell:
+                        out << node.range.from.ToString();
+                        break;
+                    case NodeType::Range:
+                        out << node.range.ToString();
+                        break;
+                    case NodeType::String:
+                        out << '"' << strings.substr(node.text_offset, node.text_size) << '"';
+                        break;
+                    case NodeType::UnaryOp:
+                        out << '(' << node.op << ' ';
+                        stack.push_back(TextStep(")"));
+                        stack.push_back(NodeStep(node.first));
+                        break;
+                    case NodeType::BinaryOp:
+                        out << '(' << node.op << ' ';
+                        stack.push_back(TextStep(")"));
+                        stack.push_back(NodeStep(nodes[node.first].next));
+                        stack.push_back(TextStep(" "));
+                        stack.push_back(NodeStep(node.first));
+                        break;
+                    case NodeType::Function: {
+                        out << '(' << FUNCTION_NAMES[static_cast<size_t>(node.op)];
+                        uint32_t args[MAX_FUNCTION_ARGS];
+                        size_t count = GetArgs(nodes, node, args);
+                        stack.push_back(TextStep(")"));
+                        for (size_t i = count; i-- > 0;) {
+                            stack.push_back(NodeStep(args[i]));
+                            stack.push_back(TextStep(" "));
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+        //// Output of the formula printer: a caller's buffer, writes past its end are counted but dropped
+        class TextWriter {
+        public:
+            TextWriter(char* buffer, size_t size)
+                : buffer_(buffer)
+                , size_(size) {
+            }
+
+            void Put(char c) {
+                if (length_ < size_) buffer_[length_] = c;
+                length_++;
+            }
+
+            void Put(std::string_view text) {
+                if (length_ < size_) std::copy_n(text.data(), std::min(text.size(), size_ - length_), buffer_ + length_);
+                length_ += text.size();
+            }
+
+            // Same text as ostream << value: %g with 6 significant digits
+            void PutNumber(double value) {
+                char digits[32];
+                auto [ptr, ec] = std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::general, 6);
+                Put(std::string_view(digits, ptr - digits));
+            }
+
+            void PutPosition(Position pos) {
+                char text[Position::MAX_STRING_LENGTH];
+                Put(std::string_view(text, pos.ToChars(text)));
+            }
+
+            [[nodiscard]] size_t GetLength() const {
+                return length_;
+            }
+
+        private:
+            char* buffer_;
+            size_t size_;
+            size_t length_ = 0;
+        };
+
+        // Prints the tree as formula text with only the parentheses PRECEDENCE_RULES require.
+        // Iterative like PrintNode
+        void PrintNodeFormula(const std::vector<Node>& nodes, std::string_view strings, uint32_t root, TextWriter& out) {
+            auto& stack = GetPrintStack();
+            stack.push_back(NodeStep(root));
+            while (!stack.empty()) {
+                PrintStep step = stack.back();
+                stack.pop_back();
+                if (step.node == NO_NODE) {
+                    out.Put(step.text);
+                    continue;
+                }
+                const Node& node = nodes[step.node];
+                auto precedence = GetPrecedence(node);
+                auto mask = step.right_child ? PR_RIGHT : PR_LEFT;
+                if (PRECEDENCE_RULES[step.parent_precedence][precedence] & mask) {
+                    out.Put('(');
+                    stack.push_back(TextStep(")"));
+                }
+
+                switch (node.type) {
+                    case NodeType::Number:
+                        out.PutNumber(node.number);
+                        break;
+                    case NodeType::Cell:
+                        out.PutPosition(node.range.from);
+                        break;
+                    case NodeType::Range:
+                        out.PutPosition(node.range.from);
+                        out.Put(':');
+                        out.PutPosition(node.range.to);
+                        break;
+                    case NodeType::String:
+                        out.Put('"');
+                        out.Put(strings.substr(node.text_offset, node.text_size));
+                        out.Put('"');
+                        break;
+                    case NodeType::UnaryOp:
+                        out.Put(node.op);
+                        stack.push_back(NodeStep(node.first, precedence));
+                        break;
+                    case NodeType::BinaryOp:
+                        stack.push_back(NodeStep(nodes[node.first].next, precedence, /* right_child = */ true));
+                        stack.push_back(TextStep(std::string_view(&node.op, 1)));
+                        stack.push_back(NodeStep(node.first, precedence));
+                        break;
+                    case NodeType::Function: {
+                        out.Put(FUNCTION_NAMES[static_cast<size_t>(node.op)]);
+                        out.Put('(');
+                        uint32_t args[MAX_FUNCTION_ARGS];
+                        size_t count = GetArgs(nodes, node, args);
+                        stack.push_back(TextStep(")"));
+                        for (size_t i = count; i-- > 0;) {
+                            stack.push_back(NodeStep(args[i]));
+                            if (i > 0) stack.push_back(TextStep(","));
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
+//// Builds the flat AST from exit events in post order. Reads only the tokens of each context, so it works
+//// as a parse listener with setBuildParseTree(false): rule contexts are never linked into a tree
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
-
-        return root;
+    explicit ParseASTListener(const FormulaLimits& limits)
+        : builder_(limits.max_nodes, limits.max_range_area)
+        , depth_(limits.max_depth) {
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    FormulaAST Build() {
+        assert(args_.size() == 1);
+        args_.clear();
+        return builder_.Build();
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(!args_.empty());
 
-        auto operand = std::move(args_.back());
-
-        UnaryOpExpr::Type type;
+        char op;
         if (ctx->SUB()) {
-            type = UnaryOpExpr::UnaryMinus;
+            op = '-';
         } else {
             assert(ctx->ADD() != nullptr);
-            type = UnaryOpExpr::UnaryPlus;
+            op = '+';
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = {builder_.AddUnaryOp(op, args_.back().node), GetStart(ctx)};
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -330,50 +707,91 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back({builder_.AddNumber(value), GetStart(ctx)});
     }
 
     void exitCell(FormulaParser::CellContext* cell_context) override {
         auto str = cell_context->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(str);
-        cells_.push_front(value);
-
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        args_.push_back({builder_.AddCell(Position::FromString(str)), GetStart(cell_context)});
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back().node;
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back().node;
 
-        BinaryOpExpr::Type type;
+        char op;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            op = '+';
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            op = '-';
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            op = '*';
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            op = '/';
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = {builder_.AddBinaryOp(op, lhs, rhs), GetStart(ctx)};
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        args_.push_back({builder_.AddRange(Position::FromString(ctx->CELL(0)->getSymbol()->getText()),
+                                           Position::FromString(ctx->CELL(1)->getSymbol()->getText())),
+                         GetStart(ctx)});
+    }
+
+    void exitString(FormulaParser::StringContext* ctx) override {
+        auto text = ctx->STRING()->getSymbol()->getText();
+        args_.push_back({builder_.AddString(std::string_view(text).substr(1, text.size() - 2)), GetStart(ctx)});
+    }
+
+    // Arguments are the pending nodes that start after the function name --ctx->arg() is empty without a parse tree
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        size_t start = GetStart(ctx);
+        size_t count = 0;
+        while (count < args_.size() && args_[args_.size() - count - 1].start > start) count++;
+
+        uint32_t nodes[MAX_FUNCTION_ARGS];
+        if (count > MAX_FUNCTION_ARGS) throw ParsingError("Wrong number of arguments: " + ctx->FUNCTION()->getSymbol()->getText());
+        for (size_t i = 0; i < count; i++) nodes[i] = args_[args_.size() - count + i].node;
+
+        auto node = builder_.AddFunction(ctx->FUNCTION()->getSymbol()->getText(), nodes, count);
+        args_.resize(args_.size() - count);
+        args_.push_back({node, start});
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
+    // Every invocation of the expr rule is one level of recursion in the generated parser --counted as a parse
+    // listener this stops the descent before the stack runs out. Iterations over a left-recursive chain are balanced
+    void enterEveryRule(antlr4::ParserRuleContext* ctx) override {
+        if (ctx->getRuleIndex() == FormulaParser::RuleExpr) depth_.Enter();
+    }
+
+    void exitEveryRule(antlr4::ParserRuleContext* ctx) override {
+        if (ctx->getRuleIndex() == FormulaParser::RuleExpr) depth_.Exit();
+    }
+
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    // Node not attached to a parent yet and the index of its first token
+    struct Pending {
+        uint32_t node;
+        size_t start;
+    };
+
+    static size_t GetStart(antlr4::ParserRuleContext* ctx) {
+        return ctx->getStart()->getTokenIndex();
+    }
+
+    NodeBuilder builder_;
+    DepthCounter depth_;
+    std::vector<Pending> args_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -386,69 +804,689 @@ public:
     }
 };
 
+
+//// Hand-written lexer for Formula.g4: tokens are views into the input, nothing is allocated
+class FastLexer {
+public:
+    enum TokenType {
+        TT_END,
+        TT_NUMBER,
+        TT_CELL,
+        TT_FUNCTION,
+        TT_STRING,
+        TT_ADD,
+        TT_SUB,
+        TT_MUL,
+        TT_DIV,
+        TT_LPAREN,
+        TT_RPAREN,
+        TT_COMMA,
+        TT_COLON,
+    };
+
+    struct Token {
+        TokenType type = TT_END;
+        std::string_view text;
+    };
+
+public:
+    explicit FastLexer(std::string_view input)
+        : input_(input) {
+        current_ = Lex();
+        next_ = Lex();
+    }
+
+    [[nodiscard]] const Token& Peek() const {
+        return current_;
+    }
+
+    [[nodiscard]] const Token& PeekNext() const {
+        return next_;
+    }
+
+    Token Consume() {
+        Token token = current_;
+        current_ = next_;
+        next_ = Lex();
+        return token;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < input_.size() && IsDigit(input_[pos])) pos++;
+        return pos;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT? --the longest match like the ANTLR lexer
+    size_t LexNumber(size_t pos) const {
+        size_t end = SkipDigits(pos);
+        if (end < input_.size() && input_[end] == '.') {
+            size_t fraction = SkipDigits(end + 1);
+            if (fraction == end + 1) {
+                if (end == pos) throw ParsingError("Error when lexing: unexpected '.'");
+                return end;
+            }
+            end = fraction;
+        }
+        if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) exponent++;
+            size_t exponent_end = SkipDigits(exponent);
+            if (exponent_end != exponent) end = exponent_end;
+        }
+        return end;
+    }
+
+    Token Lex() {
+        while (pos_ < input_.size() && (input_[pos_] == ' ' || input_[pos_] == '\t' || input_[pos_] == '\n' || input_[pos_] == '\r')) {
+            pos_++;
+        }
+        if (pos_ == input_.size()) return {TT_END, {}};
+
+        size_t start = pos_;
+        char c = input_[pos_];
+        TokenType type;
+        if (IsDigit(c) || c == '.') {
+            pos_ = LexNumber(pos_);
+            type = TT_NUMBER;
+        } else if (IsUpper(c)) {
+            while (pos_ < input_.size() && IsUpper(input_[pos_])) pos_++;
+            size_t digits = SkipDigits(pos_);
+            type = digits == pos_ ? TT_FUNCTION : TT_CELL;
+            pos_ = digits;
+        } else if (c == '"') {
+            size_t end = input_.find('"', pos_ + 1);
+            if (end == std::string_view::npos) throw ParsingError("Error when lexing: unterminated string");
+            pos_ = end + 1;
+            type = TT_STRING;
+        } else {
+            switch (c) {
+                case '+': type = TT_ADD; break;
+                case '-': type = TT_SUB; break;
+                case '*': type = TT_MUL; break;
+                case '/': type = TT_DIV; break;
+                case '(': type = TT_LPAREN; break;
+                case ')': type = TT_RPAREN; break;
+                case ',': type = TT_COMMA; break;
+                case ':': type = TT_COLON; break;
+                default: throw ParsingError(std::string("Error when lexing: unexpected '") + c + "'");
+            }
+            pos_++;
+        }
+        return {type, input_.substr(start, pos_ - start)};
+    }
+
+    std::string_view input_;
+    size_t pos_ = 0;
+    Token current_;
+    Token next_;
+};
+
+//// Pratt parser for Formula.g4. Builds the same nodes as ParseASTListener, precedences follow the
+//// order of the grammar alternatives: unary > MUL/DIV > ADD/SUB, binary operators are left associative
+class PrattParser {
+public:
+    PrattParser(std::string_view input, const FormulaLimits& limits)
+        : lexer_(input)
+        , builder_(limits.max_nodes, limits.max_range_area)
+        , depth_(limits.max_depth) {
+    }
+
+    FormulaAST Parse() {
+        ParseExpr(0);
+        Expect(FastLexer::TT_END, "end of formula");
+        return builder_.Build();
+    }
+
+private:
+    // {left binding power, right binding power} of a binary operator --0 if the token is not one
+    static std::pair<int, int> GetBindingPower(FastLexer::TokenType type) {
+        switch (type) {
+            case FastLexer::TT_ADD:
+            case FastLexer::TT_SUB:
+                return {1, 2};
+            case FastLexer::TT_MUL:
+            case FastLexer::TT_DIV:
+                return {3, 4};
+            default:
+                return {0, 0};
+        }
+    }
+
+    static constexpr int UNARY_POWER = 5;
+
+    FastLexer::Token Expect(FastLexer::TokenType type, const char* what) {
+        if (lexer_.Peek().type != type) {
+            throw ParsingError("Error when parsing: expected " + std::string(what) + " at '" + std::string(lexer_.Peek().text) + "'");
+        }
+        return lexer_.Consume();
+    }
+
+    // Operands of a chain of binary operators are parsed in the loop, only subexpressions recurse
+    uint32_t ParseExpr(int min_power) {
+        depth_.Enter();
+        auto lhs = ParsePrefix();
+        while (true) {
+            auto type = lexer_.Peek().type;
+            auto [left_power, right_power] = GetBindingPower(type);
+            if (left_power == 0 || left_power < min_power) break;
+            lexer_.Consume();
+            auto rhs = ParseExpr(right_power);
+            lhs = builder_.AddBinaryOp(ToOperator(type), lhs, rhs);
+        }
+        depth_.Exit();
+        return lhs;
+    }
+
+    static char ToOperator(FastLexer::TokenType type) {
+        switch (type) {
+            case FastLexer::TT_ADD: return '+';
+            case FastLexer::TT_SUB: return '-';
+            case FastLexer::TT_MUL: return '*';
+            default: return '/';
+        }
+    }
+
+    uint32_t ParsePrefix() {
+        FastLexer::Token token = lexer_.Consume();
+        switch (token.type) {
+            case FastLexer::TT_NUMBER: {
+                double value = 0;
+                auto [ptr, ec] = std::from_chars(token.text.data(), token.text.data() + token.text.size(), value);
+                if (ec != std::errc() || ptr != token.text.data() + token.text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(token.text));
+                }
+                return builder_.AddNumber(value);
+            }
+            case FastLexer::TT_CELL:
+                return builder_.AddCell(Position::FromString(token.text));
+            case FastLexer::TT_STRING:
+                return builder_.AddString(token.text.substr(1, token.text.size() - 2));
+            case FastLexer::TT_ADD:
+            case FastLexer::TT_SUB: {
+                auto operand = ParseExpr(UNARY_POWER);
+                return builder_.AddUnaryOp(token.type == FastLexer::TT_SUB ? '-' : '+', operand);
+            }
+            case FastLexer::TT_LPAREN: {
+                auto expr = ParseExpr(0);
+                Expect(FastLexer::TT_RPAREN, "')'");
+                return expr;
+            }
+            case FastLexer::TT_FUNCTION: {
+                Expect(FastLexer::TT_LPAREN, "'('");
+                uint32_t args[MAX_FUNCTION_ARGS];
+                size_t count = 0;
+                if (lexer_.Peek().type != FastLexer::TT_RPAREN) {
+                    while (true) {
+                        if (count == MAX_FUNCTION_ARGS) throw ParsingError("Wrong number of arguments: " + std::string(token.text));
+                        args[count++] = ParseArg();
+                        if (lexer_.Peek().type != FastLexer::TT_COMMA) break;
+                        lexer_.Consume();
+                    }
+                }
+                Expect(FastLexer::TT_RPAREN, "')'");
+                return builder_.AddFunction(token.text, args, count);
+            }
+            default:
+                throw ParsingError("Error when parsing: unexpected '" + std::string(token.text) + "'");
+        }
+    }
+
+    // arg: CELL ':' CELL | expr
+    uint32_t ParseArg() {
+        if (lexer_.Peek().type != FastLexer::TT_CELL || lexer_.PeekNext().type != FastLexer::TT_COLON) {
+            return ParseExpr(0);
+        }
+        auto from = Position::FromString(lexer_.Consume().text);
+        lexer_.Consume();
+        auto to = Position::FromString(Expect(FastLexer::TT_CELL, "cell").text);
+        return builder_.AddRange(from, to);
+    }
+
+    FastLexer lexer_;
+    NodeBuilder builder_;
+    DepthCounter depth_;
+};
+}  // namespace
+}  // namespace ASTImpl
+
+namespace ASTImpl {
+namespace {
+
+//// ANTLR objects reused by every parse on a thread. Reset between inputs instead of being rebuilt;
+//// the DFA cache behind the ATN simulators is static and shared by all threads
+class AntlrParserContext {
+public:
+    AntlrParserContext()
+        : lexer_(&ascii_input_)
+        , tokens_(&lexer_)
+        , parser_(&tokens_)
+        , error_handler_(std::make_shared<antlr4::BailErrorStrategy>()) {
+        lexer_.removeErrorListeners();
+        lexer_.addErrorListener(&error_listener_);
+        parser_.setErrorHandler(error_handler_);
+        parser_.removeErrorListeners();
+        parser_.setBuildParseTree(false);
+    }
+
+    // SLL prediction is enough for almost every formula, full LL is tried only if SLL fails
+    FormulaAST Parse(std::string_view text) {
+        using namespace antlr4;
+        try {
+            Reset(text, atn::PredictionMode::SLL);
+            return BuildAST();
+        } catch (const ParseCancellationException&) {
+            Reset(text, atn::PredictionMode::LL);
+            return BuildAST();
+        }
+    }
+
+private:
+    // Nodes are appended by a parse listener as rules are exited --the parse tree is neither built nor walked
+    FormulaAST BuildAST() {
+        ParseASTListener listener(GetFormulaLimits());
+        parser_.addParseListener(&listener);
+        try {
+            parser_.main();
+        } catch (...) {
+            parser_.removeParseListeners();
+            throw;
+        }
+        parser_.removeParseListeners();
+        return listener.Build();
+    }
+
+    // ASCII text is lexed in place, anything else is validated as UTF-8 and decoded by ANTLRInputStream
+    void Reset(std::string_view text, antlr4::atn::PredictionMode mode) {
+        if (AsciiCharStream::IsAscii(text)) {
+            ascii_input_.Load(text);
+            lexer_.setInputStream(&ascii_input_);
+        } else {
+            input_.load(text.data(), text.size());
+            lexer_.setInputStream(&input_);
+        }
+        tokens_.setTokenSource(&lexer_);
+        parser_.setTokenStream(&tokens_);
+        parser_.getInterpreter<antlr4::atn::ParserATNSimulator>()->setPredictionMode(mode);
+    }
+
+    AsciiCharStream ascii_input_;
+    antlr4::ANTLRInputStream input_;
+    FormulaLexer lexer_;
+    antlr4::CommonTokenStream tokens_;
+    FormulaParser parser_;
+    BailErrorListener error_listener_;
+    std::shared_ptr<antlr4::BailErrorStrategy> error_handler_;
+};
+
+AntlrParserContext& GetAntlrParserContext() {
+    thread_local AntlrParserContext context;
+    return context;
+}
+
+//// Compiled form of a formula: the nodes in post order, each as a type byte and its payload --number,
+//// cell, range corners, string, operator or function with its argument count. Children are not stored,
+//// they are the subtrees on top of the stack when the node is read. Positions are signed 16-bit offsets
+//// from an origin, so the same pattern of references compiles to the same bytes in every cell
+class CompiledWriter {
+public:
+    CompiledWriter(std::string& out, Position origin)
+        : out_(out)
+        , origin_(origin) {
+    }
+
+    template <typename T>
+    void Put(T value) {
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void PutPosition(Position pos) {
+        Put(static_cast<int16_t>(pos.row - origin_.row));
+        Put(static_cast<int16_t>(pos.col - origin_.col));
+    }
+
+    void PutText(std::string_view text) {
+        Put(static_cast<uint32_t>(text.size()));
+        out_.append(text);
+    }
+
+private:
+    std::string& out_;
+    Position origin_;
+};
+
+class CompiledReader {
+public:
+    CompiledReader(std::string_view data, Position origin)
+        : data_(data)
+        , origin_(origin) {
+    }
+
+    template <typename T>
+    T Get() {
+        T value;
+        std::memcpy(&value, Take(sizeof(value)).data(), sizeof(value));
+        return value;
+    }
+
+    Position GetPosition() {
+        int row = origin_.row + Get<int16_t>();
+        int col = origin_.col + Get<int16_t>();
+        return {row, col};
+    }
+
+    std::string_view GetText() {
+        return Take(Get<uint32_t>());
+    }
+
+    [[nodiscard]] bool AtEnd() const {
+        return data_.empty();
+    }
+
+private:
+    std::string_view Take(size_t size) {
+        if (size > data_.size()) throw ParsingError("Damaged compiled formula: unexpected end");
+        std::string_view result = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return result;
+    }
+
+    std::string_view data_;
+    Position origin_;
+};
+
+void WriteCompiled(const std::vector<Node>& nodes, std::string_view strings, Position origin, std::string& out) {
+    CompiledWriter writer(out, origin);
+    for (const Node& node : nodes) {
+        writer.Put(node.type);
+        switch (node.type) {
+            case NodeType::Number:
+                writer.Put(node.number);
+                break;
+            case NodeType::Cell:
+                writer.PutPosition(node.range.from);
+                break;
+            case NodeType::Range:
+                writer.PutPosition(node.range.from);
+                writer.PutPosition(node.range.to);
+                break;
+            case NodeType::String:
+                writer.PutText(strings.substr(node.text_offset, node.text_size));
+                break;
+            case NodeType::UnaryOp:
+            case NodeType::BinaryOp:
+                writer.Put(node.op);
+                break;
+            case NodeType::Function: {
+                uint8_t count = 0;
+                for (uint32_t arg = node.first; arg != NO_NODE; arg = nodes[arg].next) count++;
+                writer.Put(node.op);
+                writer.Put(count);
+                break;
+            }
+        }
+    }
+}
+
+// Replays the instructions through NodeBuilder, so a damaged form fails the same checks as a parsed formula
+FormulaAST ReadCompiled(std::string_view data, Position origin) {
+    CompiledReader reader(data, origin);
+    NodeBuilder builder(NO_NODE, SIZE_MAX); // Limits were checked when the formula was parsed
+    std::vector<uint32_t> operands; // Roots of the subtrees not used yet
+    auto pop = [&operands]() {
+        if (operands.empty()) throw ParsingError("Damaged compiled formula: missing operand");
+        uint32_t node = operands.back();
+        operands.pop_back();
+        return node;
+    };
+    auto is_operator = [](char op) {
+        return op == '+' || op == '-' || op == '*' || op == '/';
+    };
+    try {
+        while (!reader.AtEnd()) {
+            switch (reader.Get<NodeType>()) {
+                case NodeType::Number:
+                    operands.push_back(builder.AddNumber(reader.Get<double>()));
+                    break;
+                case NodeType::Cell:
+                    operands.push_back(builder.AddCell(reader.GetPosition()));
+                    break;
+                case NodeType::Range: {
+                    Position from = reader.GetPosition();
+                    operands.push_back(builder.AddRange(from, reader.GetPosition()));
+                    break;
+                }
+                case NodeType::String:
+                    operands.push_back(builder.AddString(reader.GetText()));
+                    break;
+                case NodeType::UnaryOp: {
+                    char op = reader.Get<char>();
+                    if (op != '+' && op != '-') throw ParsingError("Damaged compiled formula: unknown operator");
+                    operands.push_back(builder.AddUnaryOp(op, pop()));
+                    break;
+                }
+                case NodeType::BinaryOp: {
+                    char op = reader.Get<char>();
+                    if (!is_operator(op)) throw ParsingError("Damaged compiled formula: unknown operator");
+                    uint32_t rhs = pop();
+                    uint32_t lhs = pop();
+                    operands.push_back(builder.AddBinaryOp(op, lhs, rhs));
+                    break;
+                }
+                case NodeType::Function: {
+                    auto type = reader.Get<uint8_t>();
+                    auto count = reader.Get<uint8_t>();
+                    if (type >= FT_END) throw ParsingError("Damaged compiled formula: unknown function");
+                    if (count > MAX_FUNCTION_ARGS || count > operands.size()) throw ParsingError("Damaged compiled formula: missing argument");
+                    uint32_t args[MAX_FUNCTION_ARGS];
+                    std::copy(operands.end() - count, operands.end(), args);
+                    operands.resize(operands.size() - count);
+                    operands.push_back(builder.AddFunction(FUNCTION_NAMES[type], args, count));
+                    break;
+                }
+                default:
+                    throw ParsingError("Damaged compiled formula: unknown node");
+            }
+        }
+    } catch (const FormulaError&) {
+        throw ParsingError("Damaged compiled formula: invalid position");
+    }
+    if (operands.size() != 1) throw ParsingError("Damaged compiled formula: unbalanced nodes");
+    return builder.Build();
+}
+
 }  // namespace
 }  // namespace ASTImpl
 
+namespace {
+    std::atomic<size_t> max_formula_length{FormulaLimits{}.max_length};
+    std::atomic<size_t> max_formula_nodes{FormulaLimits{}.max_nodes};
+    std::atomic<size_t> max_formula_depth{FormulaLimits{}.max_depth};
+    std::atomic<size_t> max_formula_range_area{FormulaLimits{}.max_range_area};
+
+    void CheckLength(std::string_view in) {
+        size_t max_length = max_formula_length;
+        if (in.size() > max_length) throw ParsingError("Formula is too long: more than " + std::to_string(max_length) + " chars");
+    }
+}  // namespace
+
+void SetFormulaLimits(FormulaLimits limits) {
+    max_formula_length = limits.max_length;
+    max_formula_nodes = limits.max_nodes;
+    max_formula_depth = limits.max_depth;
+    max_formula_range_area = limits.max_range_area;
+}
+
+FormulaLimits GetFormulaLimits() {
+    return {max_formula_length, max_formula_nodes, max_formula_depth, max_formula_range_area};
+}
+
+FormulaAST ParseFormulaASTAntlr(std::string_view in) {
+    CheckLength(in);
+    return ASTImpl::GetAntlrParserContext().Parse(in);
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
+    std::string text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return ParseFormulaASTAntlr(text);
+}
 
-    ANTLRInputStream input(in);
+void WarmUpFormulaParser(const std::vector<std::string>& corpus) {
+    static const std::vector<std::string> DEFAULT_CORPUS = {
+        "1", "A1", "-A1", "A1+B2", "A1-B2*C3", "(A1+B2)/C3", "1.5e-3*A1", "+(A1-2)/-B1",
+        "VLOOKUP(A1, B1:C100, 2, 0)", "MATCH(1, A1:A10)", "XLOOKUP(A1, B1:B9, C1:C9, -1)",
+        "SUMIF(A1:A10, \">5\", B1:B10)", "COUNTIF(A1:A10, \"x\")", "AVERAGEIF(A1:A10, 3)",
+    };
+    for (const auto& formula : corpus.empty() ? DEFAULT_CORPUS : corpus) {
+        try {
+            ParseFormulaASTAntlr(formula);
+        } catch (...) {
+            // invalid formulas warm up the DFA as well
+        }
+    }
+}
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+namespace {
+    std::atomic<ParserMode> parser_mode{ParserMode::Fast};
+
+    // Runs both parsers, throws ParserMismatchError if they disagree
+    FormulaAST ParseFormulaASTDifferential(const std::string& in_str) {
+        std::optional<FormulaAST> fast;
+        std::exception_ptr fast_error;
+        try {
+            fast.emplace(ParseFormulaASTFast(in_str));
+        } catch (...) {
+            fast_error = std::current_exception();
+        }
 
-    CommonTokenStream tokens(&lexer);
+        std::optional<FormulaAST> reference;
+        std::exception_ptr reference_error;
+        try {
+            reference.emplace(ParseFormulaASTAntlr(in_str));
+        } catch (...) {
+            reference_error = std::current_exception();
+        }
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+        if (fast.has_value() != reference.has_value()) {
+            throw ParserMismatchError("Parsers disagree on validity of: " + in_str);
+        }
+        if (!reference) std::rethrow_exception(reference_error);
+
+        std::ostringstream fast_tree;
+        std::ostringstream reference_tree;
+        fast->Print(fast_tree);
+        reference->Print(reference_tree);
+        if (fast_tree.str() != reference_tree.str() || fast->GetCells() != reference->GetCells() || fast->GetRanges() != reference->GetRanges()) {
+            throw ParserMismatchError("Parsers disagree on: " + in_str + " --" + fast_tree.str() + " vs " + reference_tree.str());
+        }
+        return std::move(*reference);
+    }
+}  // namespace
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+FormulaAST ParseFormulaASTFast(std::string_view in) {
+    CheckLength(in);
+    return ASTImpl::PrattParser(in, GetFormulaLimits()).Parse();
+}
+
+void SetParserMode(ParserMode mode) {
+    parser_mode = mode;
+}
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+ParserMode GetParserMode() {
+    return parser_mode;
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
     try {
-        return ParseFormulaAST(in);
+        switch (GetParserMode()) {
+            case ParserMode::Fast:
+                return ParseFormulaASTFast(in_str);
+            case ParserMode::Differential:
+                return ParseFormulaASTDifferential(in_str);
+            default:
+                return ParseFormulaASTAntlr(in_str);
+        }
+    } catch (const ParserMismatchError&) {
+        throw;
     } catch (const std::exception& exc) {
         std::throw_with_nested(FormulaException(exc.what()));
     }
 }
 
+FormulaAST DeserializeFormulaAST(std::string_view data, Position origin) {
+    return ASTImpl::ReadCompiled(data, origin);
+}
+
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::PrintNode(nodes_, strings_, static_cast<uint32_t>(nodes_.size() - 1), out);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    out << expression_;
+}
+
+size_t FormulaAST::PrintFormula(char* buffer, size_t size) const {
+    ASTImpl::TextWriter out(buffer, size);
+    ASTImpl::PrintNodeFormula(nodes_, strings_, static_cast<uint32_t>(nodes_.size() - 1), out);
+    return out.GetLength();
+}
+
+const std::string& FormulaAST::GetExpression() const {
+    return expression_;
 }
 
 CellInterface::Value FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    return ASTImpl::Evaluate(nodes_, strings_, sheet);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position>  cells)
-    : root_expr_(std::move(root_expr))  {
-    auto temp_cells = std::move(cells);
-    for (auto cell : temp_cells) {
-        if (!std::count(cells_.begin(), cells_.end(), cell)) cells_.push_front(cell);
+FormulaAST::FormulaAST(std::vector<ASTImpl::Node> nodes, std::string strings, std::vector<Position> cells, std::vector<Range> ranges)
+    : nodes_(std::move(nodes))
+    , strings_(std::move(strings))
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
+    std::sort(cells_.begin(), cells_.end());
+    cells_.erase(std::unique(cells_.begin(), cells_.end()), cells_.end());
+    std::sort(ranges_.begin(), ranges_.end());
+    ranges_.erase(std::unique(ranges_.begin(), ranges_.end()), ranges_.end());
+
+    char buffer[256];
+    size_t length = PrintFormula(buffer, sizeof(buffer));
+    if (length <= sizeof(buffer)) {
+        expression_.assign(buffer, length);
+    } else {
+        expression_.resize(length);
+        PrintFormula(expression_.data(), length);
     }
-    cells_.sort();
 }
 
-[[maybe_unused]] std::forward_list<Position>& FormulaAST::GetCells() {
+[[maybe_unused]] std::vector<Position>& FormulaAST::GetCells() {
     return cells_;
 }
 
-const std::forward_list<Position>& FormulaAST::GetCells() const {
+const std::vector<Position>& FormulaAST::GetCells() const {
     return cells_;
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+const std::vector<Range>& FormulaAST::GetRanges() const {
+    return ranges_;
+}
+
+const std::vector<ASTImpl::Node>& FormulaAST::GetNodes() const {
+    return nodes_;
+}
+
+const std::string& FormulaAST::GetStrings() const {
+    return strings_;
+}
+
+void FormulaAST::Serialize(std::string& out, Position origin) const {
+    ASTImpl::WriteCompiled(nodes_, strings_, origin, out);
+}
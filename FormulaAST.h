@@ -1,27 +1,69 @@
 #pragma once
 #include "FormulaLexer.h"
 #include "common.h"
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 namespace ASTImpl {
-    class Expr;
+    enum class NodeType : uint8_t {
+        Number,
+        Cell,
+        Range,
+        String,
+        UnaryOp,
+        BinaryOp,
+        Function,
+    };
+
+    inline constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    //// Node of the flat AST. Nodes of a formula live in one array in post order --operands before the
+    //// operator, the root is the last node. Children are indices into the array: an operator or a function
+    //// points to its first operand, operands are chained through next
+    struct Node {
+        NodeType type = NodeType::Number;
+        char op = 0; // '+', '-', '*', '/' of an operator, function type of a function
+        uint32_t first = NO_NODE; // First operand or argument
+        uint32_t next = NO_NODE; // Right operand of a binary operator, next argument of a function
+        uint32_t text_offset = 0; // String: text in the string pool of the formula
+        uint32_t text_size = 0;
+        double number = 0; // Number
+        Range range; // Range, Cell --from only
+    };
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
-class FormulaAST {
+// Thrown in ParserMode::Differential if the fast parser and ANTLR build different trees
+class ParserMismatchError : public std::logic_error {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position>  cells);
+    using std::logic_error::logic_error;
+};
 
-    FormulaAST(FormulaAST&&) = default;
+// Fast: hand-written Pratt parser. Antlr: reference parser generated from Formula.g4.
+// Differential: runs both and checks they agree on every formula --for tests
+enum class ParserMode {
+    Fast,
+    Antlr,
+    Differential,
+};
 
-    FormulaAST& operator=(FormulaAST&&) = default;
+// Limits of a formula, checked while parsing so oversized formulas are rejected before they are built
+struct FormulaLimits {
+    size_t max_length = size_t{1} << 22; // Chars of the formula text
+    size_t max_nodes = size_t{1} << 20; // Operands, operators and function calls
+    size_t max_depth = 1024; // Nesting of subexpressions: parentheses, unary operators, function arguments
+    size_t max_range_area = size_t{1} << 20; // Cells of a range --rows times columns
+};
 
-    ~FormulaAST();
+class FormulaAST {
+public:
+    explicit FormulaAST(std::vector<ASTImpl::Node> nodes, std::string strings, std::vector<Position> cells, std::vector<Range> ranges);
 
     [[nodiscard]] CellInterface::Value Execute(const SheetInterface& sheet) const; // Executes all Cells in the sheet
 
@@ -29,15 +71,55 @@ public:
 
     void PrintFormula(std::ostream& out) const; // Prints formula
 
-    [[maybe_unused]] std::forward_list<Position>& GetCells(); // Cells that affect the formula --cells_
+    // Writes the formula text to the buffer without allocating and returns its full length.
+    // Output is cut at size --print again into a buffer of the returned length if it was bigger
+    size_t PrintFormula(char* buffer, size_t size) const;
+
+    [[nodiscard]] const std::string& GetExpression() const; // Formula text, printed once when the AST is built
+
+    [[maybe_unused]] std::vector<Position>& GetCells(); // Cells referenced one by one --sorted, unique
+
+    [[nodiscard]] const std::vector<Position>& GetCells() const; // Cells referenced one by one --sorted, unique
 
-    [[nodiscard]] const std::forward_list<Position>& GetCells() const; // Cells that affect the formula --cells_
+    // Ranges of function arguments --sorted, unique. Their cells aren't listed by GetCells()
+    [[nodiscard]] const std::vector<Range>& GetRanges() const;
+
+    [[nodiscard]] const std::vector<ASTImpl::Node>& GetNodes() const; // Post order, the root is the last node
+
+    [[nodiscard]] const std::string& GetStrings() const; // Texts of string literals back to back
+
+    // Appends the compiled form: one instruction per node in post order, read back by DeserializeFormulaAST.
+    // Positions are stored relative to origin --the cell of the formula in snapshots
+    void Serialize(std::string& out, Position origin = {0, 0}) const;
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    std::vector<ASTImpl::Node> nodes_;
+    std::string strings_;
+    std::vector<Position> cells_;
+    std::vector<Range> ranges_;
+    std::string expression_;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
+FormulaAST ParseFormulaAST(std::istream& in); // ANTLR parser
+
+FormulaAST ParseFormulaASTAntlr(std::string_view in); // ANTLR parser of the calling thread --reused between calls
+
+FormulaAST ParseFormulaAST(const std::string& in_str); // Parser selected by SetParserMode(), errors are nested into FormulaException
+
+FormulaAST ParseFormulaASTFast(std::string_view in); // Pratt parser
+
+// Rebuilds the AST from FormulaAST::Serialize() output for the same origin without parsing. Throws ParsingError
+// if the data is damaged or a position falls outside the sheet
+FormulaAST DeserializeFormulaAST(std::string_view data, Position origin = {0, 0});
+
+void SetParserMode(ParserMode mode); // Process-wide, Fast by default
+
+void SetFormulaLimits(FormulaLimits limits); // Process-wide, applied by every parser --formulas parsed before are kept
+
+FormulaLimits GetFormulaLimits();
+
+ParserMode GetParserMode();
 
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// Parses a corpus of representative formulas with ANTLR to fill the shared DFA cache before the first real parse.
+// Built-in corpus is used if none passed
+void WarmUpFormulaParser(const std::vector<std::string>& corpus = {});
\ No newline at end of file
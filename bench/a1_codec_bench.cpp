@@ -0,0 +1,145 @@
+// Microbenchmark of the A1 codec: Position::ToString/FromString against the previous
+// stream-based versions, and the batch entry points
+#include "../common.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace {
+    namespace legacy {
+        const int LETTERS = 26;
+        const int MAX_POSITION_LENGTH = 17;
+        const int MAX_POS_LETTER_COUNT = 3;
+
+        std::string ToString(Position pos) {
+            if (!pos.IsValid()) {
+                return "";
+            }
+
+            std::string result;
+            result.reserve(MAX_POSITION_LENGTH);
+            int c = pos.col;
+            while (c >= 0) {
+                result.insert(result.begin(), 'A' + c % LETTERS);
+                c = c / LETTERS - 1;
+            }
+
+            result += std::to_string(pos.row + 1);
+
+            return result;
+        }
+
+        Position FromString(std::string_view str) {
+            auto it = std::find_if(str.begin(), str.end(), [](const char c) {
+                return !(std::isalpha(c) && std::isupper(c));
+            });
+            auto letters = str.substr(0, it - str.begin());
+            auto digits = str.substr(it - str.begin());
+
+            if (letters.empty() || digits.empty()) {
+                return Position::NONE;
+            }
+            if (letters.size() > MAX_POS_LETTER_COUNT) {
+                return Position::NONE;
+            }
+
+            if (!std::isdigit(digits[0])) {
+                return Position::NONE;
+            }
+
+            int row;
+            std::istringstream row_in{std::string{digits}};
+            if (!(row_in >> row) || !row_in.eof()) {
+                return Position::NONE;
+            }
+
+            int col = 0;
+            for (char ch : letters) {
+                col *= LETTERS;
+                col += ch - 'A' + 1;
+            }
+
+            return {row - 1, col - 1};
+        }
+    }  // namespace legacy
+
+    template <typename Body>
+    void Measure(const char* name, size_t count, Body body) {
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = body();
+        auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": " << elapsed / count << " ns/position (checksum " << checksum << ")" << std::endl;
+    }
+}  // namespace
+
+int main() {
+    const size_t COUNT = 1 << 20;
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+    std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+    std::vector<Position> positions(COUNT);
+    for (auto& pos : positions) {
+        pos = {rows(random), cols(random)};
+    }
+
+    std::vector<std::string> texts(COUNT);
+    std::vector<std::string_view> views(COUNT);
+    for (size_t i = 0; i < COUNT; i++) {
+        texts[i] = positions[i].ToString();
+        views[i] = texts[i];
+        if (!(legacy::FromString(texts[i]) == positions[i]) || legacy::ToString(positions[i]) != texts[i]) {
+            std::cerr << "Codecs disagree on " << texts[i] << std::endl;
+            return 1;
+        }
+    }
+
+    Measure("legacy ToString", COUNT, [&] {
+        size_t checksum = 0;
+        for (auto pos : positions) checksum += legacy::ToString(pos).size();
+        return checksum;
+    });
+    Measure("ToString", COUNT, [&] {
+        size_t checksum = 0;
+        for (auto pos : positions) checksum += pos.ToString().size();
+        return checksum;
+    });
+    Measure("ToChars", COUNT, [&] {
+        size_t checksum = 0;
+        char buffer[Position::MAX_STRING_LENGTH];
+        for (auto pos : positions) checksum += pos.ToChars(buffer);
+        return checksum;
+    });
+    std::vector<char> buffer(COUNT * Position::MAX_STRING_LENGTH);
+    std::vector<size_t> ends(COUNT);
+    Measure("PositionsToChars", COUNT, [&] {
+        return PositionsToChars(positions.data(), COUNT, buffer.data(), ends.data());
+    });
+
+    Measure("legacy FromString", COUNT, [&] {
+        size_t checksum = 0;
+        for (auto text : views) checksum += legacy::FromString(text).row;
+        return checksum;
+    });
+    Measure("FromString", COUNT, [&] {
+        size_t checksum = 0;
+        for (auto text : views) checksum += Position::FromString(text).row;
+        return checksum;
+    });
+    std::vector<Position> decoded(COUNT);
+    PositionsFromStrings(views.data(), COUNT, decoded.data());
+    if (decoded != positions) {
+        std::cerr << "PositionsFromStrings disagrees with FromString" << std::endl;
+        return 1;
+    }
+    Measure("PositionsFromStrings", COUNT, [&] {
+        PositionsFromStrings(views.data(), COUNT, decoded.data());
+        size_t checksum = 0;
+        for (auto pos : decoded) checksum += pos.row;
+        return checksum;
+    });
+    return 0;
+}
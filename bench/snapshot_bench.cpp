@@ -0,0 +1,98 @@
+// Save/load benchmark of the binary snapshot and its deltas against reloading the sheet from its texts,
+// which parses and evaluates every formula. Views taken by SheetInterface::Snapshot() are measured too
+#include "../common.h"
+#include "../formula.h"
+#include "../importer.h"
+#include "../sheet_view.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+    template <typename Body>
+    void Measure(const char* name, size_t cells, Body body) {
+        auto start = std::chrono::steady_clock::now();
+        size_t checksum = body();
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << name << ": " << elapsed << " ms, " << elapsed * 1e6 / cells << " ns/cell (checksum " << checksum << ")" << std::endl;
+    }
+
+    // Numbers, texts and two formulas per row: a chain down column B and a row-local expression
+    std::unique_ptr<SheetInterface> BuildSheet(int rows) {
+        auto sheet = CreateSheet();
+        std::vector<CellEdit> edits;
+        edits.reserve(static_cast<size_t>(rows) * 4);
+        for (int i = 0; i < rows; i++) {
+            std::string row = std::to_string(i + 1);
+            edits.push_back({{i, 0}, std::to_string(i % 1000)});
+            edits.push_back({{i, 1}, i == 0 ? "=A1" : "=B" + std::to_string(i) + "+A" + row});
+            edits.push_back({{i, 2}, "=(A" + row + "*2-1)/(A" + row + "+1)"});
+            edits.push_back({{i, 3}, "row " + row});
+        }
+        sheet->SetCells(edits);
+        return sheet;
+    }
+
+    size_t Checksum(const SheetInterface& sheet, int rows) {
+        return static_cast<size_t>(std::get<double>(sheet.GetCell({rows - 1, 1})->GetValue()));
+    }
+}  // namespace
+
+int main() {
+    const int ROWS = Position::MAX_ROWS;
+    const size_t CELLS = static_cast<size_t>(ROWS) * 4;
+    const std::string path = "snapshot_bench.bin";
+    auto sheet = BuildSheet(ROWS);
+
+    Measure("SaveSnapshot", CELLS, [&] {
+        sheet->SaveSnapshot(path);
+        return CELLS;
+    });
+    auto size = static_cast<size_t>(std::ifstream(path, std::ios::binary | std::ios::ate).tellg());
+    std::cout << "snapshot size: " << size << " bytes, " << static_cast<double>(size) / CELLS << " bytes/cell" << std::endl;
+    const std::string delta_path = "snapshot_bench.delta";
+    Measure("SaveDelta after editing one row (autosave)", CELLS, [&] {
+        sheet->SetCell({ROWS / 2, 3}, "edited");
+        sheet->SaveDelta(delta_path);
+        return sheet->GetChangedTileCount();
+    });
+    Measure("Snapshot (first view, copies every tile)", CELLS, [&] {
+        return sheet->Snapshot()->GetCellCount();
+    });
+    Measure("Snapshot after editing one cell (copies its tile)", CELLS, [&] {
+        sheet->SetCell({ROWS / 2, 3}, "edited again");
+        return sheet->Snapshot()->GetCellCount();
+    });
+    Measure("LoadSnapshot with the delta", CELLS, [&] {
+        return Checksum(*LoadSnapshot(path, delta_path), ROWS);
+    });
+    std::remove(delta_path.c_str());
+    std::ostringstream texts;
+    Measure("PrintTexts", CELLS, [&] {
+        sheet->PrintTexts(texts);
+        return texts.str().size();
+    });
+
+    ClearFormulaCache();
+    std::unique_ptr<SheetInterface> loaded;
+    Measure("LoadSnapshot", CELLS, [&] {
+        loaded = LoadSnapshot(path);
+        return Checksum(*loaded, ROWS);
+    });
+    Measure("first edit after LoadSnapshot (loads the column B chain)", CELLS, [&] {
+        loaded->SetCell({0, 0}, "1");
+        return Checksum(*loaded, ROWS);
+    });
+
+    ClearFormulaCache();
+    Measure("ImportTexts (parse and evaluate)", CELLS, [&] {
+        auto imported = CreateSheet();
+        ImportTexts(*imported, texts.str());
+        return Checksum(*imported, ROWS);
+    });
+    std::remove(path.c_str());
+    return 0;
+}
@@ -1,4 +1,7 @@
 #include "cell.h"
+#include "criteria_index.h"
+#include "export.h"
+#include "lookup_index.h"
 
 #include <iostream>
 #include <string>
@@ -9,35 +12,51 @@ Cell::Cell(): impl_(std::make_unique<EmptyImpl>()){
 
 Cell::~Cell() = default;
 
-void Cell::Set(std::string text, SheetInterface &sheet) {
+void Cell::Set(std::string text, SheetInterface &sheet, std::unique_ptr<FormulaInterface> formula) {
     if (text.empty()) {
         impl_ = std::make_unique<EmptyImpl>();
+        UnlinkPrecedents();
+        NotifyChanged(sheet);
     } else if (text.size() != 1 && text[0] == '=') {
-        std::string old_val_text = cell_node_.node_ptr->GetText();
-        impl_ = std::make_unique<FormulaImpl>(text.substr(1), sheet);
+        auto new_impl = formula ? std::make_unique<FormulaImpl>(std::move(formula), sheet)
+                                : std::make_unique<FormulaImpl>(text.substr(1), sheet);
         //// Begin of --graph processing
-        cell_node_.prev_ptr_set.clear();
-        for (auto pos : this->GetReferencedCells()) {
-            auto prev_node = dynamic_cast<Cell*>(sheet.GetCell(pos));
-            prev_node->cell_node_.next_ptr_set.insert(cell_node_.node_ptr);
-            cell_node_.prev_ptr_set.insert(prev_node);
-        }
-        try {
-            ReferenceUpdate(cell_node_.node_ptr, cell_node_.prev_ptr_set, sheet);
-        } catch (const CircularDependencyException&) {
-            if (old_val_text.empty()) impl_ = std::make_unique<EmptyImpl>();
-            else if (old_val_text.size() != 1 && old_val_text[0] == '=') impl_ = std::make_unique<FormulaImpl>(old_val_text.substr(1), sheet);
-            else impl_ = std::make_unique<TextImpl>(old_val_text);
-            throw CircularDependencyException("ReferenceUpdate --cycle found");
+        auto old_impl = std::move(impl_);
+        auto old_prev_ptr_set = cell_node_.prev_ptr_set;
+        auto old_ranges = cell_node_.ranges;
+        impl_ = std::move(new_impl);
+        UnlinkPrecedents();
+        LinkPrecedents(sheet);
+        if (HasCycle()) {
+            UnlinkPrecedents();
+            impl_ = std::move(old_impl);
+            for (auto prev_node : old_prev_ptr_set) {
+                prev_node->cell_node_.next_ptr_set.insert(cell_node_.node_ptr);
+            }
+            cell_node_.prev_ptr_set = std::move(old_prev_ptr_set);
+            LinkRanges(std::move(old_ranges));
+            throw CircularDependencyException("Cell::Set --cycle found");
         }
         //// End Of --graph processing
     } else {
         impl_ = std::make_unique<TextImpl>(text);
+        UnlinkPrecedents();
+        NotifyChanged(sheet);
     }
 }
 
-void Cell::Clear() {
+void Cell::Clear(const SheetInterface &sheet) {
     impl_ = std::make_unique<EmptyImpl>();
+    UnlinkPrecedents();
+    NotifyChanged(sheet);
+}
+
+void Cell::Load(std::string text, SheetInterface &sheet, std::unique_ptr<FormulaInterface> formula) {
+    UnlinkPrecedents();
+    if (formula) impl_ = std::make_unique<FormulaImpl>(std::move(formula), sheet);
+    else if (text.empty()) impl_ = std::make_unique<EmptyImpl>();
+    else impl_ = std::make_unique<TextImpl>(std::move(text));
+    NotifyChanged(sheet);
 }
 
 Cell::Value Cell::GetValue() const {
@@ -52,25 +71,167 @@ std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
 
-//// Recursive call -- dependent cell update
-void Cell::ReferenceUpdate(Cell* node_ptr, std::set<Cell*> node_ptr_set, SheetInterface &sheet) {
-    for (auto a : node_ptr_set){
-        if (node_ptr == a) {
-            throw CircularDependencyException("ReferenceUpdate --cycle found");
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
+
+std::vector<Position> Cell::GetDependentCells() const {
+    std::vector<Position> result;
+    result.reserve(cell_node_.next_ptr_set.size());
+    for (auto next_node : cell_node_.next_ptr_set) {
+        result.push_back(next_node->cell_node_.pos);
+    }
+    return result;
+}
+
+bool Cell::IsFormula() const {
+    return impl_->IsFormula();
+}
+
+void Cell::CashUpdate(const SheetInterface &sheet) {
+    impl_->Recalculate();
+    NotifyChanged(sheet);
+}
+
+void Cell::Unlink() {
+    UnlinkPrecedents();
+    for (auto next_node : cell_node_.next_ptr_set) {
+        next_node->cell_node_.prev_ptr_set.erase(cell_node_.node_ptr);
+    }
+    cell_node_.next_ptr_set.clear();
+}
+
+void Cell::LinkPrecedents(SheetInterface &sheet) {
+    for (auto pos : GetReferencedCells()) {
+        auto prev_node = dynamic_cast<Cell*>(sheet.GetCell(pos));
+        prev_node->cell_node_.next_ptr_set.insert(cell_node_.node_ptr);
+        cell_node_.prev_ptr_set.insert(prev_node);
+    }
+    cell_node_.range_dependents = sheet.GetRangeDependents();
+    LinkRanges(impl_->GetReferencedRanges());
+}
+
+void Cell::UnlinkPrecedents() {
+    for (auto prev_node : cell_node_.prev_ptr_set) {
+        prev_node->cell_node_.next_ptr_set.erase(cell_node_.node_ptr);
+    }
+    cell_node_.prev_ptr_set.clear();
+    for (Range range : cell_node_.ranges) cell_node_.range_dependents->Remove(range, this);
+    cell_node_.ranges.clear();
+}
+
+void Cell::LinkRanges(std::vector<Range> ranges) {
+    if (!cell_node_.range_dependents) return; // The sheet doesn't track ranges
+    for (Range range : ranges) cell_node_.range_dependents->Add(range, this);
+    cell_node_.ranges = std::move(ranges);
+}
+
+//// Depth-first search over dependent cells with an explicit stack. Dependents over a range are found by the
+//// position of the cell
+bool Cell::HasCycle() const {
+    std::set<const Cell*> visited;
+    std::vector<const Cell*> stack;
+    auto push_dependents = [&](const Cell* node) {
+        stack.insert(stack.end(), node->cell_node_.next_ptr_set.begin(), node->cell_node_.next_ptr_set.end());
+        if (cell_node_.range_dependents) {
+            cell_node_.range_dependents->ForEachDependent(node->cell_node_.pos, [&](const Cell* next) { stack.push_back(next); });
         }
+    };
+    push_dependents(this);
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+        if (node == this) return true;
+        if (!visited.insert(node).second) continue;
+        push_dependents(node);
     }
-    node_ptr_set.emplace(node_ptr);
-    for (auto a : node_ptr->cell_node_.next_ptr_set){
-        ReferenceUpdate(a, node_ptr_set, sheet);
-        a->CashUpdate(a->GetText(), sheet); //// Updates cash
+    return false;
+}
+
+void Cell::SetPosition(Position pos) {
+    cell_node_.pos = pos;
+}
+
+Position Cell::GetPosition() const {
+    return cell_node_.pos;
+}
+
+void Cell::SerializeFormula(std::string& out) const {
+    impl_->Serialize(out, cell_node_.pos);
+}
+
+void Cell::Restore(Position pos, std::unique_ptr<Impl> impl) {
+    cell_node_.pos = pos;
+    impl_ = std::move(impl);
+}
+
+void Cell::RestoreLinks(SheetInterface &sheet) {
+    LinkPrecedents(sheet);
+}
+
+bool Cell::ResolveLazy(SheetInterface &sheet, bool keep_value) {
+    std::string text = impl_->GetText();
+    std::unique_ptr<FormulaInterface> formula;
+    try {
+        formula = ParseFormula(text.substr(1));
+    } catch (const FormulaException&) {
+        impl_ = std::make_unique<TextImpl>(std::move(text));
+        return false;
     }
+    auto impl = std::make_unique<FormulaImpl>(std::move(formula), sheet);
+    if (keep_value) impl->SetCash(impl_->GetValue());
+    impl_ = std::move(impl);
+    LinkPrecedents(sheet);
+    return true;
+}
+
+void Cell::KeepAsText() {
+    UnlinkPrecedents();
+    impl_ = std::make_unique<TextImpl>(impl_->GetText());
+}
+
+//// Must run before dependent cells are recalculated --they may look up in a range containing this cell
+void Cell::NotifyChanged(const SheetInterface &sheet) const {
+    if (!cell_node_.pos.IsValid()) return;
+    if (auto cache = sheet.GetLookupCache()) cache->OnCellChanged(cell_node_.pos, sheet);
+    if (auto cache = sheet.GetCriteriaCache()) cache->OnCellChanged(cell_node_.pos, sheet);
+}
+
+void RangeDependents::Add(Range range, Cell* cell) {
+    auto [it, added] = cells_.try_emplace(range);
+    if (added) buckets_.Insert(range);
+    it->second.insert(cell);
+}
+
+void RangeDependents::Remove(Range range, Cell* cell) {
+    auto it = cells_.find(range);
+    if (it == cells_.end()) return;
+    it->second.erase(cell);
+    if (!it->second.empty()) return;
+    buckets_.Erase(range);
+    cells_.erase(it);
+    released_.push_back(range);
+}
+
+bool RangeDependents::IsEmpty() const {
+    return cells_.empty();
 }
 
-void Cell::CashUpdate(const std::string& text, SheetInterface &sheet) {
-    impl_ = std::make_unique<FormulaImpl>(text.substr(1), sheet);
+bool RangeDependents::IsCovered(Range range) const {
+    bool covered = false;
+    buckets_.ForEachContaining(range.from, [&](Range used) { covered = covered || used.Contains(range.to); });
+    return covered;
+}
+
+std::vector<Range> RangeDependents::TakeReleased() {
+    return std::exchange(released_, {});
 }
 
 std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) { // not through the stream --no locale, no precision loss
+        char buffer[MAX_NUMBER_LENGTH];
+        return output.write(buffer, static_cast<std::streamsize>(FormatNumber(std::get<double>(value), buffer)));
+    }
     std::visit([&](const auto& val) { output << val; }, value);
     return output;
 }
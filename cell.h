@@ -2,23 +2,41 @@
 #include <utility>
 #include "formula.h"
 #include "FormulaAST.h"
+#include "mapped_file.h"
+#include "range_buckets.h"
+
+#include <map>
 
 class Cell;
+class RangeDependents;
 
 struct CellNode {
 public:
     Cell* node_ptr = nullptr;
+    Position pos = Position::NONE; // Cell position in the sheet
     std::set<Cell*> next_ptr_set;
     std::set<Cell*> prev_ptr_set;
+    std::vector<Range> ranges; // Ranges of the formula registered in range_dependents
+    RangeDependents* range_dependents = nullptr; // Of the sheet --set when the cell is linked
 };
 
 class Impl {
 public:
+    virtual ~Impl() = default; // Cells own their impl through the base --formulas release ASTs and mapped files
+
     virtual std::string GetText() = 0;
 
     virtual CellInterface::Value GetValue() = 0;
 
     virtual std::vector<Position> GetReferencedCells() = 0;
+
+    virtual std::vector<Range> GetReferencedRanges() {return {};}
+
+    virtual void Recalculate() {} // Recomputes cached value --formulas only
+
+    virtual void Serialize(std::string& out, Position origin) const {} // Appends the compiled formula --formulas only
+
+    [[nodiscard]] virtual bool IsFormula() const {return false;}
 };
 
 // Cell is empty, if value is requested - returns 0.0
@@ -53,35 +71,86 @@ private:
     std::string text_;
 };
 
+// Compiled formula inside a mapped snapshot --the file stays mapped until the formula is loaded. Positions are
+// relative to origin, the cell of the formula
+struct CompiledFormula {
+    std::shared_ptr<const MappedFile> file;
+    std::string_view data;
+    Position origin = {0, 0};
+};
+
 // Cell as a formula
 class FormulaImpl : public Impl {
 public:
-    explicit FormulaImpl(const std::string &expression, SheetInterface &sheet) : sheet_(sheet) {
-        formula_ = ParseFormula(expression);
-        if (std::holds_alternative<double>(formula_->Evaluate(sheet_))) {
-            cash_ = std::get<double>(formula_->Evaluate(sheet_));
-            referenced_cells_ = formula_->GetReferencedCells();
-            for (auto pos : referenced_cells_) {
-                if (!sheet.GetCell(pos)) sheet.SetCell(pos, "");
-            }
-        } else if (std::holds_alternative<FormulaError>(formula_->Evaluate(sheet_))) {
-            cash_ = std::get<FormulaError>(formula_->Evaluate(sheet_));
+    // Parses the formula and creates empty referenced cells --not the cells of its ranges. Value stays stale until
+    // Recalculate()
+    explicit FormulaImpl(const std::string &expression, SheetInterface &sheet) : FormulaImpl(ParseFormula(expression), sheet) {}
+
+    // Formula parsed in advance --bulk edits parse in parallel
+    explicit FormulaImpl(std::unique_ptr<FormulaInterface> formula, SheetInterface &sheet) : formula_(std::move(formula)), sheet_(sheet) {
+        text_ = "=" + formula_->GetExpression();
+        referenced_cells_ = formula_->GetReferencedCells();
+        referenced_ranges_ = formula_->GetReferencedRanges();
+        for (auto pos : referenced_cells_) {
+            if (!sheet.GetCell(pos)) sheet.SetCell(pos, "");
         }
     }
 
-    [[nodiscard]] std::string GetText() override {return "=" + formula_->GetExpression();}
+    // Restored from a snapshot: value and references are read from the file, the formula itself is loaded from
+    // its compiled form on first evaluation. An empty text is printed from the compiled form until then
+    FormulaImpl(std::string text, CellInterface::Value value, std::vector<Position> referenced_cells, std::vector<Range> referenced_ranges,
+                CompiledFormula compiled, SheetInterface &sheet)
+        : sheet_(sheet), cash_(std::move(value)), referenced_cells_(std::move(referenced_cells)), referenced_ranges_(std::move(referenced_ranges)),
+          text_(std::move(text)), compiled_(std::move(compiled)) {}
+
+    [[nodiscard]] std::string GetText() override {
+        // Printed each time and not kept: readers may share the cell --and printing a loaded sheet shouldn't keep
+        // every formula in memory
+        if (text_.empty()) return "=" + DeserializeFormulaAST(compiled_.data, compiled_.origin).GetExpression();
+        return text_;
+    }
+
+    void SetCash(CellInterface::Value value) {cash_ = std::move(value);} // Saved value of a formula loaded lazily
 
     [[nodiscard]] CellInterface::Value GetValue() override {
-        return cash_; // We keep cash that was calculated within last call --constructor. If cash is invalid - the new valid data rewrites with new constructor call
+        return cash_; // We keep cash that was calculated within last Recalculate() call --the sheet calls it for invalidated cells
     }
 
     std::vector<Position> GetReferencedCells() override {return referenced_cells_;}
 
+    std::vector<Range> GetReferencedRanges() override {return referenced_ranges_;}
+
+    void Recalculate() override {
+        auto value = GetFormula().Evaluate(sheet_);
+        if (std::holds_alternative<double>(value)) cash_ = std::get<double>(value);
+        else cash_ = std::get<FormulaError>(value);
+    }
+
+    void Serialize(std::string& out, Position origin) const override {
+        if (formula_) formula_->Serialize(out, origin);
+        else if (compiled_.origin == origin) out.append(compiled_.data);
+        else DeserializeFormulaAST(compiled_.data, compiled_.origin).Serialize(out, origin);
+    }
+
+    [[nodiscard]] bool IsFormula() const override {return true;}
+
 private:
+    const FormulaInterface& GetFormula() {
+        if (!formula_) {
+            formula_ = LoadFormula(text_.empty() ? std::string() : text_.substr(1), compiled_.data, compiled_.origin);
+            if (text_.empty()) text_ = "=" + formula_->GetExpression();
+            compiled_ = {};
+        }
+        return *formula_;
+    }
+
     std::unique_ptr<FormulaInterface> formula_;
     SheetInterface& sheet_;
     CellInterface::Value cash_ = 0.0;
     std::vector<Position> referenced_cells_{};
+    std::vector<Range> referenced_ranges_{};
+    std::string text_; // "=" and the canonical expression, printed once --empty until loaded for restored cells
+    CompiledFormula compiled_{}; // Until the formula is loaded --restored cells only
 };
 
 class Cell : public CellInterface {
@@ -90,9 +159,15 @@ public:
 
     ~Cell() override;
 
-    void Set(std::string text, SheetInterface &sheet); // Sets new cell
+    // Sets new cell, updates graph and checks cycles. Formula value is computed by CashUpdate().
+    // formula is the already parsed text of a formula cell, if nullptr the text is parsed here
+    void Set(std::string text, SheetInterface &sheet, std::unique_ptr<FormulaInterface> formula = nullptr);
+
+    void Clear(const SheetInterface &sheet); // Cell becomes empty, dependencies are kept
 
-    void Clear();
+    // Sets the content like Set() but leaves a formula unlinked and unchecked for cycles --bulk loads link it with
+    // RestoreLinks() and order the evaluation themselves. formula is the parsed text of a formula cell
+    void Load(std::string text, SheetInterface &sheet, std::unique_ptr<FormulaInterface> formula);
 
     [[nodiscard]] Value GetValue() const override; // Gets cell value
 
@@ -100,13 +175,76 @@ public:
 
     [[nodiscard]] std::vector<Position> GetReferencedCells() const override; // Gets all cells that are used in formula
 
-    void ReferenceUpdate(Cell* node_ptr, std::set<Cell*> node_ptr_set, SheetInterface &sheet); // Updates graph and calls CashUpdate for invalid cells --recursive
+    [[nodiscard]] std::vector<Range> GetReferencedRanges() const override;
+
+    // Cells whose formulas reference this cell one by one --those over a range containing it are in RangeDependents
+    [[nodiscard]] std::vector<Position> GetDependentCells() const;
+
+    [[nodiscard]] bool IsFormula() const;
+
+    void CashUpdate(const SheetInterface &sheet); // Recalculates cell's cash after invalidation --without re-parsing
 
-    void CashUpdate(const std::string& text, SheetInterface &sheet); // Updates cell's cash after invalidation
+    void Unlink(); // Removes the cell from the graph before it's destroyed
+
+    void SetPosition(Position pos); // Position is set by the sheet
+
+    [[nodiscard]] Position GetPosition() const;
+
+    void SerializeFormula(std::string& out) const; // Appends the compiled formula relative to the cell --formula cells only
+
+    void Restore(Position pos, std::unique_ptr<Impl> impl); // Content read from a snapshot, not linked yet
+
+    void RestoreLinks(SheetInterface &sheet); // Connects a restored formula with its precedents --they must exist
+
+    // Parses a formula loaded lazily --restored with its text and saved value only--, creates its missing
+    // precedents and links it. keep_value keeps the saved value, otherwise it stays stale until CashUpdate().
+    // A formula that doesn't parse becomes a text: returns false
+    bool ResolveLazy(SheetInterface &sheet, bool keep_value);
+
+    void KeepAsText(); // Unlinks a formula and keeps its text as a text cell --lazy formulas found in a cycle
 
 private:
+    void NotifyChanged(const SheetInterface &sheet) const; // Reports a new cell value to the sheet caches
+
+    void LinkPrecedents(SheetInterface &sheet); // Connects the cell with cells of its formula, registers its ranges
+
+    void UnlinkPrecedents();
+
+    void LinkRanges(std::vector<Range> ranges); // Registers the ranges with the sheet the cell was linked in
+
+    [[nodiscard]] bool HasCycle() const; // True if the cell is reachable from itself --iterative
+
     std::unique_ptr<Impl> impl_; // Cell data
     CellNode cell_node_; // Structure for dependencies graph implementation
 };
 
+//// Formula cells of a sheet by the ranges their formulas use. A range is one dependency of a formula: its cells are
+//// neither created nor linked, a changed cell finds the formulas over it here
+class RangeDependents {
+public:
+    void Add(Range range, Cell* cell);
+
+    void Remove(Range range, Cell* cell);
+
+    template <typename Visit>
+    void ForEachDependent(Position pos, Visit visit) const { // visit(cell) once per range of its formula containing pos
+        buckets_.ForEachContaining(pos, [&](Range range) {
+            for (Cell* cell : cells_.at(range)) visit(cell);
+        });
+    }
+
+    [[nodiscard]] bool IsEmpty() const;
+
+    [[nodiscard]] bool IsCovered(Range range) const; // Some formula uses a range containing it
+
+    // Ranges left without formulas since the last call --for the caches built over them. A range may be used again
+    // by then
+    std::vector<Range> TakeReleased();
+
+private:
+    RangeBuckets buckets_;
+    std::map<Range, std::set<Cell*>> cells_;
+    std::vector<Range> released_;
+};
+
 std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value);
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "checksum.h"
+
+#include <array>
+
+namespace {
+    //// Slicing-by-4: four tables let the loop consume a 32-bit word per step instead of a byte
+    using Tables = std::array<std::array<uint32_t, 256>, 4>;
+
+    constexpr Tables MakeTables() {
+        Tables tables{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            }
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (size_t t = 1; t < 4; t++) {
+                tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+            }
+        }
+        return tables;
+    }
+
+    constexpr Tables TABLES = MakeTables();
+}  // namespace
+
+uint32_t Crc32(std::string_view data, uint32_t crc) {
+    crc = ~crc;
+    auto bytes = reinterpret_cast<const unsigned char*>(data.data());
+    size_t size = data.size();
+    while (size >= 4) {
+        crc ^= uint32_t{bytes[0]} | uint32_t{bytes[1]} << 8 | uint32_t{bytes[2]} << 16 | uint32_t{bytes[3]} << 24;
+        crc = TABLES[3][crc & 0xFF] ^ TABLES[2][(crc >> 8) & 0xFF] ^ TABLES[1][(crc >> 16) & 0xFF] ^ TABLES[0][crc >> 24];
+        bytes += 4;
+        size -= 4;
+    }
+    for (; size > 0; size--, bytes++) {
+        crc = TABLES[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
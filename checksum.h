@@ -0,0 +1,6 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+
+// CRC-32 (IEEE 802.3, as zlib) of data. Pass the previous result as crc to checksum data in pieces
+uint32_t Crc32(std::string_view data, uint32_t crc = 0);
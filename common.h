@@ -1,6 +1,10 @@
 #pragma once
+#include "read_write_mutex.h"
+
 #include <iosfwd>
 #include <memory>
+#include <optional>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -18,13 +22,24 @@ struct Position {
     [[nodiscard]] bool IsValid() const;
     [[nodiscard]] std::string ToString() const;
 
+    // Writes A1 text to a buffer of MAX_STRING_LENGTH chars without allocating. Returns its length --0 if invalid
+    size_t ToChars(char* buffer) const;
+
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const size_t MAX_STRING_LENGTH = 8; // "XFD16384"
     static const Position NONE;
 };
 
+// Decodes texts[i] to positions[i], invalid texts give Position::NONE
+void PositionsFromStrings(const std::string_view* texts, size_t count, Position* positions);
+
+// Encodes positions back to back into a buffer of count * Position::MAX_STRING_LENGTH chars.
+// ends[i] is the offset past the i-th text, invalid positions give empty texts. Returns the total length
+size_t PositionsToChars(const Position* positions, size_t count, char* buffer, size_t* ends);
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -32,6 +47,22 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Rectangular cell range --both corners included: A1:B3
+struct Range {
+    Position from;
+    Position to;
+
+    bool operator==(Range rhs) const;
+    bool operator<(Range rhs) const;
+
+    [[nodiscard]] bool IsValid() const;
+    [[nodiscard]] bool Contains(Position pos) const;
+    [[nodiscard]] Size GetSize() const;
+    [[nodiscard]] std::string ToString() const;
+
+    static Range FromPositions(Position lhs, Position rhs); // Normalizes corners to top-left and bottom-right
+};
+
 // Describes errors that can occur while formula calculation
 class FormulaError {
 public:
@@ -39,6 +70,7 @@ public:
         Ref,    // cell has invalid position
         Value,  // call can't be parsed as a number
         Div0,  // division by zero occurred
+        NA,  // lookup value not found
     };
 
     FormulaError(Category category);
@@ -75,6 +107,12 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Thrown when a file of the sheet can't be opened, read or written
+class FileException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
 
@@ -97,11 +135,56 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ranges the formula uses, sorted with no duplicates. Their cells aren't listed by GetReferencedCells() and
+    // aren't created: a missing cell reads as empty
+    [[nodiscard]] virtual std::vector<Range> GetReferencedRanges() const = 0;
+};
+
+// Automatic: every edit recalculates dependent cells immediately.
+// Manual: edits only mark cells stale, values are recomputed by SheetInterface::Recalculate()
+enum class CalculationMode {
+    Automatic,
+    Manual,
+};
+
+// Content of one cell in a batch edit
+struct CellEdit {
+    Position pos;
+    std::string text;
+};
+
+// Why a cell of a batch edit was rejected
+struct CellError {
+    Position pos;
+    std::string message;
+};
+
+// Cell of a lazy load: its text and, for a formula, the value saved with it if known
+struct LazyCell {
+    Position pos;
+    std::string text;
+    std::optional<CellInterface::Value> value; // Number or error, a string is ignored
+};
+
+// How ExportValues() and ExportTexts() run. With more than one thread the printable area is split into bands of
+// band_rows rows, formatted into their own buffers in parallel and written in order: the output is the same
+struct ExportOptions {
+    unsigned threads = 1; // 0: one per core
+    int band_rows = 256;
+    bool vectored = true; // Formatted bands are passed to the sink at once --one writev() call for a file descriptor
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+class LookupIndexCache;
+class CriteriaIndexCache;
+class RangeDependents;
+class ExportSink;
+class Journal;
+class SheetView;
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -139,7 +222,116 @@ public:
     // GetValue() or GetText() used for cell transform to string. Empty cell transfers to empty string
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Same output written to a buffered sink (file descriptor, memory, stream), which is flushed at the end.
+    // Populated cells are visited in row-major order and gaps are written as runs, so the cost depends on
+    // the number of cells and the output size, not on lookups per position of the printable area.
+    // A parallel export only reads the sheet --it must not be changed until the export returns
+    virtual void ExportValues(ExportSink& sink, const ExportOptions& options = {}) const = 0;
+    virtual void ExportTexts(ExportSink& sink, const ExportOptions& options = {}) const = 0;
+
+    // Parses all formulas of the batch in parallel without touching the sheet. Returns errors per cell
+    // (invalid position, syntactically incorrect formula) in batch order
+    [[nodiscard]] virtual std::vector<CellError> ValidateCells(const std::vector<CellEdit>& cells) const = 0;
+
+    // Sets a batch of cells. Formulas are parsed in parallel first: if any cell is incorrect, nothing is
+    // changed and the errors are returned. Otherwise cells are set in batch order, dependencies are wired
+    // sequentially and the sheet is recalculated once at the end. Cells that would create a cycle keep
+    // their content and are reported
+    virtual std::vector<CellError> SetCells(const std::vector<CellEdit>& cells) = 0;
+
+    // Loads cells without parsing formulas. A formula keeps its text, and its saved value, until it is read: the
+    // first GetCell() of it parses it and the formulas it reaches, links them and evaluates those without a saved
+    // value. Edits and whole-sheet operations --printing, export, snapshots-- resolve all of them first. Saved
+    // values are trusted to match the loaded content. A formula that turns out invalid, or in a cycle, is kept as
+    // a text. Cells that exist already are set as SetCell() does, those that fail are returned
+    virtual std::vector<CellError> LoadCells(std::vector<LazyCell> cells) = 0;
+
+    // Sets many cells in time linear in their number: formulas are parsed in parallel, every cell is set, the
+    // dependencies are linked in one pass and the cells that need it are evaluated once in dependency order
+    // --marked stale in Manual mode. Unlike SetCells() incorrect cells don't stop the rest: they are left out and
+    // reported, and so is every loaded cell of a reference cycle, which is left empty
+    virtual std::vector<CellError> BulkLoad(std::vector<CellEdit> cells) = 0;
+
+    // BulkLoad() in parts, so a caller streaming cells never holds them all: each batch is parsed and set, and
+    // FinishBulkLoad() links and evaluates the cells of all batches in one pass and reports the cycles. Until then
+    // the loaded formulas are neither linked nor evaluated and the sheet takes no other edits
+    virtual std::vector<CellError> BulkLoadBatch(std::vector<CellEdit> cells) = 0;
+    virtual std::vector<CellError> FinishBulkLoad() = 0; // Nothing to do without batches since the last one
+
+    // Switching to Automatic recalculates all stale cells
+    virtual void SetCalculationMode(CalculationMode mode) = 0;
+    [[nodiscard]] virtual CalculationMode GetCalculationMode() const = 0;
+
+    // Recomputes all stale formula cells in one pass, every cell is evaluated once in dependency order
+    virtual void Recalculate() = 0;
+
+    // Number of formula cells waiting for Recalculate() --always 0 in Automatic mode
+    [[nodiscard]] virtual size_t GetDirtyCount() const = 0;
+
+    // Index cache shared by lookup functions (VLOOKUP, MATCH, XLOOKUP) of all formulas in the sheet.
+    // nullptr if the sheet keeps no cache --lookups then scan the range
+    [[nodiscard]] virtual LookupIndexCache* GetLookupCache() const { return nullptr; }
+
+    // Selection bitmaps shared by conditional aggregates (SUMIF, COUNTIF, AVERAGEIF) of all formulas in the sheet.
+    // nullptr if the sheet keeps no cache --aggregates then build their bitmaps per call
+    [[nodiscard]] virtual CriteriaIndexCache* GetCriteriaCache() const { return nullptr; }
+
+    // Formulas by the ranges they use, see cell.h: a cell set or cleared in a range recalculates them.
+    // nullptr if the sheet doesn't track ranges --nothing is recalculated by a change inside a range then
+    [[nodiscard]] virtual RangeDependents* GetRangeDependents() const { return nullptr; }
+
+    // Writes cells, compiled formulas, cached values, dependencies and the calculation mode to a binary
+    // snapshot read back by LoadSnapshot(). Throws FileException
+    virtual void SaveSnapshot(const std::string& path) const = 0;
+
+    // Writes the cells of the tiles (64x64 cells) set, cleared or recalculated since the last SaveSnapshot() or
+    // LoadSnapshot() --the base-- as a delta of that base. Returns false and writes nothing if the sheet has no
+    // base. Throws FileException
+    virtual bool SaveDelta(const std::string& path) const = 0;
+
+    // Tiles changed since the base, written by the next SaveDelta()
+    [[nodiscard]] virtual size_t GetChangedTileCount() const = 0;
+
+    // Edits that succeed from now on are appended to the journal (SetCell, SetCells, ClearCell), nullptr stops
+    // journaling. See journal.h for recovery
+    virtual void SetJournal(std::shared_ptr<Journal> journal) = 0;
+
+    // Concurrent use: any number of reading threads and one writing thread. Methods don't lock by themselves:
+    // a reader holds LockForReading() over its calls --GetCell() and the cells it returns, GetPrintableSize(),
+    // Print*(), Export*()--, the writer holds LockForWriting() over an edit or a batch of edits, and over saves,
+    // which change the persisted state. Readers see the values of the last completed write, never a recalculation
+    // half done; cell pointers are valid while the lock is held. Locks don't nest.
+    // Formulas loaded lazily are parsed by the first reader that reaches them, one reader at a time: GetCell()
+    // resolves a cell and its precedents, whole-sheet reads resolve all. Content and values don't change by it
+    [[nodiscard]] virtual std::shared_lock<ReadWriteMutex> LockForReading() const = 0;
+    [[nodiscard]] virtual std::unique_lock<ReadWriteMutex> LockForWriting() = 0;
+
+    // Immutable view of all cells with their texts and values as they are now, see sheet_view.h. It stays valid
+    // and unchanged while the sheet goes on, and is read without locks, so long exports don't hold the writer.
+    // Taking one under a read lock is enough; it shares everything with the previous view but the tiles changed
+    // since, which are copied now --an unchanged sheet gives the previous view back
+    [[nodiscard]] virtual std::shared_ptr<const SheetView> Snapshot() const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet();
+
+// Opens a snapshot written by SheetInterface::SaveSnapshot(). The file is mapped, checked and its cell table decoded:
+// every cell is created with its value and every formula linked, so opening is linear in the cells --O(n log n) with
+// the sheet's ordered map. Only formulas are deferred: nothing is parsed or evaluated, a formula is loaded from its
+// compiled form when first evaluated. Throws FileException
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path);
+
+// Opens a base with the changes of a delta written by SheetInterface::SaveDelta() on top. A missing delta, or one
+// written against another base --left by an interrupted compaction--, is ignored. Throws FileException
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path, const std::string& delta_path);
+
+struct AutosaveOptions {
+    double max_delta_ratio = 0.25; // Delta size, relative to the base, that makes Autosave() compact
+};
+
+// Saves the changes since the base of the sheet without rewriting it: a delta, whose cost follows the changed
+// tiles. Compacts --writes a new base and removes the delta-- when the sheet has no base yet or the delta has
+// outgrown max_delta_ratio of the base. Returns true if it compacted. Throws FileException
+bool Autosave(const SheetInterface& sheet, const std::string& base_path, const std::string& delta_path, const AutosaveOptions& options = {});
@@ -0,0 +1,261 @@
+#include "criteria_index.h"
+#include "cell.h"
+#include "lookup_index.h"
+
+#include <algorithm>
+#include <bitset>
+#include <charconv>
+#include <cmath>
+
+namespace {
+    size_t WordCount(Range range) {
+        Size size = range.GetSize();
+        return (static_cast<size_t>(size.rows) * size.cols + TILE_CELLS - 1) / TILE_CELLS;
+    }
+
+    size_t ToOffset(Range range, Position pos) {
+        return static_cast<size_t>(pos.row - range.from.row) * range.GetSize().cols + (pos.col - range.from.col);
+    }
+
+    void SetBit(std::vector<uint64_t>& words, size_t offset, bool value) {
+        uint64_t bit = uint64_t{1} << (offset % TILE_CELLS);
+        if (value) words[offset / TILE_CELLS] |= bit;
+        else words[offset / TILE_CELLS] &= ~bit;
+    }
+
+    bool IsEmptyCell(const CellInterface* cell) {
+        return cell == nullptr || cell->GetText().empty();
+    }
+
+    template <typename T>
+    bool Compare(Criterion::Op op, const T& lhs, const T& rhs) {
+        switch (op) {
+            case Criterion::Op::Eq: return lhs == rhs;
+            case Criterion::Op::Ne: return !(lhs == rhs);
+            case Criterion::Op::Lt: return lhs < rhs;
+            case Criterion::Op::Le: return !(rhs < lhs);
+            case Criterion::Op::Gt: return rhs < lhs;
+            case Criterion::Op::Ge: return !(lhs < rhs);
+        }
+        return false;
+    }
+}  // namespace
+
+Criterion Criterion::Parse(std::string_view text) {
+    static const std::pair<std::string_view, Op> OPERATORS[] = {
+        {"<=", Op::Le}, {">=", Op::Ge}, {"<>", Op::Ne}, {"<", Op::Lt}, {">", Op::Gt}, {"=", Op::Eq},
+    };
+    Criterion criterion;
+    for (const auto& [prefix, op] : OPERATORS) {
+        if (text.substr(0, prefix.size()) == prefix) {
+            criterion.op_ = op;
+            text.remove_prefix(prefix.size());
+            break;
+        }
+    }
+    double number;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), number);
+    if (!text.empty() && ec == std::errc() && ptr == text.data() + text.size() && std::isfinite(number)) {
+        criterion.number_ = number;
+    } else {
+        criterion.text_ = ToLowerText(text);
+    }
+    return criterion;
+}
+
+Criterion Criterion::Number(double value) {
+    Criterion criterion;
+    criterion.number_ = value;
+    return criterion;
+}
+
+bool Criterion::Matches(const CellInterface* cell) const {
+    if (IsEmptyCell(cell)) {
+        // Only "=" and "<>" with an empty operand or "<>" with any operand select empty cells
+        if (number_) return op_ == Op::Ne;
+        return text_.empty() ? op_ == Op::Eq : op_ == Op::Ne;
+    }
+    auto value = cell->GetValue();
+    if (std::holds_alternative<FormulaError>(value)) return false;
+    auto key = ReadLookupKey(cell);
+    if (number_) {
+        if (!key) return op_ == Op::Ne;
+        return Compare(op_, *key, *number_);
+    }
+    if (text_.empty()) return op_ == Op::Ne;
+    if (key) return op_ == Op::Ne;
+    return Compare(op_, ToLowerText(std::get<std::string>(value)), text_);
+}
+
+std::string Criterion::GetKey() const {
+    static const char* const OPERATORS[] = {"=", "<>", "<", "<=", ">", ">="};
+    std::string key = OPERATORS[static_cast<int>(op_)];
+    if (number_) {
+        char buffer[32];
+        auto [ptr, ec] = std::to_chars(buffer, buffer + sizeof(buffer), *number_);
+        key.append(buffer, ptr);
+    } else {
+        key += '"' + text_;
+    }
+    return key;
+}
+
+SelectionBitmap::SelectionBitmap(Range range, Criterion criterion, const SheetInterface& sheet)
+    : range_(range)
+    , criterion_(std::move(criterion))
+    , words_(WordCount(range), 0) {
+    size_t offset = 0;
+    for (int i = range_.from.row; i <= range_.to.row; i++) {
+        for (int j = range_.from.col; j <= range_.to.col; j++, offset++) {
+            if (criterion_.Matches(sheet.GetCell({i, j}))) SetBit(words_, offset, true);
+        }
+    }
+}
+
+void SelectionBitmap::Update(Position pos, const SheetInterface& sheet) {
+    SetBit(words_, ToOffset(range_, pos), criterion_.Matches(sheet.GetCell(pos)));
+}
+
+const std::vector<uint64_t>& SelectionBitmap::GetWords() const {
+    return words_;
+}
+
+ValueColumn::ValueColumn(Range range, const SheetInterface& sheet)
+    : range_(range)
+    , values_(WordCount(range) * TILE_CELLS, 0.0)
+    , numeric_words_(WordCount(range), 0) {
+    size_t offset = 0;
+    for (int i = range_.from.row; i <= range_.to.row; i++) {
+        for (int j = range_.from.col; j <= range_.to.col; j++, offset++) {
+            if (auto key = ReadLookupKey(sheet.GetCell({i, j}))) {
+                values_[offset] = *key;
+                SetBit(numeric_words_, offset, true);
+            }
+        }
+    }
+}
+
+void ValueColumn::Update(Position pos, const SheetInterface& sheet) {
+    size_t offset = ToOffset(range_, pos);
+    auto key = ReadLookupKey(sheet.GetCell(pos));
+    values_[offset] = key.value_or(0.0);
+    SetBit(numeric_words_, offset, key.has_value());
+}
+
+const std::vector<double>& ValueColumn::GetValues() const {
+    return values_;
+}
+
+const std::vector<uint64_t>& ValueColumn::GetNumericWords() const {
+    return numeric_words_;
+}
+
+const SelectionBitmap& CriteriaIndexCache::GetSelection(Range range, const Criterion& criterion, const SheetInterface& sheet) {
+    SelectionKey key(range, criterion.GetKey());
+    auto it = selections_.find(key);
+    if (it != selections_.end()) {
+        order_.splice(order_.begin(), order_, it->second.order);
+        return it->second.bitmap;
+    }
+    if (!HasRange(range)) buckets_.Insert(range);
+    order_.push_front(key);
+    it = selections_.emplace(std::move(key), Selection{SelectionBitmap(range, criterion, sheet), order_.begin()}).first;
+    Shrink();
+    return it->second.bitmap;
+}
+
+const ValueColumn& CriteriaIndexCache::GetValues(Range range, const SheetInterface& sheet) {
+    auto it = columns_.find(range);
+    if (it == columns_.end()) {
+        if (!HasRange(range)) buckets_.Insert(range);
+        it = columns_.emplace(range, ValueColumn(range, sheet)).first;
+    }
+    return it->second;
+}
+
+void CriteriaIndexCache::OnCellChanged(Position pos, const SheetInterface& sheet) {
+    buckets_.ForEachContaining(pos, [&](Range range) {
+        for (auto it = selections_.lower_bound({range, std::string()}); it != selections_.end() && it->first.first == range; ++it) {
+            it->second.bitmap.Update(pos, sheet);
+        }
+        if (auto it = columns_.find(range); it != columns_.end()) it->second.Update(pos, sheet);
+    });
+}
+
+void CriteriaIndexCache::OnRangeReleased(Range range, const RangeDependents& used) {
+    if (!HasRange(range) || used.IsCovered(range)) return;
+    auto it = selections_.lower_bound({range, std::string()});
+    while (it != selections_.end() && it->first.first == range) {
+        order_.erase(it->second.order);
+        it = selections_.erase(it);
+    }
+    columns_.erase(range);
+    buckets_.Erase(range);
+}
+
+void CriteriaIndexCache::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    Shrink();
+}
+
+void CriteriaIndexCache::Clear() {
+    selections_.clear();
+    order_.clear();
+    columns_.clear();
+    buckets_.Clear();
+}
+
+size_t CriteriaIndexCache::GetSelectionCount() const {
+    return selections_.size();
+}
+
+void CriteriaIndexCache::Shrink() {
+    while (selections_.size() > std::max<size_t>(capacity_, 1)) EraseSelection(selections_.find(order_.back()));
+}
+
+void CriteriaIndexCache::EraseSelection(std::map<SelectionKey, Selection>::iterator it) {
+    Range range = it->first.first;
+    order_.erase(it->second.order);
+    selections_.erase(it);
+    if (!HasRange(range)) buckets_.Erase(range);
+}
+
+bool CriteriaIndexCache::HasRange(Range range) const {
+    auto it = selections_.lower_bound({range, std::string()});
+    return (it != selections_.end() && it->first.first == range) || columns_.count(range) > 0;
+}
+
+//// Four independent accumulators per tile let the compiler keep the lanes in vector registers;
+//// empty tiles are skipped and full tiles are summed without the per-cell select
+double MaskedSum(const double* values, const uint64_t* selection, const uint64_t* mask, size_t words) {
+    double sums[4] = {0.0, 0.0, 0.0, 0.0};
+    for (size_t w = 0; w < words; w++) {
+        uint64_t bits = selection[w] & mask[w];
+        if (bits == 0) continue;
+        const double* tile = values + w * TILE_CELLS;
+        if (bits == ~uint64_t{0}) {
+            for (int i = 0; i < TILE_CELLS; i += 4) {
+                sums[0] += tile[i];
+                sums[1] += tile[i + 1];
+                sums[2] += tile[i + 2];
+                sums[3] += tile[i + 3];
+            }
+        } else {
+            for (int i = 0; i < TILE_CELLS; i += 4) {
+                sums[0] += (bits >> i) & 1 ? tile[i] : 0.0;
+                sums[1] += (bits >> (i + 1)) & 1 ? tile[i + 1] : 0.0;
+                sums[2] += (bits >> (i + 2)) & 1 ? tile[i + 2] : 0.0;
+                sums[3] += (bits >> (i + 3)) & 1 ? tile[i + 3] : 0.0;
+            }
+        }
+    }
+    return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+size_t MaskedCount(const uint64_t* selection, const uint64_t* mask, size_t words) {
+    size_t count = 0;
+    for (size_t w = 0; w < words; w++) {
+        count += std::bitset<TILE_CELLS>(mask ? selection[w] & mask[w] : selection[w]).count();
+    }
+    return count;
+}
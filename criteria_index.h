@@ -0,0 +1,121 @@
+#pragma once
+#include "common.h"
+#include "range_buckets.h"
+#include <cstdint>
+#include <list>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Cells of a range are numbered row by row, each tile of TILE_CELLS cells is one bitmap word
+inline constexpr int TILE_CELLS = 64;
+
+inline constexpr size_t DEFAULT_CRITERIA_CACHE_CAPACITY = 256; // Selection bitmaps of a sheet
+
+//// Condition of SUMIF, COUNTIF, AVERAGEIF: ">5", "<>0", "=meow", "meow", 7
+class Criterion {
+public:
+    enum class Op {
+        Eq,
+        Ne,
+        Lt,
+        Le,
+        Gt,
+        Ge,
+    };
+
+    static Criterion Parse(std::string_view text); // Operator prefix is optional --"=" by default
+
+    static Criterion Number(double value); // Criterion of a numeric argument: "=value"
+
+    [[nodiscard]] bool Matches(const CellInterface* cell) const;
+
+    [[nodiscard]] std::string GetKey() const; // Normalized text --key of the bitmap cache
+
+private:
+    Op op_ = Op::Eq;
+    std::optional<double> number_; // Set if the operand is a number
+    std::string text_; // Lowercase operand otherwise
+};
+
+//// Cells of a range that match a criterion --one bit per cell
+class SelectionBitmap {
+public:
+    SelectionBitmap(Range range, Criterion criterion, const SheetInterface& sheet);
+
+    void Update(Position pos, const SheetInterface& sheet); // Re-evaluates the criterion for a changed cell
+
+    [[nodiscard]] const std::vector<uint64_t>& GetWords() const;
+
+private:
+    Range range_;
+    Criterion criterion_;
+    std::vector<uint64_t> words_;
+};
+
+//// Numbers of a range laid out by tiles for masked kernels. Non-numeric cells hold 0 and are cleared in the mask
+class ValueColumn {
+public:
+    ValueColumn(Range range, const SheetInterface& sheet);
+
+    void Update(Position pos, const SheetInterface& sheet); // Re-reads a changed cell
+
+    [[nodiscard]] const std::vector<double>& GetValues() const; // Padded to whole tiles
+
+    [[nodiscard]] const std::vector<uint64_t>& GetNumericWords() const;
+
+private:
+    Range range_;
+    std::vector<double> values_;
+    std::vector<uint64_t> numeric_words_;
+};
+
+//// Bitmaps per (range, criterion) and value columns per range, shared by all conditional aggregates of the sheet.
+//// Both are built on the first request and updated in place when the sheet reports a changed cell. They are
+//// dropped with the last formula over their range; bitmaps above the capacity go least recently used first too,
+//// as a criterion read from a cell may take a new value on every edit
+class CriteriaIndexCache {
+public:
+    // The bitmap stays valid until the next call --it may evict any other
+    const SelectionBitmap& GetSelection(Range range, const Criterion& criterion, const SheetInterface& sheet);
+
+    const ValueColumn& GetValues(Range range, const SheetInterface& sheet);
+
+    void OnCellChanged(Position pos, const SheetInterface& sheet); // Updates bitmaps and columns that contain pos
+
+    // Drops the bitmaps and the column of a range no formula uses anymore, unless a range still in use contains it
+    void OnRangeReleased(Range range, const RangeDependents& used);
+
+    void SetCapacity(size_t capacity); // Number of bitmaps kept, at least the last one requested
+
+    void Clear();
+
+    [[nodiscard]] size_t GetSelectionCount() const;
+
+private:
+    using SelectionKey = std::pair<Range, std::string>; // Range and Criterion::GetKey()
+
+    struct Selection {
+        SelectionBitmap bitmap;
+        std::list<SelectionKey>::iterator order;
+    };
+
+    void Shrink();
+
+    void EraseSelection(std::map<SelectionKey, Selection>::iterator it);
+
+    [[nodiscard]] bool HasRange(Range range) const; // Some bitmap or the column is over the range
+
+    std::map<SelectionKey, Selection> selections_;
+    std::list<SelectionKey> order_; // Of the bitmaps, most recently used first
+    std::map<Range, ValueColumn> columns_;
+    RangeBuckets buckets_; // Ranges of the bitmaps and columns --finds those containing a changed cell
+    size_t capacity_ = DEFAULT_CRITERIA_CACHE_CAPACITY;
+};
+
+// Sum of values whose bits are set in selection & mask
+double MaskedSum(const double* values, const uint64_t* selection, const uint64_t* mask, size_t words);
+
+// Number of bits set in selection & mask --mask may be nullptr
+size_t MaskedCount(const uint64_t* selection, const uint64_t* mask, size_t words);
@@ -0,0 +1,178 @@
+#include "export.h"
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <ostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+ExportSink::ExportSink(size_t capacity)
+    : buffer_(std::max<size_t>(capacity, 64)) {
+}
+
+void ExportSink::Put(std::string_view text) {
+    if (text.size() > buffer_.size() - size_) {
+        Flush();
+        if (text.size() > buffer_.size()) {
+            Write(text.data(), text.size());
+            return;
+        }
+    }
+    std::memcpy(buffer_.data() + size_, text.data(), text.size());
+    size_ += text.size();
+}
+
+void ExportSink::PutRepeated(char c, size_t count) {
+    while (count > 0) {
+        if (size_ == buffer_.size()) Flush();
+        size_t part = std::min(count, buffer_.size() - size_);
+        std::memset(buffer_.data() + size_, c, part);
+        size_ += part;
+        count -= part;
+    }
+}
+
+void ExportSink::PutChunks(const std::string_view* chunks, size_t count) {
+    Flush();
+    WriteChunks(chunks, count);
+}
+
+void ExportSink::WriteChunks(const std::string_view* chunks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!chunks[i].empty()) Write(chunks[i].data(), chunks[i].size());
+    }
+}
+
+char* ExportSink::Reserve(size_t size) {
+    assert(size <= buffer_.size());
+    if (size > buffer_.size() - size_) Flush();
+    return buffer_.data() + size_;
+}
+
+void ExportSink::Flush() {
+    if (size_ == 0) return;
+    size_t size = size_;
+    size_ = 0;
+    Write(buffer_.data(), size);
+}
+
+StreamSink::StreamSink(std::ostream& output, size_t capacity)
+    : ExportSink(capacity)
+    , output_(output) {
+}
+
+void StreamSink::Write(const char* data, size_t size) {
+    output_.write(data, static_cast<std::streamsize>(size));
+}
+
+MemorySink::MemorySink(size_t capacity)
+    : ExportSink(capacity) {
+}
+
+const std::string& MemorySink::GetData() const {
+    return data_;
+}
+
+std::string MemorySink::TakeData() {
+    return std::move(data_);
+}
+
+void MemorySink::Write(const char* data, size_t size) {
+    data_.append(data, size);
+}
+
+FdSink::FdSink(int fd, size_t capacity)
+    : ExportSink(capacity)
+    , fd_(fd) {
+}
+
+//// A write may take only a part of the data --pipes and sockets --or be interrupted by a signal
+void FdSink::Write(const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(fd_, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+#else
+        ssize_t written = write(fd_, data, size);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw FileException(std::string("Can't write the export: ") + std::strerror(errno));
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+#ifdef _WIN32
+void FdSink::WriteChunks(const std::string_view* chunks, size_t count) {
+    ExportSink::WriteChunks(chunks, count);
+}
+#else
+//// At most IOV_MAX chunks per call; after a partial write the call is repeated from the first unwritten byte
+void FdSink::WriteChunks(const std::string_view* chunks, size_t count) {
+    std::vector<iovec> vectors;
+    vectors.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        if (!chunks[i].empty()) vectors.push_back({const_cast<char*>(chunks[i].data()), chunks[i].size()});
+    }
+    size_t next = 0;
+    while (next < vectors.size()) {
+        int part = static_cast<int>(std::min<size_t>(vectors.size() - next, IOV_MAX));
+        ssize_t written = writev(fd_, vectors.data() + next, part);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw FileException(std::string("Can't write the export: ") + std::strerror(errno));
+        }
+        auto left = static_cast<size_t>(written);
+        while (next < vectors.size() && left >= vectors[next].iov_len) {
+            left -= vectors[next].iov_len;
+            next++;
+        }
+        if (left > 0) {
+            vectors[next].iov_base = static_cast<char*>(vectors[next].iov_base) + left;
+            vectors[next].iov_len -= left;
+        }
+    }
+}
+#endif
+
+namespace {
+    std::atomic<int> number_precision{0};
+}  // namespace
+
+void SetNumberPrecision(int digits) {
+    number_precision = std::clamp(digits, 0, 17);
+}
+
+int GetNumberPrecision() {
+    return number_precision;
+}
+
+//// std::to_chars without a precision is the shortest round-trip form: fixed or scientific, whichever is shorter
+size_t FormatNumber(double value, char* buffer) {
+    int digits = number_precision.load(std::memory_order_relaxed);
+    auto result = digits == 0 ? std::to_chars(buffer, buffer + MAX_NUMBER_LENGTH, value)
+                              : std::to_chars(buffer, buffer + MAX_NUMBER_LENGTH, value, std::chars_format::general, digits);
+    return result.ptr - buffer;
+}
+
+void PutValue(ExportSink& sink, const CellInterface::Value& value) {
+    if (std::holds_alternative<double>(value)) {
+        char* buffer = sink.Reserve(MAX_NUMBER_LENGTH);
+        sink.Commit(FormatNumber(std::get<double>(value), buffer));
+    } else if (std::holds_alternative<std::string>(value)) {
+        sink.Put(std::get<std::string>(value));
+    } else {
+        const auto& error = std::get<FormulaError>(value); // as operator<<(std::ostream&, FormulaError)
+        sink.Put(error.GetCategory() == FormulaError::Category::Div0 ? "#DIV/0!" : error.ToString());
+    }
+}
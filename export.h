@@ -0,0 +1,131 @@
+#pragma once
+#include "common.h"
+#include <algorithm>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//// Buffered destination of an export. Output is collected in the buffer and handed to Write() in large
+//// chunks. Flush() passes the rest --the export functions of the sheet call it when they are done
+class ExportSink {
+public:
+    static const size_t DEFAULT_CAPACITY = size_t{1} << 16;
+
+    explicit ExportSink(size_t capacity = DEFAULT_CAPACITY);
+
+    ExportSink(const ExportSink&) = delete;
+
+    ExportSink& operator=(const ExportSink&) = delete;
+
+    virtual ~ExportSink() = default;
+
+    void Put(char c) {
+        if (size_ == buffer_.size()) Flush();
+        buffer_[size_++] = c;
+    }
+
+    void Put(std::string_view text); // Texts longer than the buffer go to Write() directly
+
+    void PutRepeated(char c, size_t count); // Runs of separators --gaps between cells
+
+    void PutChunks(const std::string_view* chunks, size_t count); // Whole pieces after the buffered output
+
+    // Room for at most size chars, the part used is confirmed by Commit(). size must not exceed the capacity
+    char* Reserve(size_t size);
+
+    void Commit(size_t size) {
+        size_ += size;
+    }
+
+    void Flush();
+
+protected:
+    virtual void Write(const char* data, size_t size) = 0;
+
+    virtual void WriteChunks(const std::string_view* chunks, size_t count); // Write() per chunk by default
+
+private:
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+};
+
+// Writes to a stream
+class StreamSink : public ExportSink {
+public:
+    explicit StreamSink(std::ostream& output, size_t capacity = DEFAULT_CAPACITY);
+
+protected:
+    void Write(const char* data, size_t size) override;
+
+private:
+    std::ostream& output_;
+};
+
+// Collects the output in memory
+class MemorySink : public ExportSink {
+public:
+    explicit MemorySink(size_t capacity = DEFAULT_CAPACITY);
+
+    [[nodiscard]] const std::string& GetData() const; // Output flushed so far
+
+    std::string TakeData(); // Moves the flushed output out
+
+protected:
+    void Write(const char* data, size_t size) override;
+
+private:
+    std::string data_;
+};
+
+// Writes to an open file descriptor: a file, a pipe or a socket. The descriptor is not closed.
+// Chunks are gathered by writev() on POSIX systems. Throws FileException if a write fails
+class FdSink : public ExportSink {
+public:
+    explicit FdSink(int fd, size_t capacity = DEFAULT_CAPACITY);
+
+protected:
+    void Write(const char* data, size_t size) override;
+
+    void WriteChunks(const std::string_view* chunks, size_t count) override;
+
+private:
+    int fd_;
+};
+
+inline constexpr size_t MAX_NUMBER_LENGTH = 32; // Longest FormatNumber() output: "-1.2345678901234567e-308"
+
+// Significant digits of numbers in value output: 0 writes the shortest text that reads back to the same double,
+// 1..17 round like printf("%.*g") --6 is the iostream default. Process-wide, 0 by default
+void SetNumberPrecision(int digits);
+
+int GetNumberPrecision();
+
+// Writes a number of a cell value to a buffer of MAX_NUMBER_LENGTH chars and returns its length.
+// Locale-independent and allocation-free
+size_t FormatNumber(double value, char* buffer);
+
+void PutValue(ExportSink& sink, const CellInterface::Value& value); // Formatted as operator<< does
+
+//// Writes the rows [first_row, last_row) of a printable area cols wide: cells separated by '\t', every row ended
+//// by '\n'. [begin, end) are the populated cells of these rows in row-major order as (Position, cell) pairs, each
+//// is written by put_cell(sink, cell). Gaps between cells are written as runs, no position is looked up
+template <typename Iterator, typename PutCell>
+void ExportRows(Iterator begin, Iterator end, int first_row, int last_row, int cols, ExportSink& sink, PutCell put_cell) {
+    int row = first_row;
+    int next_col = 0; // First column of the row not written yet
+    auto finish_row = [&]() {
+        sink.PutRepeated('\t', cols - std::max(next_col, 1));
+        sink.Put('\n');
+        row++;
+        next_col = 0;
+    };
+    for (; begin != end; ++begin) {
+        Position pos = begin->first;
+        while (row < pos.row) finish_row();
+        sink.PutRepeated('\t', pos.col + 1 - std::max(next_col, 1));
+        put_cell(sink, begin->second);
+        next_col = pos.col + 1;
+    }
+    while (row < last_row) finish_row();
+}
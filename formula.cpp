@@ -1,49 +1,216 @@
 #include "formula.h"
 #include "FormulaAST.h"
 
-#include <sstream>
+#include <cctype>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 using namespace std::literals;
 
+//// Div0 keeps the spelling the sheet always printed, the categories added later print their ToString()
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    if (fe.GetCategory() == FormulaError::Category::Div0) return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
     class Formula : public FormulaInterface {
     public:
-        explicit Formula(std::string& expression): ast_(ParseFormulaAST(expression)) {}
+        explicit Formula(std::shared_ptr<const FormulaAST> ast): ast_(std::move(ast)) {}
 
         [[nodiscard]] Value Evaluate(const SheetInterface& sheet) const override {
             try {
-                if (std::holds_alternative<double>(ast_.Execute(sheet))) {
-                    return std::get<double>(ast_.Execute(sheet));
+                auto value = ast_->Execute(sheet);
+                if (std::holds_alternative<double>(value)) {
+                    return std::get<double>(value);
                 }
-                return std::get<FormulaError>(ast_.Execute(sheet));
+                return std::get<FormulaError>(value);
             } catch (FormulaError & fe) {
                 return fe;
             }
         }
 
         [[nodiscard]] std::string GetExpression() const override {
-            std::ostringstream out;
-            ast_.PrintFormula(out);
-            return out.str();
+            return ast_->GetExpression();
         }
 
         [[nodiscard]] std::vector<Position> GetReferencedCells() const override {
-            return {ast_.GetCells().begin(), ast_.GetCells().end()};
+            return ast_->GetCells();
+        }
+
+        [[nodiscard]] std::vector<Range> GetReferencedRanges() const override {
+            return ast_->GetRanges();
+        }
+
+        void Serialize(std::string& out, Position origin) const override {
+            ast_->Serialize(out, origin);
         }
 
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_; // Shared with every formula of the same text through the cache
     };
+
+    //// Parsed formulas by normalized text, least recently used entries are evicted above the capacity
+    class FormulaCache {
+    public:
+        std::shared_ptr<const FormulaAST> Find(const std::string& key) {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end()) {
+                stats_.misses++;
+                return nullptr;
+            }
+            stats_.hits++;
+            order_.splice(order_.begin(), order_, it->second.second);
+            return it->second.first;
+        }
+
+        void Insert(const std::string& key, std::shared_ptr<const FormulaAST> ast) {
+            std::lock_guard lock(mutex_);
+            if (capacity_ == 0 || entries_.count(key) > 0) return;
+            order_.push_front(key);
+            entries_.emplace(key, std::make_pair(std::move(ast), order_.begin()));
+            Shrink();
+        }
+
+        void SetCapacity(size_t capacity) {
+            std::lock_guard lock(mutex_);
+            capacity_ = capacity;
+            Shrink();
+        }
+
+        void Clear() {
+            std::lock_guard lock(mutex_);
+            entries_.clear();
+            order_.clear();
+            stats_ = {};
+        }
+
+        FormulaCacheStats GetStats() {
+            std::lock_guard lock(mutex_);
+            FormulaCacheStats stats = stats_;
+            stats.size = entries_.size();
+            stats.capacity = capacity_;
+            return stats;
+        }
+
+    private:
+        void Shrink() {
+            while (entries_.size() > capacity_) {
+                entries_.erase(order_.back());
+                order_.pop_back();
+                stats_.evictions++;
+            }
+        }
+
+        std::mutex mutex_;
+        size_t capacity_ = DEFAULT_FORMULA_CACHE_CAPACITY;
+        std::list<std::string> order_; // Most recently used first
+        std::unordered_map<std::string, std::pair<std::shared_ptr<const FormulaAST>, std::list<std::string>::iterator>> entries_;
+        FormulaCacheStats stats_{};
+    };
+
+    FormulaCache& GetFormulaCache() {
+        static FormulaCache cache;
+        return cache;
+    }
+
+    bool IsWordChar(char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '.';
+    }
+
+    bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
 }  // namespace
 
+//// Whitespace is dropped unless it separates two tokens that would merge: "1 2", "A1 B2" or the
+//// exponent of "1E -5". String literals are kept as is
+std::string NormalizeFormula(std::string_view expression) {
+    std::string result;
+    result.reserve(expression.size());
+    for (size_t i = 0; i < expression.size(); i++) {
+        char c = expression[i];
+        if (c == '"') {
+            size_t end = expression.find('"', i + 1);
+            if (end == std::string_view::npos) end = expression.size() - 1;
+            result.append(expression.substr(i, end - i + 1));
+            i = end;
+            continue;
+        }
+        if (!IsSpace(c)) {
+            result += c;
+            continue;
+        }
+        while (i + 1 < expression.size() && IsSpace(expression[i + 1])) i++;
+        if (result.empty() || i + 1 == expression.size()) continue;
+        char prev = result.back();
+        char next = expression[i + 1];
+        bool merges = IsWordChar(prev) && IsWordChar(next);
+        bool exponent = prev == 'e' || prev == 'E'
+            || ((prev == '+' || prev == '-') && result.size() > 1 && (result[result.size() - 2] == 'e' || result[result.size() - 2] == 'E'));
+        if (merges || exponent) result += ' ';
+    }
+    return result;
+}
+
+void SetFormulaCacheCapacity(size_t capacity) {
+    GetFormulaCache().SetCapacity(capacity);
+}
+
+FormulaCacheStats GetFormulaCacheStats() {
+    return GetFormulaCache().GetStats();
+}
+
+void ClearFormulaCache() {
+    GetFormulaCache().Clear();
+}
+
+std::shared_ptr<const FormulaAST> ParseFormulaShared(const std::string& expression) {
+    if (GetParserMode() == ParserMode::Differential) { // Every text has to go through both parsers
+        return std::make_shared<const FormulaAST>(ParseFormulaAST(expression));
+    }
+    std::string key = NormalizeFormula(expression);
+    if (auto ast = GetFormulaCache().Find(key)) return ast;
+    // The text is parsed as written, the normalized key only finds formulas parsed before
+    auto ast = std::make_shared<const FormulaAST>(ParseFormulaAST(expression));
+    GetFormulaCache().Insert(key, ast);
+    return ast;
+}
+
 [[maybe_unused]] [[maybe_unused]] std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     try {
-        return std::make_unique<Formula>(expression);
-    } catch (...) {
-        throw FormulaException("flag-- FormulaException");
+        return std::make_unique<Formula>(ParseFormulaShared(expression));
+    } catch (const ParserMismatchError&) {
+        throw;
+    } catch (const FormulaException&) {
+        throw; // Says what is wrong with the text
+    } catch (const std::exception& exc) {
+        throw FormulaException(exc.what());
+    } catch (const FormulaError& error) { // A reference outside the sheet
+        throw FormulaException("Invalid reference: " + std::string(error.ToString()));
+    }
+}
+
+//// The canonical expression has no insignificant whitespace, so it is its own cache key. The AST prints its
+//// expression when built, which also tells whether the compiled form matches the text
+std::unique_ptr<FormulaInterface> LoadFormula(const std::string& expression, std::string_view compiled, Position origin) {
+    if (!expression.empty()) {
+        if (auto ast = GetFormulaCache().Find(expression)) return std::make_unique<Formula>(std::move(ast));
+    }
+    std::shared_ptr<const FormulaAST> ast;
+    try {
+        ast = std::make_shared<const FormulaAST>(DeserializeFormulaAST(compiled, origin));
+    } catch (const ParsingError& error) {
+        if (expression.empty()) throw FormulaException(error.what());
+        return ParseFormula(expression);
+    }
+    if (expression.empty()) {
+        if (auto cached = GetFormulaCache().Find(ast->GetExpression())) return std::make_unique<Formula>(std::move(cached));
+    } else if (ast->GetExpression() != expression) {
+        return ParseFormula(expression); // the form belongs to another text
     }
-}
\ No newline at end of file
+    GetFormulaCache().Insert(ast->GetExpression(), ast);
+    return std::make_unique<Formula>(std::move(ast));
+}
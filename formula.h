@@ -18,9 +18,46 @@ public:
     [[maybe_unused]] [[nodiscard]] virtual std::string GetExpression() const = 0;
 
 
-    // Returns a list of cells that are used for in the formula calculation with no duplicate cells
+    // Returns a list of cells that are used for in the formula calculation with no duplicate cells --cells
+    // referenced one by one, not those of ranges
     [[nodiscard]] virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ranges used by the formula, sorted with no duplicates
+    [[nodiscard]] virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Appends the compiled form of the formula with positions relative to origin --restored by LoadFormula()
+    // without parsing
+    virtual void Serialize(std::string& out, Position origin = {0, 0}) const = 0;
+};
+
+class FormulaAST;
+
+struct FormulaCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t size = 0; // Cached formulas
+    size_t capacity = 0;
 };
 
+inline constexpr size_t DEFAULT_FORMULA_CACHE_CAPACITY = 1 << 16;
+
+// Text with insignificant whitespace removed --key of the parse cache
+std::string NormalizeFormula(std::string_view expression);
+
+// Parsed formula shared by all formulas with the same normalized text. Throws like ParseFormulaAST
+std::shared_ptr<const FormulaAST> ParseFormulaShared(const std::string& expression);
+
+void SetFormulaCacheCapacity(size_t capacity); // Number of cached formulas, 0 disables the cache
+
+[[nodiscard]] FormulaCacheStats GetFormulaCacheStats();
+
+void ClearFormulaCache(); // Drops cached formulas and resets statistics
+
 // Parses the expression and returns the formula object. Throws FormulaException if the formula is syntactically incorrect.
-[[maybe_unused]] std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+[[maybe_unused]] std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Formula restored from its compiled form and canonical expression. Formulas with the same expression in the
+// parse cache are reused, a damaged compiled form falls back to parsing the expression. An empty expression is
+// taken from the compiled form, which then must be intact: throws FormulaException otherwise
+std::unique_ptr<FormulaInterface> LoadFormula(const std::string& expression, std::string_view compiled, Position origin = {0, 0});
@@ -0,0 +1,118 @@
+#include "importer.h"
+#include "mapped_file.h"
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define IMPORTER_SSE2
+#endif
+
+namespace {
+#ifdef IMPORTER_SSE2
+    int CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+#endif
+
+    // First delimiter or '\n' in [first, last), last if none. SSE2 compares 16 bytes per step
+    const char* FindFieldEnd(const char* first, const char* last, char delimiter) {
+#ifdef IMPORTER_SSE2
+        const __m128i delimiters = _mm_set1_epi8(delimiter);
+        const __m128i newlines = _mm_set1_epi8('\n');
+        while (last - first >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first));
+            __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, delimiters), _mm_cmpeq_epi8(chunk, newlines));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+            if (mask != 0) return first + CountTrailingZeros(mask);
+            first += 16;
+        }
+#endif
+        for (; first != last; ++first) {
+            if (*first == delimiter || *first == '\n') return first;
+        }
+        return last;
+    }
+
+    // Unescapes a field that starts with '"' into text, returns the position after the closing quote
+    const char* ReadQuoted(const char* first, const char* last, std::string& text) {
+        ++first;
+        while (true) {
+            auto quote = static_cast<const char*>(std::memchr(first, '"', last - first));
+            if (quote == nullptr) { // unterminated --the rest of the data is the field
+                text.append(first, last);
+                return last;
+            }
+            text.append(first, quote);
+            first = quote + 1;
+            if (first == last || *first != '"') return first;
+            text += '"';
+            ++first;
+        }
+    }
+
+    // Passes a batch of cells to the sheet, lazily or to a bulk load finished by the caller
+    void Flush(SheetInterface& sheet, std::vector<CellEdit>& batch, bool lazy, ImportResult& result) {
+        size_t count = batch.size();
+        std::vector<CellError> errors;
+        if (lazy) {
+            std::vector<LazyCell> cells;
+            cells.reserve(batch.size());
+            for (auto& edit : batch) cells.push_back({edit.pos, std::move(edit.text), std::nullopt});
+            errors = sheet.LoadCells(std::move(cells));
+        } else {
+            errors = sheet.BulkLoadBatch(std::move(batch));
+        }
+        result.cells += count - errors.size();
+        result.errors.insert(result.errors.end(), errors.begin(), errors.end());
+        batch.clear();
+    }
+}  // namespace
+
+ImportResult ImportTexts(SheetInterface& sheet, std::string_view data, const ImportOptions& options) {
+    ImportResult result;
+    std::vector<CellEdit> batch;
+    const char* first = data.data();
+    const char* last = data.data() + data.size();
+    size_t batch_rows = 0;
+    while (first != last) {
+        for (int col = 0;; col++) {
+            std::string text;
+            if (options.quoted && first != last && *first == '"') first = ReadQuoted(first, last, text); // after a final delimiter
+            const char* end = FindFieldEnd(first, last, options.delimiter);
+            text.append(first, end);
+            bool row_end = end == last || *end == '\n';
+            if (row_end && !text.empty() && text.back() == '\r') text.pop_back();
+
+            if (!text.empty()) {
+                Position pos{static_cast<int>(result.rows), col};
+                if (pos.IsValid()) batch.push_back({pos, std::move(text)});
+                else result.errors.push_back({pos, "Invalid position"});
+            }
+            first = end == last ? last : end + 1;
+            if (row_end) break;
+        }
+        result.rows++;
+        if (++batch_rows == options.batch_rows) {
+            Flush(sheet, batch, options.lazy, result);
+            batch_rows = 0;
+        }
+    }
+    Flush(sheet, batch, options.lazy, result);
+    if (options.lazy) return result;
+    auto cycles = sheet.FinishBulkLoad();
+    result.cells -= cycles.size();
+    result.errors.insert(result.errors.end(), cycles.begin(), cycles.end());
+    return result;
+}
+
+ImportResult ImportFile(SheetInterface& sheet, const std::string& path, const ImportOptions& options) {
+    MappedFile file(path);
+    return ImportTexts(sheet, file.GetData(), options);
+}
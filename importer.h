@@ -0,0 +1,28 @@
+#pragma once
+#include "common.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Layout of an imported file
+struct ImportOptions {
+    char delimiter = '\t'; // '\t': the format of PrintTexts, ',': CSV
+    bool quoted = false; // Fields may be wrapped in '"', "" inside is one quote --CSV
+    bool lazy = false; // Formulas are parsed when first read --SheetInterface::LoadCells()
+    size_t batch_rows = 4096; // Rows passed to the sheet at once --LoadCells() or BulkLoadBatch()
+};
+
+struct ImportResult {
+    size_t rows = 0; // Lines of the file
+    size_t cells = 0; // Non-empty fields set in the sheet
+    std::vector<CellError> errors; // Fields left out: invalid formulas and positions, cycles
+};
+
+//// Sets the cells of the sheet from delimited text: one line per row starting at row 0, one field per column.
+//// Empty fields are skipped, "\r\n" line ends are accepted. Cells go to SheetInterface::BulkLoadBatch() a batch
+//// of rows at a time and are evaluated by one FinishBulkLoad(), so every formula is evaluated once whatever the
+//// order of the rows and no more than a batch of texts is held
+ImportResult ImportTexts(SheetInterface& sheet, std::string_view data, const ImportOptions& options = {});
+
+// Same for a file mapped into memory. Throws FileException
+ImportResult ImportFile(SheetInterface& sheet, const std::string& path, const ImportOptions& options = {});
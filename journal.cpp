@@ -0,0 +1,306 @@
+#include "journal.h"
+#include "checksum.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const size_t HEADER_SIZE = sizeof(JOURNAL_MAGIC) + sizeof(uint32_t);
+    const size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t); // payload size, checksum
+    const size_t PAYLOAD_HEADER_SIZE = 1 + 2 * sizeof(int32_t); // op, row, col
+
+    FileException Failure(const std::string& what, const std::string& path) {
+        return FileException(what + " " + path + ": " + std::strerror(errno));
+    }
+
+#ifdef _WIN32
+    int OpenForAppend(const std::string& path) {
+        return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+
+    long long WriteSome(int fd, const char* data, size_t size) {
+        return _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+    }
+
+    int SyncFile(int fd) {
+        return _commit(fd);
+    }
+
+    int TruncateFile(int fd, size_t size) {
+        return _chsize_s(fd, static_cast<long long>(size));
+    }
+
+    void CloseFile(int fd) {
+        _close(fd);
+    }
+#else
+    int OpenForAppend(const std::string& path) {
+        return open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+
+    long long WriteSome(int fd, const char* data, size_t size) {
+        return write(fd, data, size);
+    }
+
+    int SyncFile(int fd) {
+        return fsync(fd);
+    }
+
+    int TruncateFile(int fd, size_t size) {
+        return ftruncate(fd, static_cast<off_t>(size));
+    }
+
+    void CloseFile(int fd) {
+        close(fd);
+    }
+#endif
+
+    // False for a file too short to hold a header --left by a crash right after it was created
+    bool CheckHeader(std::string_view data, const std::string& path) {
+        if (data.size() < HEADER_SIZE) return false;
+        uint32_t version;
+        std::memcpy(&version, data.data() + sizeof(JOURNAL_MAGIC), sizeof(version));
+        if (std::memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || version != JOURNAL_VERSION) {
+            throw FileException(path + " is not a journal");
+        }
+        return true;
+    }
+
+    // Calls visit(op, pos, text) for each intact record and returns the length of the intact part of the journal
+    template <typename Visit>
+    size_t ReadRecords(std::string_view data, Visit visit) {
+        size_t offset = HEADER_SIZE;
+        while (data.size() - offset >= RECORD_HEADER_SIZE) {
+            uint32_t size;
+            uint32_t checksum;
+            std::memcpy(&size, data.data() + offset, sizeof(size));
+            std::memcpy(&checksum, data.data() + offset + sizeof(size), sizeof(checksum));
+            if (size < PAYLOAD_HEADER_SIZE || size > data.size() - offset - RECORD_HEADER_SIZE) break;
+            std::string_view payload = data.substr(offset + RECORD_HEADER_SIZE, size);
+            if (Crc32(payload) != checksum) break;
+            auto op = static_cast<uint8_t>(payload[0]);
+            if (op > static_cast<uint8_t>(JournalOp::Clear)) break;
+            int32_t row;
+            int32_t col;
+            std::memcpy(&row, payload.data() + 1, sizeof(row));
+            std::memcpy(&col, payload.data() + 1 + sizeof(row), sizeof(col));
+            visit(static_cast<JournalOp>(op), Position{row, col}, payload.substr(PAYLOAD_HEADER_SIZE));
+            offset += RECORD_HEADER_SIZE + size;
+        }
+        return offset;
+    }
+
+    // Runs of sets go through SetCells. It applies nothing if a formula is invalid --then the cells are set one by one
+    void ApplyBatch(SheetInterface& sheet, std::vector<CellEdit>& batch, ReplayResult& result) {
+        if (batch.empty()) return;
+        auto errors = sheet.SetCells(batch);
+        if (!errors.empty() && !sheet.ValidateCells(batch).empty()) {
+            errors.clear();
+            for (auto& edit : batch) {
+                try {
+                    sheet.SetCell(edit.pos, std::move(edit.text));
+                } catch (const std::exception& exc) {
+                    errors.push_back({edit.pos, exc.what()});
+                }
+            }
+        }
+        result.errors.insert(result.errors.end(), errors.begin(), errors.end());
+        batch.clear();
+    }
+}  // namespace
+
+//// The intact part of an existing journal is found the same way replay does, anything after it is cut off so
+//// new records don't follow a torn one
+Journal::Journal(const std::string& path, const JournalOptions& options)
+    : path_(path)
+    , options_(options) {
+    size_t size = 0;
+    size_t valid = 0;
+    {
+        std::ifstream probe(path, std::ios::binary);
+        if (probe) {
+            MappedFile file(path);
+            std::string_view data = file.GetData();
+            size = data.size();
+            if (CheckHeader(data, path)) valid = ReadRecords(data, [](JournalOp, Position, std::string_view) {});
+        }
+    }
+    fd_ = OpenForAppend(path);
+    if (fd_ < 0) throw Failure("Can't open", path);
+    try {
+        if (valid < size && TruncateFile(fd_, valid) != 0) throw Failure("Can't truncate", path);
+        if (valid == 0) {
+            std::string header(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+            header.append(reinterpret_cast<const char*>(&JOURNAL_VERSION), sizeof(JOURNAL_VERSION));
+            WriteAll(header);
+        }
+        if (valid != size || valid == 0) Sync();
+    } catch (...) {
+        CloseFile(fd_);
+        throw;
+    }
+    thread_ = std::thread([this] { Run(); });
+}
+
+Journal::~Journal() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    commit_wanted_.notify_one();
+    thread_.join();
+    CloseFile(fd_);
+}
+
+uint64_t Journal::AppendSet(Position pos, std::string_view text) {
+    return Append(JournalOp::Set, pos, text);
+}
+
+uint64_t Journal::AppendClear(Position pos) {
+    return Append(JournalOp::Clear, pos, {});
+}
+
+uint64_t Journal::Append(JournalOp op, Position pos, std::string_view text) {
+    std::string payload(PAYLOAD_HEADER_SIZE + text.size(), '\0');
+    payload[0] = static_cast<char>(op);
+    int32_t row = pos.row;
+    int32_t col = pos.col;
+    std::memcpy(payload.data() + 1, &row, sizeof(row));
+    std::memcpy(payload.data() + 1 + sizeof(row), &col, sizeof(col));
+    if (!text.empty()) std::memcpy(payload.data() + PAYLOAD_HEADER_SIZE, text.data(), text.size()); // data() may be null
+    uint32_t header[2] = {static_cast<uint32_t>(payload.size()), Crc32(payload)};
+
+    std::lock_guard lock(mutex_);
+    if (error_) std::rethrow_exception(error_);
+    bool was_empty = pending_.empty();
+    pending_.append(reinterpret_cast<const char*>(header), sizeof(header));
+    pending_ += payload;
+    if (was_empty || pending_.size() >= options_.commit_bytes) commit_wanted_.notify_one();
+    return ++appended_;
+}
+
+void Journal::Commit() {
+    std::unique_lock lock(mutex_);
+    uint64_t target = appended_;
+    if (durable_ < target && !error_) {
+        commit_requested_ = true;
+        commit_wanted_.notify_one();
+        committed_.wait(lock, [&] { return durable_ >= target || error_; });
+    }
+    if (error_) std::rethrow_exception(error_);
+}
+
+uint64_t Journal::GetDurableSequence() const {
+    std::lock_guard lock(mutex_);
+    return durable_;
+}
+
+//// The commit thread can't start a write while the lock is held, and nothing is pending or being written
+void Journal::Reset() {
+    std::unique_lock lock(mutex_);
+    commit_requested_ = true;
+    commit_wanted_.notify_one();
+    committed_.wait(lock, [&] { return (pending_.empty() && durable_ == appended_) || error_; });
+    if (error_) std::rethrow_exception(error_);
+    if (TruncateFile(fd_, HEADER_SIZE) != 0) throw Failure("Can't truncate", path_);
+    Sync();
+}
+
+//// Waits for the first record, then for the rest of the commit interval unless a commit is requested or enough
+//// has been collected. Records appended during a write go to the next commit
+void Journal::Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        commit_wanted_.wait(lock, [this] { return stopping_ || commit_requested_ || !pending_.empty(); });
+        commit_wanted_.wait_for(lock, options_.commit_interval, [this] {
+            return stopping_ || commit_requested_ || pending_.size() >= options_.commit_bytes;
+        });
+        commit_requested_ = false;
+        if (!pending_.empty() && !error_) {
+            std::string batch = std::move(pending_);
+            pending_.clear();
+            uint64_t sequence = appended_;
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                WriteAll(batch);
+                Sync();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            if (error) error_ = error;
+            else durable_ = sequence;
+        }
+        committed_.notify_all();
+        if (stopping_ && (pending_.empty() || error_)) return;
+    }
+}
+
+void Journal::WriteAll(const std::string& data) {
+    const char* first = data.data();
+    size_t size = data.size();
+    while (size > 0) {
+        long long written = WriteSome(fd_, first, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw Failure("Can't write", path_);
+        }
+        first += written;
+        size -= static_cast<size_t>(written);
+    }
+}
+
+void Journal::Sync() {
+    if (SyncFile(fd_) != 0) throw Failure("Can't sync", path_);
+}
+
+ReplayResult ReplayJournal(SheetInterface& sheet, const std::string& path, size_t batch_size) {
+    ReplayResult result;
+    if (!std::ifstream(path, std::ios::binary)) return result;
+    MappedFile file(path);
+    std::string_view data = file.GetData();
+    if (!CheckHeader(data, path)) {
+        result.torn_tail = !data.empty();
+        return result;
+    }
+
+    CalculationMode mode = sheet.GetCalculationMode();
+    sheet.SetCalculationMode(CalculationMode::Manual);
+    try {
+        std::vector<CellEdit> batch;
+        size_t valid = ReadRecords(data, [&](JournalOp op, Position pos, std::string_view text) {
+            result.records++;
+            if (op == JournalOp::Set) {
+                batch.push_back({pos, std::string(text)});
+                if (batch.size() >= batch_size) ApplyBatch(sheet, batch, result);
+                return;
+            }
+            ApplyBatch(sheet, batch, result);
+            try {
+                sheet.ClearCell(pos);
+            } catch (const InvalidPositionException& exc) {
+                result.errors.push_back({pos, exc.what()});
+            }
+        });
+        ApplyBatch(sheet, batch, result);
+        result.torn_tail = valid < data.size();
+    } catch (...) {
+        sheet.SetCalculationMode(mode);
+        throw;
+    }
+    sheet.SetCalculationMode(mode);
+    return result;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include "common.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//// Journal file: a header, then one record per edit:
+////   payload size (u32) | CRC-32 of the payload (u32) | payload: op (u8), row (i32), col (i32), text
+//// in the byte order of the writing machine. A crash can leave a torn record at the end: replay stops there
+//// and opening the journal cuts it off
+
+inline constexpr char JOURNAL_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'J', 'N', 'L'};
+inline constexpr uint32_t JOURNAL_VERSION = 1;
+
+enum class JournalOp : uint8_t {
+    Set, // SetCell
+    Clear, // ClearCell
+};
+
+struct JournalOptions {
+    std::chrono::milliseconds commit_interval{10}; // Longest time an edit waits to be written and synced
+    size_t commit_bytes = size_t{1} << 20; // Pending records that start a commit before the interval ends
+};
+
+//// Append-only journal of sheet edits with group commit. Records are collected in memory and a background
+//// thread writes and syncs them in one go, so an edit never waits for the disk; Commit() waits until the
+//// records appended so far are durable. Attach it with SheetInterface::SetJournal().
+//// Recovery: load the last snapshot, ReplayJournal() onto it, then open the journal again and attach it.
+//// Checkpoint: SaveSnapshot(), then Reset() --only once SaveSnapshot() has returned, which is when the snapshot
+//// is synced to disk; if it throws the journal is still needed
+class Journal {
+public:
+    // Opens or creates the journal, a torn record at the end is cut off. Throws FileException
+    explicit Journal(const std::string& path, const JournalOptions& options = {});
+
+    Journal(const Journal&) = delete;
+
+    Journal& operator=(const Journal&) = delete;
+
+    ~Journal(); // Commits pending records
+
+    // Returns the sequence number of the record. Throws FileException if an earlier commit failed
+    uint64_t AppendSet(Position pos, std::string_view text);
+
+    uint64_t AppendClear(Position pos);
+
+    void Commit(); // Returns once every record appended so far is written and synced. Throws FileException
+
+    [[nodiscard]] uint64_t GetDurableSequence() const; // Records up to this number are on disk
+
+    void Reset(); // Commits and empties the journal --after a snapshot has taken its edits. Throws FileException
+
+private:
+    uint64_t Append(JournalOp op, Position pos, std::string_view text);
+
+    void Run(); // Commit thread
+
+    void WriteAll(const std::string& data); // Throws FileException
+
+    void Sync(); // Throws FileException
+
+    std::string path_;
+    JournalOptions options_;
+    int fd_ = -1;
+    mutable std::mutex mutex_;
+    std::condition_variable commit_wanted_;
+    std::condition_variable committed_;
+    std::string pending_; // Records not written yet
+    uint64_t appended_ = 0; // Sequence number of the last record
+    uint64_t durable_ = 0;
+    bool commit_requested_ = false;
+    bool stopping_ = false;
+    std::exception_ptr error_; // Failure of the commit thread, reported to writers
+    std::thread thread_;
+};
+
+struct ReplayResult {
+    size_t records = 0; // Records read
+    bool torn_tail = false; // The journal ended with an incomplete or damaged record
+    std::vector<CellError> errors; // Edits that couldn't be applied
+};
+
+//// Applies the journal to the sheet in order. Runs of SetCell records go through SetCells, the sheet stays in
+//// manual mode until the end so every formula is evaluated once. A missing journal applies nothing.
+//// Throws FileException if the file exists but isn't a journal
+ReplayResult ReplayJournal(SheetInterface& sheet, const std::string& path, size_t batch_size = 4096);
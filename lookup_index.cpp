@@ -0,0 +1,189 @@
+#include "lookup_index.h"
+#include "cell.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+
+std::optional<double> ReadLookupKey(const CellInterface* cell) {
+    if (cell == nullptr) return std::nullopt;
+    auto value = cell->GetValue();
+    if (std::holds_alternative<double>(value)) {
+        // An empty cell has no key, as a missing one --ranges don't create their cells
+        if (std::get<double>(value) == 0 && cell->GetText().empty()) return std::nullopt;
+        return std::get<double>(value);
+    }
+    if (std::holds_alternative<std::string>(value)) return ReadNumberText(std::get<std::string>(value));
+    return std::nullopt;
+}
+
+std::optional<double> ReadNumberText(std::string_view text) {
+    auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+    while (!text.empty() && is_space(text.front())) text.remove_prefix(1);
+    while (!text.empty() && is_space(text.back())) text.remove_suffix(1);
+    if (!text.empty() && text.front() == '+') {
+        text.remove_prefix(1);
+        if (!text.empty() && text.front() == '-') return std::nullopt; // "+-5"
+    }
+    double result;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), result);
+    if (text.empty() || ec != std::errc() || ptr != text.data() + text.size() || !std::isfinite(result)) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+std::optional<std::string> ReadLookupText(const CellInterface* cell) {
+    if (cell == nullptr) return std::nullopt;
+    auto value = cell->GetValue();
+    if (!std::holds_alternative<std::string>(value) || ReadLookupKey(cell)) return std::nullopt;
+    return std::get<std::string>(std::move(value));
+}
+
+std::string ToLowerText(std::string_view text) {
+    std::string result(text);
+    std::transform(result.begin(), result.end(), result.begin(), [](unsigned char c) { return std::tolower(c); });
+    return result;
+}
+
+LookupIndex::LookupIndex(Range range, const SheetInterface& sheet) : range_(range) {
+    Size size = range_.GetSize();
+    keys_.reserve(size.rows * size.cols);
+    for (int i = range_.from.row; i <= range_.to.row; i++) {
+        for (int j = range_.from.col; j <= range_.to.col; j++) {
+            const CellInterface* cell = sheet.GetCell({i, j});
+            keys_.push_back(ReadLookupKey(cell));
+            if (keys_.back()) continue;
+            if (auto text = ReadLookupText(cell)) texts_.emplace(static_cast<int>(keys_.size() - 1), ToLowerText(*text));
+        }
+    }
+}
+
+std::optional<int> LookupIndex::Find(double value, MatchMode mode) {
+    if (mode == MatchMode::Exact) {
+        if (!hash_built_) {
+            for (int offset = 0; offset < static_cast<int>(keys_.size()); offset++) {
+                if (keys_[offset]) hash_[*keys_[offset]].insert(offset);
+            }
+            hash_built_ = true;
+        }
+        auto it = hash_.find(value);
+        if (it == hash_.end()) return std::nullopt;
+        return *it->second.begin();
+    }
+    if (!sorted_built_) {
+        for (int offset = 0; offset < static_cast<int>(keys_.size()); offset++) {
+            if (keys_[offset]) sorted_[*keys_[offset]].insert(offset);
+        }
+        sorted_built_ = true;
+    }
+    if (mode == MatchMode::NextSmaller) {
+        auto it = sorted_.upper_bound(value);
+        if (it == sorted_.begin()) return std::nullopt;
+        return *std::prev(it)->second.begin();
+    }
+    auto it = sorted_.lower_bound(value);
+    if (it == sorted_.end()) return std::nullopt;
+    return *it->second.begin();
+}
+
+std::optional<int> LookupIndex::FindText(std::string_view text) {
+    if (!text_hash_built_) {
+        for (const auto& [offset, key] : texts_) text_hash_[key].insert(offset);
+        text_hash_built_ = true;
+    }
+    auto it = text_hash_.find(ToLowerText(text));
+    if (it == text_hash_.end()) return std::nullopt;
+    return *it->second.begin();
+}
+
+void LookupIndex::Update(Position pos, const SheetInterface& sheet) {
+    int offset = ToOffset(pos);
+    const CellInterface* cell = sheet.GetCell(pos);
+    auto key = ReadLookupKey(cell);
+    std::optional<std::string> text;
+    if (!key) {
+        if (auto value = ReadLookupText(cell)) text = ToLowerText(*value);
+    }
+    SetText(offset, std::move(text));
+    if (key == keys_[offset]) return;
+    Erase(offset);
+    keys_[offset] = key;
+    Insert(offset);
+}
+
+Range LookupIndex::GetRange() const {
+    return range_;
+}
+
+int LookupIndex::ToOffset(Position pos) const {
+    return (pos.row - range_.from.row) * range_.GetSize().cols + (pos.col - range_.from.col);
+}
+
+void LookupIndex::Insert(int offset) {
+    if (!keys_[offset]) return;
+    if (hash_built_) hash_[*keys_[offset]].insert(offset);
+    if (sorted_built_) sorted_[*keys_[offset]].insert(offset);
+}
+
+void LookupIndex::Erase(int offset) {
+    if (!keys_[offset]) return;
+    if (hash_built_) {
+        auto it = hash_.find(*keys_[offset]);
+        it->second.erase(offset);
+        if (it->second.empty()) hash_.erase(it);
+    }
+    if (sorted_built_) {
+        auto it = sorted_.find(*keys_[offset]);
+        it->second.erase(offset);
+        if (it->second.empty()) sorted_.erase(it);
+    }
+}
+
+void LookupIndex::SetText(int offset, std::optional<std::string> text) {
+    auto it = texts_.find(offset);
+    if (it == texts_.end() ? !text : text && it->second == *text) return;
+    if (it != texts_.end()) {
+        if (text_hash_built_) {
+            auto hash_it = text_hash_.find(it->second);
+            hash_it->second.erase(offset);
+            if (hash_it->second.empty()) text_hash_.erase(hash_it);
+        }
+        texts_.erase(it);
+    }
+    if (!text) return;
+    if (text_hash_built_) text_hash_[*text].insert(offset);
+    texts_.emplace(offset, std::move(*text));
+}
+
+LookupIndex& LookupIndexCache::Get(Range range, const SheetInterface& sheet) {
+    auto it = indexes_.find(range);
+    if (it == indexes_.end()) {
+        it = indexes_.emplace(range, LookupIndex(range, sheet)).first;
+        buckets_.Insert(range);
+    }
+    return it->second;
+}
+
+void LookupIndexCache::OnCellChanged(Position pos, const SheetInterface& sheet) {
+    buckets_.ForEachContaining(pos, [&](Range range) { indexes_.at(range).Update(pos, sheet); });
+}
+
+void LookupIndexCache::OnRangeReleased(Range range, const RangeDependents& used) {
+    for (Range indexed : {range, Range{range.from, {range.to.row, range.from.col}}}) {
+        auto it = indexes_.find(indexed);
+        if (it == indexes_.end() || used.IsCovered(indexed)) continue;
+        indexes_.erase(it);
+        buckets_.Erase(indexed);
+    }
+}
+
+void LookupIndexCache::Clear() {
+    indexes_.clear();
+    buckets_.Clear();
+}
+
+size_t LookupIndexCache::GetIndexCount() const {
+    return indexes_.size();
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include "common.h"
+#include "range_buckets.h"
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// How a lookup value is matched against the keys of a range
+enum class MatchMode {
+    Exact,        // key == value
+    NextSmaller,  // largest key <= value
+    NextLarger,   // smallest key >= value
+};
+
+//// Index over a one-column or one-row range of the sheet.
+//// Keys are the numeric values of the cells and the lowercase texts of text cells that can't be read as a number,
+//// empty cells are skipped. Hash indexes (exact match) and sorted index (approximate match) are built lazily on the
+//// first request; texts are matched exactly only
+class LookupIndex {
+public:
+    LookupIndex(Range range, const SheetInterface& sheet); // Reads keys of the range --O(rows)
+
+    [[nodiscard]] std::optional<int> Find(double value, MatchMode mode); // Offset of the first matching cell in the range
+
+    [[nodiscard]] std::optional<int> FindText(std::string_view text); // Exact match ignoring case, as Find()
+
+    void Update(Position pos, const SheetInterface& sheet); // Re-reads the key of a changed cell --O(log rows)
+
+    [[nodiscard]] Range GetRange() const;
+
+private:
+    [[nodiscard]] int ToOffset(Position pos) const;
+
+    void Insert(int offset);
+
+    void Erase(int offset);
+
+    void SetText(int offset, std::optional<std::string> text);
+
+    Range range_;
+    std::vector<std::optional<double>> keys_; // Key per offset of the range
+    std::unordered_map<int, std::string> texts_; // Text key per offset --text cells only
+    bool text_hash_built_ = false;
+    std::unordered_map<std::string, std::set<int>> text_hash_; // Exact match: text -> offsets
+    bool hash_built_ = false;
+    std::unordered_map<double, std::set<int>> hash_; // Exact match: key -> offsets
+    bool sorted_built_ = false;
+    std::map<double, std::set<int>> sorted_; // Approximate match: ordered key -> offsets
+};
+
+//// Lookup indexes of the sheet. One index per range is shared by every formula that looks up in that range,
+//// the sheet reports every changed cell so the indexes are updated in place instead of being rebuilt, and every
+//// range its formulas stopped using so the indexes built for it are dropped
+class LookupIndexCache {
+public:
+    LookupIndex& Get(Range range, const SheetInterface& sheet); // Index for the range --built on the first call
+
+    void OnCellChanged(Position pos, const SheetInterface& sheet); // Updates indexes that contain pos
+
+    // Drops the indexes looked up in a range no formula uses anymore --the range itself and its first column, the
+    // table of VLOOKUP-- unless a range still in use contains them
+    void OnRangeReleased(Range range, const RangeDependents& used);
+
+    void Clear();
+
+    [[nodiscard]] size_t GetIndexCount() const;
+
+private:
+    std::map<Range, LookupIndex> indexes_;
+    RangeBuckets buckets_; // Ranges of the indexes --finds those containing a changed cell
+};
+
+std::optional<double> ReadLookupKey(const CellInterface* cell); // Numeric key of the cell or nullopt if the cell has none
+
+// Number written as a text: optional spaces, an optional '+' or '-', a decimal number with an optional fraction and
+// exponent, optional spaces --" +5 ", "-1.5e3". The whole text must be read: "3D" is not a number, nor are hex
+// numbers, "inf" and "nan"
+std::optional<double> ReadNumberText(std::string_view text);
+
+// Text of a cell that has no numeric key: a text that can't be read as a number. nullopt for other cells
+std::optional<std::string> ReadLookupText(const CellInterface* cell);
+
+std::string ToLowerText(std::string_view text); // ASCII letters lowered --texts are matched ignoring case
@@ -1,8 +1,22 @@
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <thread>
 #include <utility>
 
+#include "AsciiCharStream.h"
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
+#include "criteria_index.h"
+#include "export.h"
 #include "formula.h"
+#include "importer.h"
+#include "journal.h"
+#include "lookup_index.h"
+#include "sheet_view.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -198,6 +212,15 @@ namespace {
 
         sheet->SetCell("E2"_pos, "3D");
         ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value))
+
+        for (const char* text : {"+5", " 5", "5 ", " +5e0\t"}) {
+            sheet->SetCell("E2"_pos, text);
+            ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(), CellInterface::Value(5.0))
+        }
+        ASSERT_EQUAL(ReadNumberText("-1.5e3").value_or(0), -1500.0)
+        for (const char* text : {"5 5", "+-5", "+ 5", "0x1A", "inf", "nan", "", " ", "+"}) {
+            ASSERT(!ReadNumberText(text))
+        }
     }
 
     void TestErrorDiv0() {
@@ -239,7 +262,7 @@ namespace {
     void TestEmptyCellTreatedAsZero() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=B2");
-        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0))
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0))
     }
 
     void TestFormulaInvalidPosition() {
@@ -260,6 +283,7 @@ namespace {
         try_formula("=XFD16385");
         try_formula("=XFE16384");
         try_formula("=R2D2");
+        ASSERT_EQUAL(sheet->ValidateCells({{"A1"_pos, "=XFE16384"}})[0].message, "Invalid reference: #REF!")
     }
 
     void TestPrint() {
@@ -337,6 +361,1117 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready")
     }
 
+    void TestLookupIndex() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "10");
+        sheet->SetCell("A2"_pos, "20");
+        sheet->SetCell("A3"_pos, "meow");
+        sheet->SetCell("A4"_pos, "40");
+
+        LookupIndexCache& cache = *sheet->GetLookupCache();
+        Range range{"A1"_pos, "A5"_pos};
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(20, MatchMode::Exact).value_or(-1), 1)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(30, MatchMode::Exact).value_or(-1), -1)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(30, MatchMode::NextSmaller).value_or(-1), 1)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(30, MatchMode::NextLarger).value_or(-1), 3)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(5, MatchMode::NextSmaller).value_or(-1), -1)
+        ASSERT_EQUAL(cache.Get(range, *sheet).FindText("MEOW").value_or(-1), 2)
+
+        // Index is updated in place by the sheet
+        sheet->SetCell("A3"_pos, "30");
+        sheet->SetCell("A5"_pos, "50");
+        sheet->ClearCell("A2"_pos);
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(30, MatchMode::Exact).value_or(-1), 2)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(45, MatchMode::NextLarger).value_or(-1), 4)
+        ASSERT_EQUAL(cache.Get(range, *sheet).Find(20, MatchMode::Exact).value_or(-1), -1)
+        ASSERT_EQUAL(cache.Get(range, *sheet).FindText("meow").value_or(-1), -1)
+        sheet->SetCell("A1"_pos, "'Meow");
+        ASSERT_EQUAL(cache.Get(range, *sheet).FindText("meow").value_or(-1), 0)
+        ASSERT_EQUAL(cache.GetIndexCount(), 1u)
+    }
+
+    void TestLookupFunctions() {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < 5; ++i) {
+            sheet->SetCell(Position{i, 0}, std::to_string((i + 1) * 10));
+            sheet->SetCell(Position{i, 1}, std::to_string(i * i));
+        }
+        auto value = [&](Position pos, std::string text) {
+            sheet->SetCell(pos, std::move(text));
+            return sheet->GetCell(pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(value("D1"_pos, "=VLOOKUP(30, A1:B5, 2, 0)"), CellInterface::Value(4.0))
+        ASSERT_EQUAL(value("D2"_pos, "=VLOOKUP(35, A1:B5, 2)"), CellInterface::Value(4.0))
+        ASSERT_EQUAL(value("D3"_pos, "=VLOOKUP(35, A1:B5, 2, 0)"), CellInterface::Value(FormulaError::Category::NA))
+        ASSERT_EQUAL(value("D4"_pos, "=MATCH(40, A1:A5, 0)"), CellInterface::Value(4.0))
+        ASSERT_EQUAL(value("D5"_pos, "=XLOOKUP(45, A1:A5, B1:B5, 1)"), CellInterface::Value(16.0))
+        ASSERT_EQUAL(value("D6"_pos, "=VLOOKUP(10, A1:B5, 3, 0)"), CellInterface::Value(FormulaError::Category::Ref))
+        ASSERT_EQUAL(sheet->GetCell("D5"_pos)->GetText(), "=XLOOKUP(45,A1:A5,B1:B5,1)")
+
+        // All lookups in the same range share one index
+        ASSERT_EQUAL(sheet->GetLookupCache()->GetIndexCount(), 1u)
+
+        sheet->SetCell("A3"_pos, "35");
+        ASSERT_EQUAL(value("D7"_pos, "=VLOOKUP(35, A1:B5, 2, 0)+1"), CellInterface::Value(5.0))
+
+        // Texts are matched exactly, ignoring case
+        sheet->SetCell("A2"_pos, "Meow");
+        sheet->SetCell("C1"_pos, "MEOW");
+        ASSERT_EQUAL(value("D8"_pos, "=VLOOKUP(\"meow\", A1:B5, 2, 0)"), CellInterface::Value(1.0))
+        ASSERT_EQUAL(value("D9"_pos, "=MATCH(C1, A1:A5, 0)"), CellInterface::Value(2.0))
+        ASSERT_EQUAL(value("D10"_pos, "=MATCH(C1, A1:A5)"), CellInterface::Value(FormulaError::Category::NA))
+        sheet->SetCell("C1"_pos, "purr");
+        ASSERT_EQUAL(sheet->GetCell("D9"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA))
+        ASSERT_EQUAL(sheet->GetLookupCache()->GetIndexCount(), 1u)
+
+        // Indexes are dropped with the last formula over their range
+        for (int i = 0; i < 10; ++i) {
+            sheet->ClearCell(Position{i, 3});
+        }
+        ASSERT_EQUAL(sheet->GetLookupCache()->GetIndexCount(), 0u)
+
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(isIncorrect("VLOOKUP(1, A1:B2)"))
+        ASSERT(isIncorrect("VLOOKUP(1, 2, 3)"))
+        ASSERT(isIncorrect("LOOKUP(1, A1:B2, 2)"))
+        ASSERT(isIncorrect("A1:B2"))
+    }
+
+    void TestCriteriaIndex() {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < 100; ++i) {
+            sheet->SetCell(Position{i, 0}, i % 2 ? "odd" : "even");
+            sheet->SetCell(Position{i, 1}, std::to_string(i));
+        }
+        CriteriaIndexCache& cache = *sheet->GetCriteriaCache();
+        Range labels{"A1"_pos, "A100"_pos};
+        Range numbers{"B1"_pos, "B100"_pos};
+
+        const auto& odd = cache.GetSelection(labels, Criterion::Parse("ODD"), *sheet).GetWords();
+        const ValueColumn& column = cache.GetValues(numbers, *sheet);
+        ASSERT_EQUAL(odd.size(), 2u)
+        ASSERT_EQUAL(MaskedCount(odd.data(), nullptr, odd.size()), 50u)
+        ASSERT_EQUAL(MaskedSum(column.GetValues().data(), odd.data(), column.GetNumericWords().data(), odd.size()), 2500.0)
+
+        const auto& big = cache.GetSelection(numbers, Criterion::Parse(">=90"), *sheet).GetWords();
+        ASSERT_EQUAL(MaskedCount(big.data(), nullptr, big.size()), 10u)
+
+        // Bitmaps and values are updated in place
+        sheet->SetCell("A2"_pos, "even");
+        sheet->SetCell("B2"_pos, "meow");
+        sheet->SetCell("B100"_pos, "1000");
+        ASSERT_EQUAL(MaskedCount(odd.data(), nullptr, odd.size()), 49u)
+        ASSERT_EQUAL(MaskedSum(column.GetValues().data(), odd.data(), column.GetNumericWords().data(), odd.size()), 3400.0)
+        ASSERT_EQUAL(MaskedCount(big.data(), nullptr, big.size()), 10u)
+        ASSERT_EQUAL(cache.GetSelectionCount(), 2u)
+
+        // Least recently used bitmaps go above the capacity
+        cache.SetCapacity(2);
+        cache.GetSelection(labels, Criterion::Parse("odd"), *sheet);
+        const auto& small = cache.GetSelection(numbers, Criterion::Parse("<5"), *sheet).GetWords();
+        ASSERT_EQUAL(cache.GetSelectionCount(), 2u)
+        sheet->SetCell("B1"_pos, "7");
+        ASSERT_EQUAL(MaskedCount(small.data(), nullptr, small.size()), 3u)
+        cache.SetCapacity(DEFAULT_CRITERIA_CACHE_CAPACITY);
+    }
+
+    void TestConditionalAggregates() {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < 10; ++i) {
+            sheet->SetCell(Position{i, 0}, i < 4 ? "cat" : "dog");
+            sheet->SetCell(Position{i, 1}, std::to_string(i + 1));
+        }
+        auto value = [&](Position pos, std::string text) {
+            sheet->SetCell(pos, std::move(text));
+            return sheet->GetCell(pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(value("D1"_pos, "=SUMIF(A1:A10, \"cat\", B1:B10)"), CellInterface::Value(10.0))
+        ASSERT_EQUAL(value("D2"_pos, "=COUNTIF(A1:A10, \"<>cat\")"), CellInterface::Value(6.0))
+        ASSERT_EQUAL(value("D3"_pos, "=AVERAGEIF(B1:B10, \">5\")"), CellInterface::Value(8.0))
+        ASSERT_EQUAL(value("D4"_pos, "=COUNTIF(B1:B10, 3)"), CellInterface::Value(1.0))
+        ASSERT_EQUAL(value("D5"_pos, "=AVERAGEIF(A1:A10, \"bird\", B1:B10)"), CellInterface::Value(FormulaError::Category::Div0))
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "=SUMIF(A1:A10,\"cat\",B1:B10)")
+
+        sheet->SetCell("A5"_pos, "cat");
+        ASSERT_EQUAL(value("D6"_pos, "=SUMIF(A1:A10, \"cat\", B1:B10)"), CellInterface::Value(15.0))
+        ASSERT_EQUAL(value("D7"_pos, "=SUMIF(A1:A10, \"cat\", B1:B9)"), CellInterface::Value(FormulaError::Category::Value))
+        ASSERT_EQUAL(value("D8"_pos, "=COUNTIF(A1:A10, A1)"), CellInterface::Value(5.0)) // criterion in a text cell
+        ASSERT(sheet->GetCriteriaCache()->GetSelectionCount() > 0)
+
+        // Bitmaps and columns are dropped with the last formula over their range
+        sheet->SetCell("D8"_pos, "=COUNTIF(A1:A9, A1)");
+        for (int i = 0; i < 7; ++i) {
+            sheet->ClearCell(Position{i, 3});
+        }
+        ASSERT_EQUAL(sheet->GetCriteriaCache()->GetSelectionCount(), 1u)
+        sheet->ClearCell("D8"_pos);
+        ASSERT_EQUAL(sheet->GetCriteriaCache()->GetSelectionCount(), 0u)
+    }
+
+    void TestRangeDependencies() {
+        auto sheet = CreateSheet();
+        auto value = [&](Position pos) {
+            return std::get<double>(sheet->GetCell(pos)->GetValue());
+        };
+        sheet->SetCell("AA1"_pos, "=COUNTIF(A1:Z16384, 1)");
+        sheet->SetCell("AB1"_pos, "=AA1*2");
+        ASSERT_EQUAL(value("AA1"_pos), 0.0)
+        ASSERT(sheet->GetPrintableSize() == (Size{1, 28})) // cells of the range are not created
+        ASSERT(sheet->GetCell("AA1"_pos)->GetReferencedCells().empty())
+
+        sheet->SetCell("C5"_pos, "1");
+        ASSERT_EQUAL(value("AA1"_pos), 1.0)
+        ASSERT_EQUAL(value("AB1"_pos), 2.0)
+        sheet->ClearCell("C5"_pos);
+        ASSERT_EQUAL(value("AA1"_pos), 0.0)
+        ASSERT_EQUAL(value("AB1"_pos), 0.0)
+
+        for (const char* text : {"=AB1", "=COUNTIF(B2:C3, 1)"}) {
+            try {
+                sheet->SetCell("B2"_pos, text); // in the range of AA1, or its own range
+                ASSERT(false)
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        ASSERT(sheet->GetCell("B2"_pos)->GetText().empty())
+
+        ASSERT(sheet->BulkLoad({{"D7"_pos, "1"}, {"Z16384"_pos, "=1"}}).empty())
+        ASSERT_EQUAL(value("AA1"_pos), 2.0)
+        ASSERT(sheet->LoadCells({{"E7"_pos, "1", std::nullopt}}).empty())
+        ASSERT_EQUAL(value("AA1"_pos), 3.0)
+        ASSERT_EQUAL(value("AB1"_pos), 6.0)
+
+        FormulaLimits defaults = GetFormulaLimits();
+        FormulaLimits limits = defaults;
+        limits.max_range_area = 100;
+        SetFormulaLimits(limits);
+        ClearFormulaCache();
+        try {
+            sheet->SetCell("AC1"_pos, "=COUNTIF(A1:J11, 1)");
+            ASSERT(false)
+        } catch (const FormulaException&) {
+        }
+        sheet->SetCell("AC1"_pos, "=COUNTIF(A1:J10, 1)");
+        ASSERT_EQUAL(value("AC1"_pos), 2.0)
+        SetFormulaLimits(defaults);
+    }
+
+    void TestManualCalculation() {
+        auto sheet = CreateSheet();
+        sheet->SetCalculationMode(CalculationMode::Manual);
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1*2");
+        sheet->SetCell("C1"_pos, "=A1+B1");
+        sheet->SetCell("D1"_pos, "=B1+C1");
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 3u)
+
+        sheet->Recalculate();
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 0u)
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0))
+
+        // Edits only mark dependents stale
+        sheet->SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 3u)
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0))
+
+        // Cycles are still rejected at once
+        try {
+            sheet->SetCell("A1"_pos, "=D1");
+            ASSERT(false)
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "10")
+
+        sheet->SetCalculationMode(CalculationMode::Automatic);
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 0u)
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(50.0))
+
+        sheet->SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 0u)
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0))
+
+        sheet->ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0))
+    }
+
+    void TestParserDifferential() {
+        const std::vector<std::string> corpus = {
+            "1", "  -1  ", "2 + 2*2", "(2+3)*4 + (3-4)*5", "-A1*2", "+(A1-B2)/-C3", "1-2-3", "8/4/2",
+            ".5e-3+1E+2", "((1))", "VLOOKUP(3, A1:B9, 2, 0)", "SUMIF(B9:A1, \">=5\")+MATCH(1, C1:C3)",
+            "1+", "A0", "1.", "(1", "A1:B2", "SUMIF(A1:A2, \"x\", 1)", "VLOOKUP()", "R2D2", "1 2", "\"x\"",
+            "MATCH(XLOOKUP(1, A1:A3, B1:B3), C1:C3, -(1))*2", "1-COUNTIF(A1:A9, (2))/VLOOKUP(A1, B1:C2, MATCH(1, D1:D2))",
+            "MATCH(1, A1:A2, 1, 1, 1)",
+        };
+        SetParserMode(ParserMode::Differential);
+        for (const auto& formula : corpus) {
+            try {
+                ParseFormula(formula);
+            } catch (const FormulaException&) {
+                // both parsers rejected it
+            } catch (const ParserMismatchError&) {
+                SetParserMode(ParserMode::Fast);
+                throw;
+            }
+        }
+        SetParserMode(ParserMode::Fast);
+    }
+
+    void TestAsciiCharStream() {
+        ASSERT(AsciiCharStream::IsAscii("A1+VLOOKUP(1, B1:C3, 2)"))
+        ASSERT(!AsciiCharStream::IsAscii("SUMIF(A1:A3, \"\xc3\xa9t\xc3\xa9\")"))
+
+        std::string text = "A1+2";
+        AsciiCharStream stream;
+        stream.Load(text);
+        ASSERT_EQUAL(stream.size(), 4u)
+        ASSERT_EQUAL(stream.LA(1), size_t{'A'})
+        stream.consume();
+        stream.consume();
+        ASSERT_EQUAL(stream.LA(-1), size_t{'1'})
+        ASSERT_EQUAL(stream.LA(1), size_t{'+'})
+        ASSERT_EQUAL(stream.getText(antlr4::misc::Interval(size_t{1}, size_t{3})), "1+2")
+        stream.seek(4);
+        ASSERT_EQUAL(stream.LA(1), size_t(antlr4::IntStream::EOF))
+    }
+
+    void TestFormulaCache() {
+        ASSERT_EQUAL(NormalizeFormula(" ( A1 + 2 ) * B2 "), "(A1+2)*B2")
+        ASSERT_EQUAL(NormalizeFormula("1 2"), "1 2")
+        ASSERT_EQUAL(NormalizeFormula("1E - 5"), "1E -5")
+        ASSERT_EQUAL(NormalizeFormula("COUNTIF(A1:A3, \" a  b \")"), "COUNTIF(A1:A3,\" a  b \")")
+
+        ClearFormulaCache();
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int i = 1; i < 100; ++i) {
+            sheet->SetCell(Position{i, 0}, i % 2 ? "=A1 + 2" : "=A1+2");
+        }
+        ASSERT_EQUAL(GetFormulaCacheStats().misses, 1u)
+        ASSERT_EQUAL(GetFormulaCacheStats().hits, 98u)
+        ASSERT_EQUAL(sheet->GetCell("A50"_pos)->GetValue(), CellInterface::Value(3.0))
+        ASSERT_EQUAL(sheet->GetCell("A51"_pos)->GetText(), "=A1+2")
+
+        SetFormulaCacheCapacity(2);
+        ParseFormula("1");
+        ParseFormula("2");
+        ParseFormula("3");
+        ASSERT_EQUAL(GetFormulaCacheStats().size, 2u)
+        ASSERT_EQUAL(GetFormulaCacheStats().evictions, 2u)
+        SetFormulaCacheCapacity(DEFAULT_FORMULA_CACHE_CAPACITY);
+    }
+
+    void TestBulkSetCells() {
+        auto sheet = CreateSheet();
+        std::vector<CellEdit> batch;
+        for (int i = 0; i < 1000; ++i) {
+            // Dependents arrive before their precedents
+            batch.push_back({Position{i, 1}, "=A" + std::to_string(i + 1) + "*2"});
+            batch.push_back({Position{i, 0}, std::to_string(i)});
+        }
+
+        auto bad_batch = batch;
+        bad_batch.push_back({"C1"_pos, "=1+"});
+        bad_batch.push_back({Position{-1, 0}, "1"});
+        auto errors = sheet->ValidateCells(bad_batch);
+        ASSERT_EQUAL(errors.size(), 2u)
+        ASSERT_EQUAL(errors[0].pos, "C1"_pos)
+        ASSERT(errors[0].message.find("unexpected") != std::string::npos) // the parser's own message
+        ASSERT_EQUAL(sheet->SetCells(bad_batch).size(), 2u)
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}))
+
+        ASSERT(sheet->SetCells(batch).empty())
+        ASSERT_EQUAL(sheet->GetDirtyCount(), 0u)
+        ASSERT_EQUAL(sheet->GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1998.0))
+
+        errors = sheet->SetCells({{"A1"_pos, "=B1"}, {"C1"_pos, "=B1+1"}});
+        ASSERT_EQUAL(errors.size(), 1u)
+        ASSERT_EQUAL(errors[0].pos, "A1"_pos)
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0))
+    }
+
+    void TestFlatAST() {
+        using ASTImpl::NodeType;
+        auto ast = ParseFormulaASTFast("-(A1+2)*SUMIF(B1:B3, \">1\", C1:C3)");
+        const auto& nodes = ast.GetNodes();
+        ASSERT_EQUAL(nodes.size(), 9u)
+        ASSERT(nodes.back().type == NodeType::BinaryOp)
+        ASSERT(nodes[nodes.back().first].type == NodeType::UnaryOp)
+        ASSERT(nodes[nodes[nodes.back().first].next].type == NodeType::Function)
+        for (size_t i = 0; i < nodes.size(); i++) {
+            // post order: children are always before the parent
+            ASSERT(nodes[i].first == ASTImpl::NO_NODE || nodes[i].first < i)
+        }
+        ASSERT_EQUAL(ast.GetStrings(), ">1")
+        ASSERT_EQUAL(ast.GetCells().size(), 1u)
+        ASSERT(ast.GetCells().front() == "A1"_pos)
+        ASSERT_EQUAL(ast.GetRanges().size(), 2u)
+        ASSERT(ast.GetRanges().front() == Range::FromPositions("B1"_pos, "B3"_pos))
+
+        std::ostringstream tree;
+        ast.Print(tree);
+        ASSERT_EQUAL(tree.str(), "(* (- (+ A1 2)) (SUMIF B1:B3 \">1\" C1:C3))")
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "2");
+        sheet->SetCell("C1"_pos, "10");
+        FormulaAST copy = ast;
+        ASSERT_EQUAL(std::get<double>(copy.Execute(*sheet)), -30.0)
+        std::ostringstream text;
+        copy.PrintFormula(text);
+        ASSERT_EQUAL(text.str(), "-(A1+2)*SUMIF(B1:B3,\">1\",C1:C3)")
+    }
+
+    void TestFormulaPrinter() {
+        auto ast = ParseFormulaASTFast("(1.5e-5 + AA10)");
+        ASSERT_EQUAL(ast.GetExpression(), "1.5e-05+AA10")
+
+        auto long_ast = ParseFormulaASTFast("SUMIF(A1:A3, \"abc\", B1:B3) / (1234567 - ZZ99)");
+        const std::string& text = long_ast.GetExpression();
+        ASSERT_EQUAL(text, "SUMIF(A1:A3,\"abc\",B1:B3)/(1.23457e+06-ZZ99)")
+
+        char buffer[8];
+        ASSERT_EQUAL(long_ast.PrintFormula(buffer, sizeof(buffer)), text.size())
+        ASSERT_EQUAL(std::string(buffer, sizeof(buffer)), text.substr(0, sizeof(buffer)))
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=  (B1 +  2) * 3");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "=(B1+2)*3")
+    }
+
+    void TestA1Codec() {
+        char buffer[Position::MAX_STRING_LENGTH];
+        Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+        ASSERT_EQUAL(std::string(buffer, last.ToChars(buffer)), "XFD16384")
+        ASSERT_EQUAL(Position::NONE.ToChars(buffer), 0u)
+        ASSERT(Position::FromString("A01") == "A1"_pos)
+        ASSERT(Position::FromString("A-1") == Position::NONE)
+        ASSERT(Position::FromString("A1 ") == Position::NONE)
+        ASSERT(Position::FromString("a1") == Position::NONE)
+        ASSERT(Position::FromString("A99999999999") == Position::NONE)
+
+        std::vector<Position> positions = {"A1"_pos, Position::NONE, "ZZ100"_pos};
+        std::vector<char> text(positions.size() * Position::MAX_STRING_LENGTH);
+        std::vector<size_t> ends(positions.size());
+        size_t length = PositionsToChars(positions.data(), positions.size(), text.data(), ends.data());
+        ASSERT_EQUAL(std::string(text.data(), length), "A1ZZ100")
+        ASSERT_EQUAL(ends, (std::vector<size_t>{2, 2, 7}))
+
+        std::vector<std::string_view> views = {"A1", "", "ZZ100"};
+        std::vector<Position> decoded(views.size());
+        PositionsFromStrings(views.data(), views.size(), decoded.data());
+        ASSERT_EQUAL(decoded, positions)
+    }
+
+    void TestDeepFormulas() {
+        std::string chain = "A1";
+        for (int i = 1; i < 20000; i++) chain += i % 2 ? "+1" : "-A1";
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("B1"_pos, "=" + chain);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), -9996.0)
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=" + chain)
+
+        auto isIncorrect = [](std::string expression) {
+            try {
+                ParseFormula(std::move(expression));
+            } catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(isIncorrect(std::string(2000, '(') + "1" + std::string(2000, ')')))
+
+        FormulaLimits defaults = GetFormulaLimits();
+        FormulaLimits limits = defaults;
+        limits.max_depth = 4000;
+        SetFormulaLimits(limits);
+        auto ast = ParseFormulaASTFast(std::string(2000, '-') + "1");
+        std::ostringstream tree;
+        ast.Print(tree);
+        ASSERT_EQUAL(tree.str().size(), 2000u * 4 + 1)
+        ASSERT_EQUAL(std::get<double>(ast.Execute(*sheet)), 1.0)
+
+        limits.max_length = 100;
+        SetFormulaLimits(limits);
+        ClearFormulaCache();
+        ASSERT(isIncorrect(chain))
+        limits.max_length = defaults.max_length;
+        limits.max_nodes = 1000;
+        SetFormulaLimits(limits);
+        ASSERT(isIncorrect(chain + "+2"))
+        SetFormulaLimits(defaults);
+    }
+
+    void TestImportTexts() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "meow");
+        sheet->SetCell("C1"_pos, "=A2*2");
+        sheet->SetCell("A2"_pos, "3");
+        sheet->SetCell("B3"_pos, "=COUNTIF(A1:A2, \">1\")");
+        sheet->SetCell("D3"_pos, "'=escaped");
+        std::ostringstream texts;
+        sheet->PrintTexts(texts);
+
+        ImportOptions options;
+        options.batch_rows = 2;
+        auto imported = CreateSheet();
+        auto result = ImportTexts(*imported, texts.str(), options);
+        ASSERT_EQUAL(result.rows, 3u)
+        ASSERT_EQUAL(result.cells, 5u)
+        ASSERT(result.errors.empty())
+        std::ostringstream imported_texts;
+        imported->PrintTexts(imported_texts);
+        ASSERT_EQUAL(imported_texts.str(), texts.str())
+        ASSERT_EQUAL(std::get<double>(imported->GetCell("C1"_pos)->GetValue()), 6.0)
+        ASSERT_EQUAL(std::get<double>(imported->GetCell("B3"_pos)->GetValue()), 1.0)
+
+        ImportOptions csv;
+        csv.delimiter = ',';
+        csv.quoted = true;
+        auto csv_sheet = CreateSheet();
+        result = ImportTexts(*csv_sheet, "1,\"a,\"\"b\"\"\",=A1+\r\n,,=A1*10", csv);
+        ASSERT_EQUAL(result.rows, 2u)
+        ASSERT_EQUAL(result.cells, 3u)
+        ASSERT_EQUAL(result.errors.size(), 1u)
+        ASSERT(result.errors[0].pos == "C1"_pos)
+        ASSERT_EQUAL(csv_sheet->GetCell("B1"_pos)->GetText(), "a,\"b\"")
+        ASSERT_EQUAL(std::get<double>(csv_sheet->GetCell("C2"_pos)->GetValue()), 10.0)
+        ASSERT(csv_sheet->GetCell("C1"_pos) == nullptr)
+        const std::vector<char> trailing{'a', ','}; // a delimiter ends the data --nothing may be read past it
+        result = ImportTexts(*CreateSheet(), std::string_view(trailing.data(), trailing.size()), csv);
+        ASSERT_EQUAL(result.rows, 1u)
+        ASSERT_EQUAL(result.cells, 1u)
+
+        const std::string path = "import_test.tsv";
+        std::ofstream(path) << texts.str();
+        auto file_sheet = CreateSheet();
+        result = ImportFile(*file_sheet, path);
+        std::remove(path.c_str());
+        ASSERT_EQUAL(result.cells, 5u)
+        ASSERT_EQUAL(std::get<double>(file_sheet->GetCell("C1"_pos)->GetValue()), 6.0)
+    }
+
+    void TestSnapshot() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "=A1*3");
+        sheet->SetCell("B1"_pos, "'=text");
+        sheet->SetCell("B2"_pos, "=SUMIF(A1:A2, \">1\", A1:A2) + C9");
+        sheet->SetCell("C1"_pos, "=1/0");
+        sheet->SetCell("D1"_pos, "=COUNTIF(A1:B2, \"=text\")");
+
+        const std::string path = "snapshot_test.bin";
+        sheet->SaveSnapshot(path);
+        ClearFormulaCache();
+        auto loaded = LoadSnapshot(path);
+        std::ostringstream texts, loaded_texts, values, loaded_values;
+        sheet->PrintTexts(texts);
+        loaded->PrintTexts(loaded_texts);
+        sheet->PrintValues(values);
+        loaded->PrintValues(loaded_values);
+        ASSERT_EQUAL(loaded_texts.str(), texts.str())
+        ASSERT_EQUAL(loaded_values.str(), values.str())
+        ASSERT(loaded->GetCell("C9"_pos) != nullptr)
+        ASSERT(loaded->GetCell("B2"_pos)->GetReferencedCells() == sheet->GetCell("B2"_pos)->GetReferencedCells())
+        ASSERT(loaded->GetCell("B2"_pos)->GetReferencedRanges() == sheet->GetCell("B2"_pos)->GetReferencedRanges())
+        ASSERT_EQUAL(GetFormulaCacheStats().size, 0u) // nothing is loaded until evaluated
+
+        loaded->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("A2"_pos)->GetValue()), 15.0)
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("B2"_pos)->GetValue()), 20.0)
+        ASSERT(GetFormulaCacheStats().size > 0)
+        try {
+            loaded->SetCell("C9"_pos, "=B2");
+            ASSERT(false)
+        } catch (const CircularDependencyException&) {
+        }
+
+        // Stale cells and the mode survive a round trip through loaded and not yet loaded formulas
+        loaded->SetCalculationMode(CalculationMode::Manual);
+        loaded->SetCell("A1"_pos, "1");
+        loaded->SaveSnapshot(path);
+        auto reloaded = LoadSnapshot(path);
+        ASSERT(reloaded->GetCalculationMode() == CalculationMode::Manual)
+        ASSERT_EQUAL(reloaded->GetDirtyCount(), loaded->GetDirtyCount())
+        reloaded->Recalculate();
+        ASSERT_EQUAL(std::get<double>(reloaded->GetCell("A2"_pos)->GetValue()), 3.0)
+        ASSERT(std::get<FormulaError>(reloaded->GetCell("C1"_pos)->GetValue()) == FormulaError(FormulaError::Category::Div0))
+
+        for (const std::string formula : {"-(A1+2)/B3*4", "XLOOKUP(1, A1:A9, B1:B9, -1)", "COUNTIF(A1:B2, \"<>x\")"}) {
+            auto ast = ParseFormulaAST(formula);
+            std::string compiled;
+            ast.Serialize(compiled);
+            auto restored = DeserializeFormulaAST(compiled);
+            ASSERT_EQUAL(restored.GetExpression(), ast.GetExpression())
+            ASSERT(restored.GetCells() == ast.GetCells())
+            bool damaged = false;
+            try {
+                DeserializeFormulaAST(std::string_view(compiled).substr(0, compiled.size() - 1));
+            } catch (const ParsingError&) {
+                damaged = true;
+            }
+            ASSERT(damaged)
+            ASSERT_EQUAL(LoadFormula(ast.GetExpression(), "")->GetExpression(), ast.GetExpression()) // parsed again
+        }
+
+#ifdef __linux__
+        { // Formulas not loaded yet release the mapping with the sheet
+            const std::string mapped_path = "snapshot_mapped_test.bin";
+            sheet->SaveSnapshot(mapped_path);
+            ASSERT(LoadSnapshot(mapped_path)->GetCell("A2"_pos) != nullptr)
+            std::ifstream maps("/proc/self/maps");
+            std::string mappings{std::istreambuf_iterator<char>(maps), std::istreambuf_iterator<char>()};
+            std::remove(mapped_path.c_str());
+            ASSERT(mappings.find(mapped_path) == std::string::npos)
+        }
+#endif
+
+        std::ofstream(path, std::ios::binary) << "not a snapshot";
+        bool rejected = false;
+        try {
+            LoadSnapshot(path);
+        } catch (const FileException&) {
+            rejected = true;
+        }
+        std::remove(path.c_str());
+        ASSERT(rejected)
+    }
+
+    void TestExportSinks() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("B2"_pos, "x");
+        sheet->SetCell("D4"_pos, "=1/3");
+        sheet->SetCell("A5"_pos, "'t");
+        MemorySink values(1); // smallest buffer, flushed on the way
+        sheet->ExportValues(values);
+        ASSERT_EQUAL(values.GetData(), "\t\t\t\n\tx\t\t\n\t\t\t\n\t\t\t0.3333333333333333\nt\t\t\t\n")
+        MemorySink texts;
+        sheet->ExportTexts(texts);
+        ASSERT_EQUAL(texts.GetData(), "\t\t\t\n\tx\t\t\n\t\t\t\n\t\t\t=1/3\n't\t\t\t\n")
+        std::ostringstream printed;
+        sheet->PrintTexts(printed);
+        ASSERT_EQUAL(printed.str(), texts.GetData())
+
+        auto errors = CreateSheet();
+        errors->SetCell("A1"_pos, "5");
+        errors->SetCell("B1"_pos, "=VLOOKUP(99, A1:A1, 1, 0)");
+        errors->SetCell("C1"_pos, "=1/0");
+        errors->SetCell("D1"_pos, "=VLOOKUP(5, A1:A1, 2, 0)");
+        MemorySink error_values;
+        errors->ExportValues(error_values);
+        ASSERT_EQUAL(error_values.GetData(), "5\t#N/A\t#DIV/0!\t#REF!\n")
+        std::ostringstream printed_errors;
+        errors->PrintValues(printed_errors);
+        ASSERT_EQUAL(printed_errors.str(), error_values.GetData())
+
+        const std::string long_text(1000, 'z');
+        sheet->SetCell("C1"_pos, long_text);
+        MemorySink small(64);
+        sheet->ExportTexts(small);
+        ASSERT_EQUAL(small.GetData().substr(0, long_text.size() + 3), "\t\t" + long_text + "\t")
+
+        auto sparse = CreateSheet();
+        sparse->SetCell({Position::MAX_ROWS - 1, 2}, "end");
+        MemorySink far;
+        sparse->ExportTexts(far);
+        ASSERT_EQUAL(far.GetData().size(), static_cast<size_t>(Position::MAX_ROWS) * 3 + 3)
+        ASSERT_EQUAL(far.GetData().substr(far.GetData().size() - 6), "\t\tend\n")
+    }
+
+    void TestNumberFormat() {
+        auto format = [](double value) {
+            char buffer[MAX_NUMBER_LENGTH];
+            return std::string(buffer, FormatNumber(value, buffer));
+        };
+        ASSERT_EQUAL(format(35), "35")
+        ASSERT_EQUAL(format(-0.5), "-0.5")
+        ASSERT_EQUAL(format(0.1 + 0.2), "0.30000000000000004")
+        ASSERT_EQUAL(format(1e20), "1e+20")
+        ASSERT_EQUAL(format(-1.2345678901234567e-308), "-1.2345678901234567e-308")
+        for (double value : {1.0 / 3, 2.0 / 7 * 1e-9, 123456789.125, 6.02214076e23}) {
+            std::string text = format(value);
+            double parsed = 0;
+            std::from_chars(text.data(), text.data() + text.size(), parsed);
+            ASSERT_EQUAL(parsed, value)
+        }
+
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=2/3");
+        sheet->SetCell("B1"_pos, "=1234567*10");
+        std::ostringstream shortest;
+        sheet->PrintValues(shortest);
+        ASSERT_EQUAL(shortest.str(), "0.6666666666666666\t12345670\n")
+        std::ostringstream value;
+        value << sheet->GetCell("A1"_pos)->GetValue();
+        ASSERT_EQUAL(value.str(), "0.6666666666666666")
+
+        SetNumberPrecision(6);
+        std::ostringstream rounded;
+        sheet->PrintValues(rounded);
+        SetNumberPrecision(0);
+        ASSERT_EQUAL(rounded.str(), "0.666667\t1.23457e+07\n")
+    }
+
+    void TestParallelExport() {
+        auto sheet = CreateSheet();
+        std::vector<CellEdit> edits;
+        for (int i = 0; i < 300; i++) {
+            if (i % 17 == 5) continue; // empty rows
+            for (int j = (i * 7) % 5; j < 12; j += 1 + i % 4) {
+                std::string text = j % 3 == 0 ? std::to_string(i * j) : j % 3 == 1 ? "t" + std::to_string(i) : "=A" + std::to_string(i + 1) + "/7";
+                edits.push_back({{i, j}, text});
+            }
+        }
+        ASSERT(sheet->SetCells(edits).empty())
+        MemorySink serial_values, serial_texts;
+        sheet->ExportValues(serial_values);
+        sheet->ExportTexts(serial_texts);
+
+        for (bool vectored : {true, false}) {
+            ExportOptions options;
+            options.threads = 4;
+            options.band_rows = 7;
+            options.vectored = vectored;
+            MemorySink values, texts;
+            sheet->ExportValues(values, options);
+            sheet->ExportTexts(texts, options);
+            ASSERT_EQUAL(values.GetData(), serial_values.GetData())
+            ASSERT_EQUAL(texts.GetData(), serial_texts.GetData())
+        }
+#ifndef _WIN32
+        std::FILE* file = std::tmpfile();
+        {
+            FdSink sink(fileno(file), 64);
+            ExportOptions options;
+            options.threads = 3;
+            options.band_rows = 1;
+            sheet->ExportValues(sink, options);
+        }
+        std::string written(serial_values.GetData().size() + 1, '\0');
+        std::rewind(file);
+        written.resize(std::fread(written.data(), 1, written.size(), file));
+        std::fclose(file);
+        ASSERT_EQUAL(written, serial_values.GetData())
+#endif
+    }
+
+    void TestJournal() {
+        const std::string path = "journal_test.log";
+        const std::string base = "journal_test.bin";
+        std::remove(path.c_str());
+        auto texts = [](const SheetInterface& sheet) {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+            sheet.PrintValues(out);
+            return out.str();
+        };
+
+        auto sheet = CreateSheet();
+        auto journal = std::make_shared<Journal>(path);
+        sheet->SetJournal(journal);
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("A2"_pos, "=A1+1");
+        ASSERT(sheet->SetCells({{"B1"_pos, "x"}, {"B2"_pos, "=A2*2"}, {"B3"_pos, "=B2"}}).empty())
+        sheet->ClearCell("B1"_pos);
+        try {
+            sheet->SetCell("A1"_pos, "=B2"); // rejected, not journaled
+        } catch (const CircularDependencyException&) {
+        }
+        journal->Commit();
+        ASSERT_EQUAL(journal->GetDurableSequence(), 6u)
+
+        auto restored = CreateSheet();
+        auto result = ReplayJournal(*restored, path);
+        ASSERT_EQUAL(result.records, 6u)
+        ASSERT(!result.torn_tail && result.errors.empty())
+        ASSERT_EQUAL(texts(*restored), texts(*sheet))
+        ASSERT(restored->GetCell("B1"_pos) == nullptr)
+
+        // Checkpoint: the snapshot takes the edits, the journal keeps only the later ones
+        sheet->SaveSnapshot(base);
+        journal->Reset();
+        sheet->SetCell("A1"_pos, "10");
+        journal->Commit();
+        sheet->SetJournal(nullptr);
+        journal.reset();
+        std::ofstream(path, std::ios::binary | std::ios::app) << "torn"; // crash in the middle of a record
+
+        auto recovered = LoadSnapshot(base);
+        result = ReplayJournal(*recovered, path);
+        ASSERT_EQUAL(result.records, 1u)
+        ASSERT(result.torn_tail)
+        ASSERT_EQUAL(texts(*recovered), texts(*sheet))
+        ASSERT_EQUAL(std::get<double>(recovered->GetCell("B3"_pos)->GetValue()), 22.0)
+
+        {
+            Journal reopened(path); // cuts the torn record off
+            reopened.AppendSet("C1"_pos, "=A1");
+        }
+        auto again = LoadSnapshot(base);
+        result = ReplayJournal(*again, path);
+        ASSERT(!result.torn_tail)
+        ASSERT_EQUAL(result.records, 2u)
+        ASSERT_EQUAL(std::get<double>(again->GetCell("C1"_pos)->GetValue()), 10.0)
+        std::remove(path.c_str());
+        std::remove(base.c_str());
+    }
+
+    void TestLazyLoad() {
+        ClearFormulaCache();
+        auto sheet = CreateSheet();
+        std::vector<LazyCell> cells;
+        cells.push_back({"A1"_pos, "2", std::nullopt});
+        cells.push_back({"A2"_pos, "=A1*3", std::nullopt});
+        cells.push_back({"A3"_pos, "=A2 + 1", 100.0}); // saved values are trusted
+        cells.push_back({"B1"_pos, "=1+", std::nullopt});
+        cells.push_back({"C1"_pos, "=C2", std::nullopt});
+        cells.push_back({"C2"_pos, "=C1", std::nullopt});
+        cells.push_back({"Z1"_pos, "=A1/0", FormulaError(FormulaError::Category::Div0)});
+        ASSERT(sheet->LoadCells(std::move(cells)).empty())
+        ASSERT_EQUAL(GetFormulaCacheStats().size, 0u) // nothing is parsed until read
+
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()), 100.0)
+        ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "=A2+1")
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()), 6.0) // reached from A3
+        ASSERT_EQUAL(GetFormulaCacheStats().size, 2u)
+        ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("B1"_pos)->GetValue()), "=1+") // invalid: a text
+        ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("C1"_pos)->GetValue()), "=C2") // in a cycle: a text
+        ASSERT(sheet->GetCell("C2"_pos)->GetReferencedCells().empty())
+
+        sheet->SetCell("A1"_pos, "5"); // resolves the rest
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()), 16.0)
+        ASSERT(std::get<FormulaError>(sheet->GetCell("Z1"_pos)->GetValue()) == FormulaError(FormulaError::Category::Div0))
+
+        const std::string texts = "1\t=A1+1\t=B1*C2\n\t=B1*2\t=A1/0\n";
+        auto eager = CreateSheet();
+        auto lazy = CreateSheet();
+        ImportTexts(*eager, texts);
+        ImportOptions options;
+        options.lazy = true;
+        auto result = ImportTexts(*lazy, texts, options);
+        ASSERT_EQUAL(result.cells, 5u)
+        ASSERT_EQUAL(std::get<double>(lazy->GetCell("B2"_pos)->GetValue()), 4.0)
+        std::ostringstream eager_values, lazy_values;
+        eager->PrintValues(eager_values);
+        lazy->PrintValues(lazy_values);
+        ASSERT_EQUAL(lazy_values.str(), eager_values.str())
+    }
+
+    void TestBulkLoad() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("E1"_pos, "=F1*2");
+        sheet->SetCell("G1"_pos, "=H1");
+        std::vector<CellEdit> cells;
+        for (int row = 999; row > 0; row--) { // dependents before their precedents
+            cells.push_back({{row, 1}, "=B" + std::to_string(row) + "+1"});
+        }
+        cells.push_back({"B1"_pos, "1"});
+        cells.push_back({"A1"_pos, "=A2"});
+        cells.push_back({"A2"_pos, "=A3"});
+        cells.push_back({"A3"_pos, "=A1"});
+        cells.push_back({"A4"_pos, "=A1+1"}); // behind the cycle, not in it
+        cells.push_back({"D1"_pos, "=D1"});
+        cells.push_back({"D2"_pos, "=1+"});
+        cells.push_back({"F1"_pos, "3"});
+        cells.push_back({"H1"_pos, "=G1"}); // closes a cycle with a cell of the sheet
+        auto errors = sheet->BulkLoad(std::move(cells));
+
+        std::set<Position> rejected;
+        for (const auto& error : errors) rejected.insert(error.pos);
+        ASSERT(rejected == (std::set<Position>{"A1"_pos, "A2"_pos, "A3"_pos, "D1"_pos, "D2"_pos, "H1"_pos}))
+        ASSERT_EQUAL(errors.size(), 6u)
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1000"_pos)->GetValue()), 1000.0)
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A4"_pos)->GetValue()), 1.0)
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "")
+        ASSERT(sheet->GetCell("D2"_pos) == nullptr)
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("E1"_pos)->GetValue()), 6.0)
+        ASSERT_EQUAL(sheet->GetCell("G1"_pos)->GetText(), "=H1")
+        sheet->SetCell("A1"_pos, "5"); // the emptied cells are still linked
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A4"_pos)->GetValue()), 6.0)
+
+        auto manual = CreateSheet();
+        manual->SetCalculationMode(CalculationMode::Manual);
+        ASSERT(manual->BulkLoad({{"A2"_pos, "=A1*2"}, {"A1"_pos, "=B1+1"}, {"B1"_pos, "4"}}).empty())
+        ASSERT_EQUAL(manual->GetDirtyCount(), 2u)
+        manual->Recalculate();
+        ASSERT_EQUAL(std::get<double>(manual->GetCell("A2"_pos)->GetValue()), 10.0)
+
+        // A self reference among many dependents --found whatever the addresses of the cells: A1 comes last here
+        auto self = CreateSheet();
+        std::vector<CellEdit> self_cells;
+        for (int i = 0; i < 64; ++i) self_cells.push_back({Position{i, 1}, "=A1"});
+        self_cells.push_back({"A1"_pos, "=A1+1"});
+        auto self_errors = self->BulkLoad(std::move(self_cells));
+        ASSERT_EQUAL(self_errors.size(), 1u)
+        ASSERT_EQUAL(self_errors[0].pos, "A1"_pos)
+
+        auto batched = CreateSheet(); // references and cycles across batches
+        ASSERT(batched->BulkLoadBatch({{"A1"_pos, "=A2+1"}, {"B1"_pos, "=B2"}}).empty())
+        ASSERT(batched->BulkLoadBatch({{"A2"_pos, "2"}, {"B2"_pos, "=B1"}}).empty())
+        auto cycles = batched->FinishBulkLoad();
+        ASSERT_EQUAL(cycles.size(), 2u)
+        ASSERT_EQUAL(std::get<double>(batched->GetCell("A1"_pos)->GetValue()), 3.0)
+        ASSERT_EQUAL(batched->GetCell("B2"_pos)->GetText(), "")
+        ASSERT(batched->FinishBulkLoad().empty())
+    }
+
+    void TestDeltaSnapshot() {
+        auto sheet = CreateSheet();
+        for (int row = 0; row < 200; row++) {
+            for (int col = 0; col < 160; col += 5) sheet->SetCell({row, col}, "v" + std::to_string(row * 160 + col));
+        }
+        sheet->SetCell("A1"_pos, "0");
+        sheet->SetCell("Z100"_pos, "=A1*2"); // another tile, depends on the first
+        sheet->SetCell("C150"_pos, "text");
+        const std::string base = "delta_test_base.bin";
+        const std::string delta = "delta_test_delta.bin";
+        ASSERT(!sheet->SaveDelta(delta)) // no base yet
+        sheet->SaveSnapshot(base);
+        ASSERT_EQUAL(sheet->GetChangedTileCount(), 0u)
+
+        sheet->SetCell("A1"_pos, "5"); // recalculates Z100 in its own tile
+        sheet->ClearCell("C150"_pos);
+        ASSERT_EQUAL(sheet->GetChangedTileCount(), 3u)
+        ASSERT(sheet->SaveDelta(delta))
+        ASSERT(std::ifstream(delta, std::ios::binary | std::ios::ate).tellg() * 2 < std::ifstream(base, std::ios::binary | std::ios::ate).tellg())
+
+        auto check = [&](const SheetInterface& loaded) {
+            std::ostringstream texts, loaded_texts, values, loaded_values;
+            sheet->PrintTexts(texts);
+            loaded.PrintTexts(loaded_texts);
+            sheet->PrintValues(values);
+            loaded.PrintValues(loaded_values);
+            ASSERT_EQUAL(loaded_texts.str(), texts.str())
+            ASSERT_EQUAL(loaded_values.str(), values.str())
+        };
+        auto loaded = LoadSnapshot(base, delta);
+        check(*loaded);
+        ASSERT_EQUAL(loaded->GetChangedTileCount(), 3u) // the next delta still covers them
+        loaded->SetCell("A1"_pos, "7"); // links between cells of the base and of the delta
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("Z100"_pos)->GetValue()), 14.0)
+        ASSERT_EQUAL(LoadSnapshot(base, "missing_delta.bin")->GetCell("A1"_pos)->GetText(), "0")
+
+        // A compaction interrupted before the delta was removed leaves a delta of the old base
+        sheet->SetCell("B2"_pos, "=A1+1");
+        sheet->SaveSnapshot(base);
+        check(*LoadSnapshot(base, delta));
+
+        AutosaveOptions options;
+        ASSERT(!Autosave(*sheet, base, delta, options)) // no changes, small delta
+        options.max_delta_ratio = 0;
+        sheet->SetCell("A2"_pos, "1");
+        ASSERT(Autosave(*sheet, base, delta, options))
+        ASSERT(!std::ifstream(delta))
+        ASSERT_EQUAL(sheet->GetChangedTileCount(), 0u)
+        check(*LoadSnapshot(base, delta));
+        std::remove(base.c_str());
+    }
+
+    void TestSnapshotCompression() {
+        auto sheet = CreateSheet();
+        const int rows = 1000;
+        std::vector<CellEdit> edits;
+        for (int i = 0; i < rows; i++) {
+            std::string row = std::to_string(i + 1);
+            edits.push_back({{i, 0}, std::to_string(1000 + i)}); // ids
+            edits.push_back({{i, 1}, i % 3 == 0 ? "north" : "south"});
+            edits.push_back({{i, 2}, "=A" + row + "*2"}); // one template
+            edits.push_back({{i, 3}, i % 2 == 0 ? "=1/0" : "=A" + row + "/7"});
+            if (i % 10 == 0) edits.push_back({{i, 5}, "gap"});
+        }
+        int row = rows;
+        for (const char* text : {"007", "-0", "12345678901234567890", "-42", "'5"}) edits.push_back({{row++, 6}, text});
+        edits.push_back({{0, 7}, "=0*-1"});
+        sheet->SetCells(edits);
+
+        const std::string path = "compression_test.bin";
+        sheet->SaveSnapshot(path);
+        auto size = static_cast<size_t>(std::ifstream(path, std::ios::binary | std::ios::ate).tellg());
+        ASSERT(size < edits.size() * 4) // a 48-byte record per cell before
+        auto loaded = LoadSnapshot(path);
+        std::ostringstream texts, loaded_texts, values, loaded_values;
+        sheet->PrintTexts(texts);
+        loaded->PrintTexts(loaded_texts);
+        sheet->PrintValues(values);
+        loaded->PrintValues(loaded_values);
+        ASSERT_EQUAL(loaded_texts.str(), texts.str())
+        ASSERT_EQUAL(loaded_values.str(), values.str())
+        ASSERT(std::signbit(std::get<double>(loaded->GetCell("H1"_pos)->GetValue())))
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("D2"_pos)->GetValue()), 1001.0 / 7)
+        loaded->SetCell("A3"_pos, "1"); // templates compiled at one cell evaluate at another
+        ASSERT_EQUAL(std::get<double>(loaded->GetCell("C3"_pos)->GetValue()), 2.0)
+        ASSERT_EQUAL(loaded->GetCell("C500"_pos)->GetText(), "=A500*2")
+
+        // Any flipped byte is found on load, a cached value included
+        auto flipped = CreateSheet();
+        flipped->SetCell("A1"_pos, "=1/3");
+        flipped->SaveSnapshot(path);
+        std::string bytes;
+        {
+            std::ifstream file(path, std::ios::binary);
+            bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        double third = 1.0 / 3;
+        auto value_at = bytes.find(std::string_view(reinterpret_cast<const char*>(&third), sizeof(third)));
+        ASSERT(value_at != std::string::npos)
+        bytes[value_at] ^= 1;
+        std::ofstream(path, std::ios::binary) << bytes;
+        std::string message;
+        try {
+            LoadSnapshot(path);
+        } catch (const FileException& error) {
+            message = error.what();
+        }
+        ASSERT(message.find("checksum mismatch") != std::string::npos)
+
+        // A damaged template is found on load, not when the formula is first evaluated
+        auto small = CreateSheet();
+        small->SetCell("B2"_pos, "=A1*2");
+        small->SaveSnapshot(path);
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(-1, std::ios::end);
+            file.put('\xff'); // the operator of the root
+        }
+        bool rejected = false;
+        try {
+            LoadSnapshot(path);
+        } catch (const FileException&) {
+            rejected = true;
+        }
+        std::remove(path.c_str());
+        ASSERT(rejected)
+    }
+
+    void TestConcurrentReaders() {
+        auto sheet = CreateSheet();
+        const int chain = 50; // A1 is a number, every next cell adds 1
+        std::vector<LazyCell> cells{{{0, 0}, "0", std::nullopt}};
+        for (int i = 1; i < chain; i++) cells.push_back({{i, 0}, "=A" + std::to_string(i) + "+1", static_cast<double>(i)});
+        sheet->LoadCells(cells); // parsed by the first read lock
+        const SheetInterface& view = *sheet;
+
+        const int edits = 200;
+        std::atomic<int> torn{0};
+        std::atomic<bool> done{false};
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&] {
+                while (!done) {
+                    auto lock = view.LockForReading();
+                    double first = std::get<double>(view.GetCell({1, 0})->GetValue());
+                    double last = std::get<double>(view.GetCell({chain - 1, 0})->GetValue());
+                    if (last != first + chain - 2) torn++;
+                    std::ostringstream values;
+                    view.PrintValues(values);
+                }
+            });
+        }
+        for (int k = 1; k <= edits; k++) {
+            auto lock = sheet->LockForWriting();
+            sheet->SetCell({0, 0}, std::to_string(k));
+        }
+        done = true;
+        for (auto& reader : readers) reader.join();
+        ASSERT_EQUAL(torn.load(), 0)
+        auto lock = view.LockForReading();
+        ASSERT_EQUAL(std::get<double>(view.GetCell({chain - 1, 0})->GetValue()), static_cast<double>(edits + chain - 1))
+    }
+
+    void TestConcurrentLazyReaders() {
+        auto sheet = CreateSheet();
+        const int chain = 100; // Column c starts with c, every next cell adds 1 --evaluated when resolved
+        std::vector<LazyCell> cells;
+        for (int col = 0; col < 4; col++) {
+            cells.push_back({{0, col}, std::to_string(col), std::nullopt});
+            for (int row = 1; row < chain; row++) {
+                cells.push_back({{row, col}, "=" + Position{row - 1, col}.ToString() + "+1", std::nullopt});
+            }
+        }
+        sheet->LoadCells(cells);
+        const SheetInterface& view = *sheet;
+
+        std::atomic<int> wrong{0};
+        std::vector<std::thread> readers;
+        for (int col = 0; col < 4; col++) {
+            readers.emplace_back([&, col] { // each reader resolves its own column, then the others
+                auto lock = view.LockForReading();
+                for (int k = 0; k < 4; k++) {
+                    int c = (col + k) % 4;
+                    for (int row = chain - 1; row >= 0; row -= 7) {
+                        if (std::get<double>(view.GetCell({row, c})->GetValue()) != c + row) wrong++;
+                    }
+                }
+            });
+        }
+        for (auto& reader : readers) reader.join();
+        ASSERT_EQUAL(wrong.load(), 0)
+    }
+
+    void TestSheetViews() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "=A1*3");
+        sheet->SetCell("B1"_pos, "'=text");
+        sheet->SetCell("C1"_pos, "=1/0");
+        sheet->SetCell("CZ200"_pos, "far"); // another tile
+        auto print = [](const auto& source) {
+            std::ostringstream values, texts;
+            source.PrintValues(values);
+            source.PrintTexts(texts);
+            return values.str() + texts.str();
+        };
+        const std::string before = print(*sheet);
+
+        auto view = sheet->Snapshot();
+        ASSERT_EQUAL(print(*view), before)
+        ASSERT(sheet->Snapshot() == view) // nothing changed
+        ASSERT_EQUAL(view->GetCellCount(), 5u)
+        ASSERT(view->GetCell("A2"_pos)->GetReferencedCells() == std::vector<Position>{"A1"_pos})
+        ASSERT(view->GetCell("D1"_pos) == nullptr)
+
+        // Edits go on while the view is read without a lock
+        std::atomic<bool> changed{false};
+        std::thread reader([&] {
+            while (!changed) {
+                if (print(*view) != before) changed = true;
+            }
+        });
+        for (int i = 0; i < 200; i++) sheet->SetCell("A1"_pos, std::to_string(i));
+        sheet->ClearCell("B1"_pos);
+        changed = true;
+        reader.join();
+        ASSERT_EQUAL(print(*view), before)
+        ASSERT_EQUAL(std::get<double>(view->GetCell("A2"_pos)->GetValue()), 6.0)
+
+        auto next = sheet->Snapshot();
+        ASSERT_EQUAL(print(*next), print(*sheet))
+        ASSERT(next->GetCell("B1"_pos) == nullptr)
+        ASSERT(next->GetCell("CZ200"_pos) == view->GetCell("CZ200"_pos)) // unchanged tile shared
+        ASSERT(next->GetCell("A2"_pos) != view->GetCell("A2"_pos))
+
+        const std::string path = "view_test.bin";
+        sheet->SaveSnapshot(path);
+        auto loaded = LoadSnapshot(path);
+        std::remove(path.c_str());
+        ASSERT_EQUAL(print(*loaded->Snapshot()), print(*sheet))
+        try {
+            [[maybe_unused]] auto cell = view->GetCell(Position::NONE);
+            ASSERT(false)
+        } catch (const InvalidPositionException&) {
+        }
+    }
+
     void TestCustomCoutOutput() {
         auto sheet = CreateSheet();
         auto try_formula = [&sheet](Position pos, std::string text) {
@@ -379,6 +1514,7 @@ namespace {
 }  // namespace
 
 int main() {
+    WarmUpFormulaParser();
     TestRunner tr;
     /* */
     RUN_TEST(tr, TestPositionAndStringConversion); /// --Ok
@@ -400,6 +1536,33 @@ int main() {
     RUN_TEST(tr, TestCellReferences); /// --Ok
     RUN_TEST(tr, TestFormulaIncorrect); /// --Ok
     RUN_TEST(tr, TestCellCircularReferences); /// --Ok
+    RUN_TEST(tr, TestLookupIndex);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestCriteriaIndex);
+    RUN_TEST(tr, TestConditionalAggregates);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestManualCalculation);
+    RUN_TEST(tr, TestParserDifferential);
+    RUN_TEST(tr, TestAsciiCharStream);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestBulkSetCells);
+    RUN_TEST(tr, TestFlatAST);
+    RUN_TEST(tr, TestFormulaPrinter);
+    RUN_TEST(tr, TestA1Codec);
+    RUN_TEST(tr, TestDeepFormulas);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestExportSinks);
+    RUN_TEST(tr, TestNumberFormat);
+    RUN_TEST(tr, TestParallelExport);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestDeltaSnapshot);
+    RUN_TEST(tr, TestLazyLoad);
+    RUN_TEST(tr, TestBulkLoad);
+    RUN_TEST(tr, TestSnapshotCompression);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestConcurrentLazyReaders);
+    RUN_TEST(tr, TestSheetViews);
     RUN_TEST(tr, TestCustomCoutOutput); /// --main exits with zero
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "mapped_file.h"
+#include "common.h"
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) throw FileException("Can't open " + path);
+    buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+    if (input.bad()) throw FileException("Can't read " + path);
+}
+
+MappedFile::~MappedFile() = default;
+
+std::string_view MappedFile::GetData() const {
+    return buffer_;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw FileException("Can't open " + path);
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw FileException("Can't read " + path);
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    if (size_ > 0) {
+        address_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address_ == MAP_FAILED) {
+            address_ = nullptr;
+            close(fd);
+            throw FileException("Can't map " + path);
+        }
+        madvise(address_, size_, MADV_SEQUENTIAL);
+    }
+    close(fd); // the mapping stays valid
+}
+
+MappedFile::~MappedFile() {
+    if (address_) munmap(address_, size_);
+}
+
+std::string_view MappedFile::GetData() const {
+    return {static_cast<const char*>(address_), size_};
+}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+//// Read-only view of a whole file. Mapped into memory on POSIX systems so pages are loaded on demand,
+//// read into a buffer elsewhere
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path); // Throws FileException
+
+    MappedFile(const MappedFile&) = delete;
+
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile();
+
+    [[nodiscard]] std::string_view GetData() const;
+
+private:
+#ifdef _WIN32
+    std::string buffer_;
+#else
+    void* address_ = nullptr;
+    size_t size_ = 0;
+#endif
+};
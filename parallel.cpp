@@ -0,0 +1,128 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+    //// Workers shared by all ParallelFor() calls: started by the first call that needs them, grown on demand and
+    //// joined at exit. Threads keep their thread-local state --warm parsers-- between calls
+    class ThreadPool {
+    public:
+        ~ThreadPool() {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            task_added_.notify_all();
+            for (auto& worker : workers_) worker.join();
+        }
+
+        void Reserve(size_t workers) {
+            std::lock_guard lock(mutex_);
+            while (workers_.size() < workers) workers_.emplace_back([this] { Work(); });
+        }
+
+        void Submit(std::function<void()> task) {
+            {
+                std::lock_guard lock(mutex_);
+                tasks_.push_back(std::move(task));
+            }
+            task_added_.notify_one();
+        }
+
+        // Runs a queued task on the calling thread. False if there is none
+        bool RunOne() {
+            std::function<void()> task;
+            {
+                std::lock_guard lock(mutex_);
+                if (tasks_.empty()) return false;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+            return true;
+        }
+
+    private:
+        void Work() {
+            std::unique_lock lock(mutex_);
+            while (true) {
+                task_added_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                auto task = std::move(tasks_.front());
+                tasks_.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable task_added_;
+        std::deque<std::function<void()>> tasks_;
+        std::vector<std::thread> workers_;
+        bool stopping_ = false;
+    };
+
+    ThreadPool& GetPool() {
+        static ThreadPool pool;
+        return pool;
+    }
+}  // namespace
+
+unsigned GetDefaultThreadCount() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+//// The caller runs the first chunk and then helps with queued chunks while it waits, so a ParallelFor() called
+//// from a chunk can't wait for workers that are all waiting themselves
+void ParallelFor(size_t count, const std::function<void(size_t begin, size_t end)>& body, unsigned threads) {
+    if (count == 0) return;
+    size_t workers = std::min<size_t>(threads == 0 ? GetDefaultThreadCount() : threads, count);
+    if (workers == 1) {
+        body(0, count);
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t chunk = (count + workers - 1) / workers;
+    size_t left = (count + chunk - 1) / chunk;
+    std::exception_ptr error;
+    auto run = [&](size_t begin, size_t end) {
+        std::exception_ptr chunk_error;
+        try {
+            body(begin, end);
+        } catch (...) {
+            chunk_error = std::current_exception();
+        }
+        std::lock_guard lock(mutex);
+        if (chunk_error && !error) error = chunk_error;
+        if (--left == 0) finished.notify_all();
+    };
+
+    ThreadPool& pool = GetPool();
+    pool.Reserve(workers - 1);
+    for (size_t begin = chunk; begin < count; begin += chunk) {
+        size_t end = std::min(count, begin + chunk);
+        pool.Submit([&run, begin, end] { run(begin, end); });
+    }
+    run(0, std::min(count, chunk));
+    while (true) {
+        {
+            std::unique_lock lock(mutex);
+            if (left == 0) break;
+        }
+        if (!pool.RunOne()) {
+            std::unique_lock lock(mutex);
+            finished.wait(lock, [&] { return left == 0; });
+            break;
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+// Number of worker threads used by ParallelFor when none is requested --hardware concurrency, at least 1
+unsigned GetDefaultThreadCount();
+
+// Splits [0, count) into contiguous chunks and runs body(begin, end) for each chunk: one on the calling thread,
+// the others on a process-wide pool of threads kept between calls. Returns when all chunks are done, the first
+// exception thrown by a chunk is rethrown
+void ParallelFor(size_t count, const std::function<void(size_t begin, size_t end)>& body, unsigned threads = 0);
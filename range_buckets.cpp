@@ -0,0 +1,59 @@
+#include "range_buckets.h"
+
+#include <algorithm>
+
+namespace {
+    void EraseRange(std::vector<Range>& ranges, Range range) {
+        auto it = std::find(ranges.begin(), ranges.end(), range);
+        if (it == ranges.end()) return;
+        *it = ranges.back();
+        ranges.pop_back();
+    }
+}  // namespace
+
+void RangeBuckets::Insert(Range range) {
+    if (IsWide(range)) {
+        wide_.push_back(range);
+        return;
+    }
+    for (int row = range.from.row / RANGE_TILE_SIZE; row <= range.to.row / RANGE_TILE_SIZE; row++) {
+        for (int col = range.from.col / RANGE_TILE_SIZE; col <= range.to.col / RANGE_TILE_SIZE; col++) {
+            tiles_[GetTile(row, col)].push_back(range);
+        }
+    }
+}
+
+void RangeBuckets::Erase(Range range) {
+    if (IsWide(range)) {
+        EraseRange(wide_, range);
+        return;
+    }
+    for (int row = range.from.row / RANGE_TILE_SIZE; row <= range.to.row / RANGE_TILE_SIZE; row++) {
+        for (int col = range.from.col / RANGE_TILE_SIZE; col <= range.to.col / RANGE_TILE_SIZE; col++) {
+            auto it = tiles_.find(GetTile(row, col));
+            if (it == tiles_.end()) continue;
+            EraseRange(it->second, range);
+            if (it->second.empty()) tiles_.erase(it);
+        }
+    }
+}
+
+bool RangeBuckets::IsEmpty() const {
+    return tiles_.empty() && wide_.empty();
+}
+
+void RangeBuckets::Clear() {
+    tiles_.clear();
+    wide_.clear();
+}
+
+uint32_t RangeBuckets::GetTile(int tile_row, int tile_col) {
+    const int tile_cols = (Position::MAX_COLS + RANGE_TILE_SIZE - 1) / RANGE_TILE_SIZE;
+    return static_cast<uint32_t>(tile_row) * tile_cols + static_cast<uint32_t>(tile_col);
+}
+
+bool RangeBuckets::IsWide(Range range) {
+    int64_t rows = range.to.row / RANGE_TILE_SIZE - range.from.row / RANGE_TILE_SIZE + 1;
+    int64_t cols = range.to.col / RANGE_TILE_SIZE - range.from.col / RANGE_TILE_SIZE + 1;
+    return rows * cols > MAX_RANGE_TILES;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+//// Distinct ranges bucketed by the tiles of RANGE_TILE_SIZE x RANGE_TILE_SIZE cells they overlap, so the ranges
+//// that contain a cell are found without checking every range. A range over more than MAX_RANGE_TILES tiles is
+//// kept in one list checked for every cell --such ranges are few and shared by many formulas
+class RangeBuckets {
+public:
+    static constexpr int RANGE_TILE_SIZE = 64;
+    static constexpr int64_t MAX_RANGE_TILES = 64;
+
+    void Insert(Range range); // Range not in the buckets yet
+
+    void Erase(Range range);
+
+    template <typename Visit>
+    void ForEachContaining(Position pos, Visit visit) const { // visit(range) once per range that contains pos
+        auto it = tiles_.find(GetTile(pos.row / RANGE_TILE_SIZE, pos.col / RANGE_TILE_SIZE));
+        if (it != tiles_.end()) {
+            for (Range range : it->second) {
+                if (range.Contains(pos)) visit(range);
+            }
+        }
+        for (Range range : wide_) {
+            if (range.Contains(pos)) visit(range);
+        }
+    }
+
+    [[nodiscard]] bool IsEmpty() const;
+
+    void Clear();
+
+private:
+    static uint32_t GetTile(int tile_row, int tile_col);
+
+    static bool IsWide(Range range);
+
+    std::unordered_map<uint32_t, std::vector<Range>> tiles_;
+    std::vector<Range> wide_;
+};
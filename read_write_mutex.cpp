@@ -0,0 +1,33 @@
+#include "read_write_mutex.h"
+
+void ReadWriteMutex::lock() {
+    std::unique_lock lock(mutex_);
+    waiting_writers_++;
+    writer_gate_.wait(lock, [this] { return !writing_ && readers_ == 0; });
+    waiting_writers_--;
+    writing_ = true;
+}
+
+void ReadWriteMutex::unlock() {
+    {
+        std::lock_guard lock(mutex_);
+        writing_ = false;
+    }
+    writer_gate_.notify_one();
+    readers_gate_.notify_all();
+}
+
+void ReadWriteMutex::lock_shared() {
+    std::unique_lock lock(mutex_);
+    readers_gate_.wait(lock, [this] { return !writing_ && waiting_writers_ == 0; });
+    readers_++;
+}
+
+void ReadWriteMutex::unlock_shared() {
+    bool last;
+    {
+        std::lock_guard lock(mutex_);
+        last = --readers_ == 0;
+    }
+    if (last) writer_gate_.notify_one();
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+//// Shared mutex that prefers the writer: once a writer waits, new readers wait behind it, so a steady stream of
+//// readers can't starve it. Locks don't nest --a reader taking the lock again waits for a waiting writer forever.
+//// Names follow the standard, for std::unique_lock and std::shared_lock
+class ReadWriteMutex {
+public:
+    void lock();
+
+    void unlock();
+
+    void lock_shared();
+
+    void unlock_shared();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable readers_gate_; // Writer done
+    std::condition_variable writer_gate_; // Writer done or last reader left
+    size_t readers_ = 0;
+    size_t waiting_writers_ = 0;
+    bool writing_ = false;
+};
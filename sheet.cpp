@@ -1,35 +1,273 @@
 #include "sheet.h"
+#include "export.h"
+#include "journal.h"
+#include "parallel.h"
+#include <algorithm>
 #include <iostream>
 #include <optional>
+#include <utility>
 
 using namespace std::literals;
 
+namespace {
+    // visit(pos) for the keys of cells inside the range --row by row if the range has fewer rows than the map keys
+    template <typename Map, typename Visit>
+    void ForEachInRange(const Map& cells, Range range, Visit visit) {
+        if (static_cast<size_t>(range.to.row - range.from.row + 1) < cells.size()) {
+            for (int row = range.from.row; row <= range.to.row; row++) {
+                auto end = cells.upper_bound({row, range.to.col});
+                for (auto it = cells.lower_bound({row, range.from.col}); it != end; ++it) visit(it->first);
+            }
+            return;
+        }
+        for (const auto& entry : cells) {
+            if (range.Contains(entry.first)) visit(entry.first);
+        }
+    }
+}  // namespace
+
 Sheet::~Sheet() = default;
 
 void Sheet::SetCell(Position pos, std::string text) {
+    if (!journal_) return SetCell(pos, std::move(text), nullptr);
+    SetCell(pos, text, nullptr);
+    journal_->AppendSet(pos, text);
+}
+
+void Sheet::SetCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula) {
     if (!pos.IsValid()) throw InvalidPositionException("Sheet::SetCell");
-    sheet_[pos].Set(text, *this);
+    // A new empty cell changes no value, not even of the formulas over a range containing it --formulas create them
+    bool new_empty = text.empty() && sheet_.count(pos) == 0;
+    if (!new_empty) ResolveAll();
+    Cell& cell = sheet_[pos];
+    cell.SetPosition(pos);
+    cell.Set(std::move(text), *this, std::move(formula));
+    MarkChanged(pos);
+    if (new_empty) return;
+    Invalidate(pos);
+    ReleaseRanges();
+}
+
+std::vector<std::unique_ptr<FormulaInterface>> Sheet::ParseCells(const std::vector<CellEdit>& cells, std::vector<CellError>& errors) {
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(cells.size());
+    std::vector<std::string> messages(cells.size());
+    ParallelFor(cells.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const CellEdit& edit = cells[i];
+            if (!edit.pos.IsValid()) {
+                messages[i] = "Invalid position";
+                continue;
+            }
+            if (edit.text.size() < 2 || edit.text[0] != FORMULA_SIGN) continue;
+            try {
+                formulas[i] = ParseFormula(edit.text.substr(1));
+            } catch (const std::exception& exc) {
+                messages[i] = exc.what();
+            }
+        }
+    });
+    for (size_t i = 0; i < cells.size(); i++) {
+        if (!messages[i].empty()) errors.push_back({cells[i].pos, std::move(messages[i])});
+    }
+    return formulas;
+}
+
+std::vector<CellError> Sheet::ValidateCells(const std::vector<CellEdit>& cells) const {
+    std::vector<CellError> errors;
+    ParseCells(cells, errors);
+    return errors;
+}
+
+std::vector<CellError> Sheet::SetCells(const std::vector<CellEdit>& cells) {
+    std::vector<CellError> errors;
+    auto formulas = ParseCells(cells, errors);
+    if (!errors.empty()) return errors;
+
+    CalculationMode mode = mode_;
+    mode_ = CalculationMode::Manual;
+    try {
+        for (size_t i = 0; i < cells.size(); i++) {
+            try {
+                SetCell(cells[i].pos, cells[i].text, std::move(formulas[i]));
+                if (journal_) journal_->AppendSet(cells[i].pos, cells[i].text);
+            } catch (const CircularDependencyException& exc) {
+                errors.push_back({cells[i].pos, exc.what()});
+            }
+        }
+    } catch (...) {
+        mode_ = mode;
+        throw;
+    }
+    SetCalculationMode(mode);
+    return errors;
+}
+
+//// New cells are added without invalidating anything but the formulas over ranges containing them: no other
+//// formula references a missing cell but the lazy ones, which are read against the loaded content. Existing cells
+//// go through SetCell() before any new cell is added
+std::vector<CellError> Sheet::LoadCells(std::vector<LazyCell> cells) {
+    std::vector<CellError> errors;
+    std::vector<LazyCell*> added;
+    for (auto& loaded : cells) {
+        if (!loaded.pos.IsValid()) {
+            errors.push_back({loaded.pos, "Invalid position"});
+        } else if (sheet_.count(loaded.pos) > 0) {
+            try {
+                SetCell(loaded.pos, loaded.text);
+            } catch (const std::exception& exc) {
+                errors.push_back({loaded.pos, exc.what()});
+            }
+        } else {
+            added.push_back(&loaded);
+        }
+    }
+    for (LazyCell* loaded : added) {
+        Position pos = loaded->pos;
+        if (journal_) journal_->AppendSet(pos, loaded->text);
+        Cell& cell = sheet_[pos];
+        MarkChanged(pos);
+        if (loaded->text.size() < 2 || loaded->text[0] != FORMULA_SIGN) {
+            lazy_.erase(pos); // The same position twice in the batch
+            cell.SetPosition(pos);
+            cell.Set(std::move(loaded->text), *this);
+            continue;
+        }
+        bool saved = loaded->value && !std::holds_alternative<std::string>(*loaded->value);
+        CellInterface::Value value = saved ? std::move(*loaded->value) : 0.0;
+        cell.Restore(pos, std::make_unique<FormulaImpl>(std::move(loaded->text), std::move(value), std::vector<Position>{}, std::vector<Range>{},
+                                                        CompiledFormula{}, *this));
+        lazy_[pos] = saved;
+        has_lazy_.store(true, std::memory_order_release);
+        lookup_cache_.OnCellChanged(pos, *this);
+        criteria_cache_.OnCellChanged(pos, *this);
+    }
+    if (range_dependents_.IsEmpty()) return errors;
+    std::vector<Position> queue;
+    for (LazyCell* loaded : added) {
+        range_dependents_.ForEachDependent(loaded->pos, [&queue](const Cell* cell) { queue.push_back(cell->GetPosition()); });
+    }
+    if (!queue.empty()) Invalidate({}, std::move(queue));
+    return errors;
+}
+
+std::vector<CellError> Sheet::BulkLoad(std::vector<CellEdit> cells) {
+    auto errors = BulkLoadBatch(std::move(cells));
+    auto cycles = FinishBulkLoad();
+    errors.insert(errors.end(), cycles.begin(), cycles.end());
+    return errors;
+}
+
+//// Nothing is evaluated while the cells are set, nor linked: a formula may refer to a cell of a later batch.
+//// The texts are journaled now, FinishBulkLoad() empties the cells of the cycles through the journal too
+std::vector<CellError> Sheet::BulkLoadBatch(std::vector<CellEdit> cells) {
+    std::vector<CellError> errors;
+    auto formulas = ParseCells(cells, errors);
+    ResolveAll();
+    for (size_t i = 0; i < cells.size(); i++) {
+        CellEdit& edit = cells[i];
+        bool formula_text = edit.text.size() > 1 && edit.text[0] == FORMULA_SIGN;
+        if (!edit.pos.IsValid() || (formula_text && !formulas[i])) continue;
+        if (journal_) journal_->AppendSet(edit.pos, edit.text);
+        Cell& cell = sheet_[edit.pos];
+        cell.SetPosition(edit.pos);
+        cell.Load(std::move(edit.text), *this, std::move(formulas[i]));
+        MarkChanged(edit.pos);
+        bulk_loaded_.insert(edit.pos);
+    }
+    ReleaseRanges();
+    return errors;
+}
+
+//// The loaded cells are linked, then everything downstream of them is ordered in one pass, which evaluates it
+//// unless a cycle stops some cells; those get a second pass once the loaded cells of the cycles are emptied.
+//// A cycle always goes through a loaded cell --the sheet had none before
+std::vector<CellError> Sheet::FinishBulkLoad() {
+    std::vector<CellError> errors;
+    std::set<Position> loaded = std::move(bulk_loaded_);
+    bulk_loaded_.clear();
+    for (auto pos : loaded) {
+        Cell& cell = sheet_.at(pos);
+        if (cell.IsFormula()) cell.RestoreLinks(*this);
+    }
+
+    // Formulas downstream of the loaded cells, themselves included --a new cell may be in a range of any formula
+    std::set<Position> stale;
+    std::set<Position> visited;
+    std::vector<Position> queue(loaded.begin(), loaded.end());
+    while (!queue.empty()) {
+        Position pos = queue.back();
+        queue.pop_back();
+        if (!visited.insert(pos).second) continue;
+        if (sheet_.at(pos).IsFormula()) stale.insert(pos);
+        auto dependents = GetDependents(pos);
+        queue.insert(queue.end(), dependents.begin(), dependents.end());
+    }
+    auto settle = [this](Position pos, Cell& cell) {
+        if (mode_ == CalculationMode::Automatic) cell.CashUpdate(*this);
+        else dirty_.insert(pos);
+        MarkChanged(pos);
+    };
+    auto left = VisitInOrder(stale, settle);
+    if (left.empty()) return errors;
+
+    std::set<Position> rejected;
+    for (auto pos : FindCycles(left)) {
+        if (loaded.count(pos) == 0) continue;
+        sheet_.at(pos).Clear(*this);
+        rejected.insert(pos);
+        errors.push_back({pos, "Circular dependency"});
+        if (journal_) journal_->AppendSet(pos, "");
+    }
+    ReleaseRanges();
+    std::set<Position> rest;
+    for (auto pos : left) {
+        if (rejected.count(pos) == 0) rest.insert(pos);
+    }
+    VisitInOrder(rest, settle);
+    return errors;
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     if (!pos.IsValid()) throw InvalidPositionException("Sheet::GetCell");
-    if (sheet_.count(pos) > 0) return &sheet_.at(pos);
-    return nullptr;
+    if (!has_lazy_.load(std::memory_order_acquire)) {
+        auto it = sheet_.find(pos);
+        return it == sheet_.end() ? nullptr : &it->second;
+    }
+    std::lock_guard lock(resolve_mutex_); // Another reader may be adding cells
+    auto it = sheet_.find(pos);
+    if (it == sheet_.end()) return nullptr;
+    if (!resolving_ && lazy_.count(pos) > 0) Resolve({pos});
+    return &it->second;
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
-    if (!pos.IsValid()) throw InvalidPositionException("Sheet::GetCell");
-    if (sheet_.count(pos) > 0) return &sheet_.at(pos);
-    return nullptr;
+    return const_cast<Cell*>(static_cast<const Cell*>(std::as_const(*this).GetCell(pos)));
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) throw InvalidPositionException("Sheet::ClearCell");
     auto it = sheet_.find(pos);
-    if (it != sheet_.end()) sheet_.erase(it);
+    if (it == sheet_.end()) return;
+    ResolveAll();
+    if (journal_) journal_->AppendClear(pos);
+    MarkChanged(pos);
+    if (!it->second.GetDependentCells().empty()) { // Cell is still referenced by formulas --kept as empty
+        it->second.Clear(*this);
+        Invalidate(pos);
+        ReleaseRanges();
+        return;
+    }
+    it->second.Unlink();
+    sheet_.erase(it);
+    dirty_.erase(pos);
+    lookup_cache_.OnCellChanged(pos, *this);
+    criteria_cache_.OnCellChanged(pos, *this);
+    Invalidate(pos); // Formulas over a range containing it
+    ReleaseRanges();
 }
 
 Size Sheet::GetPrintableSize() const {
+    ResolveAll(); // Resolved formulas may create empty cells
     if (sheet_.begin() == sheet_.end()) return { 0, 0 };
     Size max_size = {0, 0};
     auto runner = sheet_.begin();
@@ -42,39 +280,358 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    bool flag = true;
-    Size printable_size = GetPrintableSize();
-    for (int i = 0; i < printable_size.rows; i++) {
-        for (int j = 0; j < printable_size.cols; j++) {
-            !flag ? output << '\t' : output;
-            flag = false;
-            if (sheet_.count({i, j}) > 0) {
-                Cell::Value value = sheet_.at({i, j}).GetValue();
-                if (std::holds_alternative<double>(value)) output << std::get<double>(value);
-                else if (std::holds_alternative<std::string>(value)) output << std::get<std::string>(value);
-                else if (std::holds_alternative<FormulaError>(value)) output << std::get<FormulaError>(value);
-                else throw FormulaException ("Sheet::PrintValues: --Unknown exception");
+    StreamSink sink(output);
+    ExportValues(sink);
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+    StreamSink sink(output);
+    ExportTexts(sink);
+}
+
+void Sheet::ExportValues(ExportSink& sink, const ExportOptions& options) const {
+    Export(sink, options, [](ExportSink& out, const Cell& cell) {
+        PutValue(out, cell.GetValue());
+    });
+}
+
+void Sheet::ExportTexts(ExportSink& sink, const ExportOptions& options) const {
+    Export(sink, options, [](ExportSink& out, const Cell& cell) {
+        out.Put(cell.GetText());
+    });
+}
+
+//// Bands are formatted a batch at a time --two per thread --so only one batch of output is held in memory.
+//// Cells of a band are found with two lookups at its edges
+template <typename PutCell>
+void Sheet::Export(ExportSink& sink, const ExportOptions& options, PutCell put_cell) const {
+    Size size = GetPrintableSize();
+    unsigned threads = options.threads == 0 ? GetDefaultThreadCount() : options.threads;
+    int band_rows = std::max(options.band_rows, 1);
+    if (threads == 1 || size.rows <= band_rows) {
+        ExportRows(sheet_.begin(), sheet_.end(), 0, size.rows, size.cols, sink, put_cell);
+        sink.Flush();
+        return;
+    }
+
+    const size_t bands = (size.rows + band_rows - 1) / band_rows;
+    const size_t batch = size_t{threads} * 2;
+    std::vector<std::string> buffers(batch);
+    std::vector<std::string_view> chunks(batch);
+    for (size_t first = 0; first < bands; first += batch) {
+        size_t count = std::min(batch, bands - first);
+        ParallelFor(count, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                int first_row = static_cast<int>(first + i) * band_rows;
+                int last_row = std::min(first_row + band_rows, size.rows);
+                MemorySink band;
+                ExportRows(sheet_.lower_bound({first_row, 0}), sheet_.lower_bound({last_row, 0}), first_row, last_row, size.cols, band, put_cell);
+                band.Flush();
+                buffers[i] = band.TakeData();
             }
+        }, threads);
+        for (size_t i = 0; i < count; i++) {
+            if (options.vectored) chunks[i] = buffers[i];
+            else sink.Put(buffers[i]);
         }
-        output << '\n';
-        flag = true;
+        if (options.vectored) sink.PutChunks(chunks.data(), count);
     }
+    sink.Flush();
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-    bool flag = true;
-    Size printable_size = GetPrintableSize();
-    for (int i = 0; i < printable_size.rows; i++) {
-        for (int j = 0; j < printable_size.cols; j++) {
-            !flag ? output << '\t' : output;
-            flag = false;
-            if (sheet_.count({i, j}) > 0) output << sheet_.at({i, j}).GetText();
+void Sheet::SetCalculationMode(CalculationMode mode) {
+    mode_ = mode;
+    if (mode_ == CalculationMode::Automatic) Recalculate();
+}
+
+CalculationMode Sheet::GetCalculationMode() const {
+    return mode_;
+}
+
+void Sheet::Recalculate() {
+    auto dirty = std::move(dirty_);
+    dirty_.clear();
+    RecalculateCells(dirty);
+}
+
+size_t Sheet::GetDirtyCount() const {
+    return dirty_.size();
+}
+
+void Sheet::Invalidate(Position pos) {
+    std::set<Position> stale;
+    auto it = sheet_.find(pos);
+    if (it != sheet_.end() && it->second.IsFormula()) stale.insert(pos);
+    Invalidate(std::move(stale), GetDependents(pos));
+}
+
+void Sheet::Invalidate(std::set<Position> stale, std::vector<Position> queue) {
+    while (!queue.empty()) {
+        Position next = queue.back();
+        queue.pop_back();
+        if (!stale.insert(next).second) continue;
+        auto dependents = GetDependents(next);
+        queue.insert(queue.end(), dependents.begin(), dependents.end());
+    }
+    if (mode_ == CalculationMode::Automatic) return RecalculateCells(stale);
+    dirty_.insert(stale.begin(), stale.end());
+    for (auto next : stale) MarkChanged(next);
+}
+
+void Sheet::ReleaseRanges() {
+    for (Range range : range_dependents_.TakeReleased()) {
+        if (range_dependents_.IsCovered(range)) continue;
+        lookup_cache_.OnRangeReleased(range, range_dependents_);
+        criteria_cache_.OnRangeReleased(range, range_dependents_);
+    }
+}
+
+std::vector<Position> Sheet::GetDependents(Position pos) const {
+    std::vector<Position> dependents;
+    if (auto it = sheet_.find(pos); it != sheet_.end()) dependents = it->second.GetDependentCells(); // By address
+    range_dependents_.ForEachDependent(pos, [&dependents](const Cell* cell) { dependents.push_back(cell->GetPosition()); });
+    std::sort(dependents.begin(), dependents.end());
+    dependents.erase(std::unique(dependents.begin(), dependents.end()), dependents.end());
+    return dependents;
+}
+
+//// A cell is visited once all its precedents among positions are visited. Precedents are counted from the
+//// dependents of the cells, the edges walked to visit --a range holds edges to cells it doesn't list
+template <typename Visit>
+std::vector<Position> Sheet::VisitInOrder(const std::set<Position>& positions, Visit visit) {
+    std::map<Position, size_t> pending; // Number of precedents not visited yet
+    for (auto pos : positions) {
+        if (sheet_.count(pos) > 0) pending.emplace_hint(pending.end(), pos, 0);
+    }
+    std::map<Position, std::vector<Position>> dependents; // Among positions
+    for (auto& [pos, count] : pending) {
+        auto& next = dependents[pos];
+        for (auto dependent : GetDependents(pos)) {
+            auto it = pending.find(dependent);
+            if (it == pending.end()) continue;
+            it->second++;
+            next.push_back(dependent);
+        }
+    }
+    std::vector<Position> ready;
+    for (const auto& [pos, count] : pending) {
+        if (count == 0) ready.push_back(pos);
+    }
+    while (!ready.empty()) {
+        Position pos = ready.back();
+        ready.pop_back();
+        visit(pos, sheet_.at(pos));
+        for (auto next : dependents[pos]) {
+            if (--pending.at(next) == 0) ready.push_back(next);
+        }
+    }
+    std::vector<Position> left;
+    for (const auto& [pos, count] : pending) {
+        if (count > 0) left.push_back(pos);
+    }
+    return left;
+}
+
+//// Components are found on the graph of references restricted to positions, with an explicit stack of frames.
+//// Edges are followed from a cell to its dependents: the components are the same as over precedents
+std::set<Position> Sheet::FindCycles(const std::vector<Position>& positions) const {
+    struct Frame {
+        Position pos;
+        std::vector<Position> dependents;
+        size_t next = 0;
+    };
+    const std::set<Position> cells(positions.begin(), positions.end());
+    std::map<Position, std::pair<size_t, size_t>> order; // Index of the visit, lowest index reachable
+    std::vector<Position> path; // Cells visited whose component isn't complete
+    std::set<Position> on_path;
+    std::set<Position> cyclic;
+    std::vector<Frame> frames;
+    auto open = [&](Position pos) {
+        size_t index = order.size();
+        order[pos] = {index, index};
+        path.push_back(pos);
+        on_path.insert(pos);
+        frames.push_back({pos, GetDependents(pos)});
+    };
+    for (auto root : cells) {
+        if (order.count(root) > 0) continue;
+        open(root);
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+            if (frame.next < frame.dependents.size()) {
+                Position next = frame.dependents[frame.next++];
+                if (cells.count(next) == 0) continue;
+                auto it = order.find(next);
+                if (it == order.end()) {
+                    open(next);
+                } else if (on_path.count(next) > 0) {
+                    auto& low = order[frame.pos].second;
+                    low = std::min(low, it->second.first);
+                }
+                continue;
+            }
+            Position pos = frame.pos;
+            bool self_reference = std::binary_search(frame.dependents.begin(), frame.dependents.end(), pos);
+            frames.pop_back();
+            auto [index, low] = order[pos];
+            if (!frames.empty()) {
+                auto& parent_low = order[frames.back().pos].second;
+                parent_low = std::min(parent_low, low);
+            }
+            if (low != index) continue;
+            bool component = !(path.back() == pos) || self_reference;
+            Position member = Position::NONE;
+            do {
+                member = path.back();
+                path.pop_back();
+                on_path.erase(member);
+                if (component) cyclic.insert(member);
+            } while (!(member == pos));
         }
-        output << '\n';
-        flag = true;
     }
+    return cyclic;
+}
+
+void Sheet::RecalculateCells(const std::set<Position>& positions) {
+    VisitInOrder(positions, [this](Position pos, Cell& cell) {
+        cell.CashUpdate(*this);
+        MarkChanged(pos);
+    });
+}
+
+//// The lazy cells reached are parsed and linked first, then visited in one topological pass that evaluates those
+//// without a saved value. Formulas that can't be ordered are in a cycle or behind one: they are kept as texts
+void Sheet::Resolve(std::vector<Position> positions) const {
+    std::lock_guard lock(resolve_mutex_);
+    auto& self = const_cast<Sheet&>(*this);
+    std::set<Position> resolved;
+    std::set<Position> stale;
+    resolving_ = true;
+    try {
+        while (!positions.empty()) {
+            Position pos = positions.back();
+            positions.pop_back();
+            auto it = lazy_.find(pos);
+            if (it == lazy_.end()) continue;
+            bool saved = it->second;
+            lazy_.erase(it);
+            Cell& cell = self.sheet_.at(pos);
+            if (!cell.ResolveLazy(self, saved)) continue;
+            resolved.insert(pos);
+            if (!saved) stale.insert(pos);
+            for (auto prev : cell.GetReferencedCells()) {
+                if (lazy_.count(prev) > 0) positions.push_back(prev);
+            }
+            for (Range range : cell.GetReferencedRanges()) {
+                ForEachInRange(lazy_, range, [&positions](Position prev) { positions.push_back(prev); });
+            }
+        }
+    } catch (...) {
+        resolving_ = false;
+        has_lazy_.store(!lazy_.empty(), std::memory_order_release);
+        throw;
+    }
+    resolving_ = false;
+
+    auto cyclic = self.VisitInOrder(resolved, [&](Position pos, Cell& cell) {
+        if (stale.count(pos) > 0) cell.CashUpdate(self);
+    });
+    for (auto pos : cyclic) self.sheet_.at(pos).KeepAsText();
+    // Readers skip the mutex from now on --everything above is published to them
+    has_lazy_.store(!lazy_.empty(), std::memory_order_release);
+}
+
+void Sheet::ResolveAll() const {
+    if (!has_lazy_.load(std::memory_order_acquire)) return;
+    std::lock_guard lock(resolve_mutex_);
+    if (lazy_.empty()) return; // Resolved by another reader meanwhile
+    std::vector<Position> positions;
+    positions.reserve(lazy_.size());
+    for (const auto& entry : lazy_) positions.push_back(entry.first);
+    Resolve(std::move(positions));
+}
+
+RangeDependents* Sheet::GetRangeDependents() const {
+    return &range_dependents_;
+}
+
+LookupIndexCache* Sheet::GetLookupCache() const {
+    return &lookup_cache_;
+}
+
+CriteriaIndexCache* Sheet::GetCriteriaCache() const {
+    return &criteria_cache_;
+}
+
+void Sheet::SaveSnapshot(const std::string& path) const {
+    ResolveAll();
+    WriteSnapshot(*this, path);
+}
+
+bool Sheet::SaveDelta(const std::string& path) const {
+    ResolveAll();
+    return WriteDelta(*this, path);
+}
+
+size_t Sheet::GetChangedTileCount() const {
+    return changed_tiles_.GetCount();
+}
+
+void Sheet::SetJournal(std::shared_ptr<Journal> journal) {
+    journal_ = std::move(journal);
+}
+
+//// Lazy cells are left to the readers: GetCell() resolves the cells it reaches, whole-sheet reads resolve all
+std::shared_lock<ReadWriteMutex> Sheet::LockForReading() const {
+    return std::shared_lock(mutex_);
+}
+
+std::unique_lock<ReadWriteMutex> Sheet::LockForWriting() {
+    return std::unique_lock(mutex_);
+}
+
+//// Only the tiles changed since the last view are rebuilt from the map. Edits pay nothing for views: a tile
+//// changed many times is copied once, by the next call
+std::shared_ptr<const SheetView> Sheet::Snapshot() const {
+    ResolveAll();
+    std::lock_guard lock(view_mutex_);
+    if (!view_) {
+        view_ = std::make_shared<const SheetView>();
+        view_tiles_.Clear();
+        for (const auto& [pos, cell] : sheet_) view_tiles_.Insert(pos);
+    }
+    if (view_tiles_.GetCount() == 0) return view_;
+    std::vector<std::pair<uint32_t, SheetView::TileCells>> tiles;
+    for (uint32_t tile : view_tiles_.GetTiles()) {
+        int first_row = static_cast<int>(tile / SNAPSHOT_TILE_COLS) * SNAPSHOT_TILE_SIZE;
+        int first_col = static_cast<int>(tile % SNAPSHOT_TILE_COLS) * SNAPSHOT_TILE_SIZE;
+        SheetView::TileCells cells;
+        for (int row = first_row; row < first_row + SNAPSHOT_TILE_SIZE; row++) {
+            auto end = sheet_.lower_bound({row, first_col + SNAPSHOT_TILE_SIZE});
+            for (auto it = sheet_.lower_bound({row, first_col}); it != end; ++it) {
+                const Cell& cell = it->second;
+                std::string text = cell.GetText();
+                bool formula = cell.IsFormula();
+                CellInterface::Value value = formula || text.empty() ? cell.GetValue() : CellInterface::Value{};
+                cells.emplace_back(it->first, ViewCell(std::move(text), std::move(value), formula ? cell.GetReferencedCells() : std::vector<Position>{},
+                                                       formula ? cell.GetReferencedRanges() : std::vector<Range>{}, formula));
+            }
+        }
+        tiles.emplace_back(tile, std::move(cells));
+    }
+    view_ = view_->Update(std::move(tiles));
+    view_tiles_.Clear();
+    return view_;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
+}
+
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path) {
+    return ReadSnapshot(path);
+}
+
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path, const std::string& delta_path) {
+    return ReadSnapshot(path, delta_path);
 }
\ No newline at end of file
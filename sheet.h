@@ -1,15 +1,29 @@
 #pragma once
 #include "cell.h"
 #include "common.h"
+#include "criteria_index.h"
+#include "lookup_index.h"
+#include "sheet_view.h"
+#include "snapshot.h"
+#include <atomic>
 #include <functional>
 #include <unordered_map>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
 
 class Sheet : public SheetInterface {
 public:
 
     friend class Cell; //access to Sheet methods from cell
 
+    friend void WriteSnapshot(const Sheet& sheet, const std::string& path); // reads cells, dirty_ and mode_, sets the base
+
+    friend bool WriteDelta(const Sheet& sheet, const std::string& path); // reads changed tiles too
+
+    friend std::unique_ptr<Sheet> ReadSnapshot(const std::string& path, const std::string& delta_path); // builds the sheet in place
+
     using Sheet_data = std::map<Position, Cell>;
 
     ~Sheet() override;
@@ -28,7 +42,112 @@ public:
 
     void PrintTexts(std::ostream& output) const override; // Printing sheet existing values as text in printable area
 
+    void ExportValues(ExportSink& sink, const ExportOptions& options = {}) const override; // PrintValues() to a sink
+
+    void ExportTexts(ExportSink& sink, const ExportOptions& options = {}) const override; // PrintTexts() to a sink
+
+    [[nodiscard]] std::vector<CellError> ValidateCells(const std::vector<CellEdit>& cells) const override;
+
+    std::vector<CellError> SetCells(const std::vector<CellEdit>& cells) override;
+
+    std::vector<CellError> LoadCells(std::vector<LazyCell> cells) override;
+
+    std::vector<CellError> BulkLoad(std::vector<CellEdit> cells) override;
+
+    std::vector<CellError> BulkLoadBatch(std::vector<CellEdit> cells) override;
+
+    std::vector<CellError> FinishBulkLoad() override;
+
+    void SetCalculationMode(CalculationMode mode) override;
+
+    [[nodiscard]] CalculationMode GetCalculationMode() const override;
+
+    void Recalculate() override; // Recalculates cells accumulated in dirty_
+
+    [[nodiscard]] size_t GetDirtyCount() const override;
+
+    [[nodiscard]] LookupIndexCache* GetLookupCache() const override; // Lookup indexes shared by all formulas of the sheet
+
+    [[nodiscard]] CriteriaIndexCache* GetCriteriaCache() const override; // Criterion bitmaps shared by all formulas of the sheet
+
+    [[nodiscard]] RangeDependents* GetRangeDependents() const override;
+
+    void SaveSnapshot(const std::string& path) const override; // Binary snapshot, see snapshot.h
+
+    bool SaveDelta(const std::string& path) const override;
+
+    [[nodiscard]] size_t GetChangedTileCount() const override;
+
+    void SetJournal(std::shared_ptr<Journal> journal) override;
+
+    [[nodiscard]] std::shared_lock<ReadWriteMutex> LockForReading() const override;
+
+    [[nodiscard]] std::unique_lock<ReadWriteMutex> LockForWriting() override;
+
+    [[nodiscard]] std::shared_ptr<const SheetView> Snapshot() const override;
+
 private:
+    void SetCell(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula); // formula is parsed in advance
+
+    void MarkChanged(Position pos) const { // Content or value of the cell changed --for deltas and views
+        changed_tiles_.Insert(pos);
+        view_tiles_.Insert(pos);
+    }
+
+    // Parsed formula per cell of the batch --nullptr for other cells; errors are appended in batch order
+    static std::vector<std::unique_ptr<FormulaInterface>> ParseCells(const std::vector<CellEdit>& cells, std::vector<CellError>& errors);
+
+    template <typename PutCell>
+    void Export(ExportSink& sink, const ExportOptions& options, PutCell put_cell) const; // put_cell(sink, cell)
+
+    void Invalidate(Position pos); // Recalculates or marks stale the cell and all its dependents
+
+    void ReleaseRanges(); // Lets the caches drop what they built for ranges no formula uses anymore
+
+    // Adds everything downstream of queue to stale, then recalculates or marks stale all of it
+    void Invalidate(std::set<Position> stale, std::vector<Position> queue);
+
+    // Formulas that use the cell, one by one or through a range --the cell may be missing. Sorted, unique
+    [[nodiscard]] std::vector<Position> GetDependents(Position pos) const;
+
+    // Kahn's algorithm: calls visit(pos, cell) for the cells at positions, each after its precedents among them.
+    // Returns the cells never visited --in a cycle or behind one
+    template <typename Visit>
+    std::vector<Position> VisitInOrder(const std::set<Position>& positions, Visit visit);
+
+    void RecalculateCells(const std::set<Position>& positions); // Evaluates cells in topological order
+
+    // Tarjan's algorithm: the cells among positions that are in a reference cycle through cells among positions.
+    // Run over dependents, which a range gives without going through its cells
+    [[nodiscard]] std::set<Position> FindCycles(const std::vector<Position>& positions) const;
+
+    void Resolve(std::vector<Position> positions) const; // Parses and links the lazy cells reachable from positions
+
+    void ResolveAll() const; // Before edits and whole-sheet operations
+
     Sheet_data sheet_{}; // Structure for keeping sheet data
+    CalculationMode mode_ = CalculationMode::Automatic;
+    std::set<Position> dirty_{}; // Stale formula cells --Manual mode only
+    mutable LookupIndexCache lookup_cache_{}; // Built lazily by lookup functions while evaluating
+    mutable CriteriaIndexCache criteria_cache_{}; // Built lazily by conditional aggregates while evaluating
+    mutable RangeDependents range_dependents_{}; // Formulas register their ranges when linked --lazy ones on reads
+    std::shared_ptr<Journal> journal_; // Successful edits are appended --nullptr if not journaled
+    std::set<Position> bulk_loaded_{}; // Cells set by the BulkLoadBatch() calls since the last FinishBulkLoad()
+    // Formula cells of LoadCells() not parsed or linked yet --true if they keep a saved value. Resolving them
+    // makes loaded content usable without changing it, so it's done by const methods too
+    mutable std::map<Position, bool> lazy_{};
+    mutable bool resolving_ = false; // Resolve() is parsing --GetCell() doesn't resolve meanwhile
+    // Readers resolve the cells they reach, one at a time under this mutex, which guards lazy_ and the cells it
+    // adds to the map. Recursive: evaluating resolved formulas calls GetCell() again
+    mutable std::recursive_mutex resolve_mutex_;
+    mutable std::atomic<bool> has_lazy_{false}; // lazy_ isn't empty --GetCell() takes resolve_mutex_ only then
+    // Persisted state, not content: changed by saving
+    mutable std::optional<uint32_t> base_checksum_; // Of the last base saved or loaded
+    mutable TileSet changed_tiles_; // Cells set, cleared, recalculated or marked stale since the base
+    mutable ReadWriteMutex mutex_; // Held by the callers, see SheetInterface::LockForReading()
+    // Last view taken by Snapshot() and the tiles changed since --the view is built by the first call
+    mutable std::shared_ptr<const SheetView> view_;
+    mutable TileSet view_tiles_;
+    mutable std::mutex view_mutex_; // Snapshot() is called by readers
 };
 
@@ -0,0 +1,145 @@
+#include "sheet_view.h"
+#include "export.h"
+
+#include <algorithm>
+
+namespace {
+    Size Extend(Size size, Size other) {
+        return {std::max(size.rows, other.rows), std::max(size.cols, other.cols)};
+    }
+}  // namespace
+
+ViewCell::ViewCell(std::string text, Value value, std::vector<Position> referenced_cells, std::vector<Range> referenced_ranges,
+                   bool formula)
+    : text_(std::move(text))
+    , value_(std::move(value))
+    , referenced_cells_(std::move(referenced_cells))
+    , referenced_ranges_(std::move(referenced_ranges))
+    , formula_(formula) {
+}
+
+CellInterface::Value ViewCell::GetValue() const {
+    if (formula_ || text_.empty()) return value_;
+    if (text_[0] == ESCAPE_SIGN) return text_.substr(1);
+    return text_;
+}
+
+std::string ViewCell::GetText() const {
+    return text_;
+}
+
+std::vector<Position> ViewCell::GetReferencedCells() const {
+    return referenced_cells_;
+}
+
+std::vector<Range> ViewCell::GetReferencedRanges() const {
+    return referenced_ranges_;
+}
+
+const CellInterface* SheetView::GetCell(Position pos) const {
+    if (!pos.IsValid()) throw InvalidPositionException("SheetView::GetCell");
+    const auto& band = bands_[pos.row / SNAPSHOT_TILE_SIZE];
+    if (!band) return nullptr;
+    const auto& tile = band->tiles[pos.col / SNAPSHOT_TILE_SIZE];
+    if (!tile) return nullptr;
+    auto it = std::lower_bound(tile->cells.begin(), tile->cells.end(), pos, [](const auto& cell, Position value) {
+        return cell.first < value;
+    });
+    return it != tile->cells.end() && it->first == pos ? &it->second : nullptr;
+}
+
+Size SheetView::GetPrintableSize() const {
+    return size_;
+}
+
+size_t SheetView::GetCellCount() const {
+    return cell_count_;
+}
+
+void SheetView::PrintValues(std::ostream& output) const {
+    StreamSink sink(output);
+    ExportValues(sink);
+}
+
+void SheetView::PrintTexts(std::ostream& output) const {
+    StreamSink sink(output);
+    ExportTexts(sink);
+}
+
+void SheetView::ExportValues(ExportSink& sink) const {
+    Export(sink, [](ExportSink& out, const ViewCell& cell) {
+        PutValue(out, cell.GetValue());
+    });
+}
+
+void SheetView::ExportTexts(ExportSink& sink) const {
+    Export(sink, [](ExportSink& out, const ViewCell& cell) {
+        out.Put(cell.GetText());
+    });
+}
+
+//// Cells of a band are put in row-major order by walking its tiles row by row, each from where it stopped
+template <typename PutCell>
+void SheetView::Export(ExportSink& sink, PutCell put_cell) const {
+    std::vector<std::pair<Position, const ViewCell*>> cells;
+    std::vector<std::pair<TileCells::const_iterator, TileCells::const_iterator>> cursors;
+    for (int first_row = 0; first_row < size_.rows; first_row += SNAPSHOT_TILE_SIZE) {
+        int last_row = std::min(first_row + SNAPSHOT_TILE_SIZE, size_.rows);
+        cells.clear();
+        cursors.clear();
+        if (const auto& band = bands_[first_row / SNAPSHOT_TILE_SIZE]) {
+            for (const auto& tile : band->tiles) {
+                if (tile) cursors.emplace_back(tile->cells.begin(), tile->cells.end());
+            }
+            for (int row = first_row; row < last_row; row++) {
+                for (auto& [it, end] : cursors) {
+                    for (; it != end && it->first.row == row; ++it) cells.emplace_back(it->first, &it->second);
+                }
+            }
+        }
+        ExportRows(cells.begin(), cells.end(), first_row, last_row, size_.cols, sink, [&put_cell](ExportSink& out, const ViewCell* cell) {
+            put_cell(out, *cell);
+        });
+    }
+    sink.Flush();
+}
+
+//// The root is copied, then each band with replaced tiles; the other bands and tiles are shared
+std::shared_ptr<const SheetView> SheetView::Update(std::vector<std::pair<uint32_t, TileCells>> tiles) const {
+    auto view = std::make_shared<SheetView>(*this);
+    std::sort(tiles.begin(), tiles.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+    for (size_t i = 0; i < tiles.size();) {
+        uint32_t band_index = tiles[i].first / SNAPSHOT_TILE_COLS;
+        auto& slot = view->bands_[band_index];
+        auto band = slot ? std::make_shared<Band>(*slot) : std::make_shared<Band>();
+        for (; i < tiles.size() && tiles[i].first / SNAPSHOT_TILE_COLS == band_index; i++) {
+            auto& [index, cells] = tiles[i];
+            auto& tile = band->tiles[index % SNAPSHOT_TILE_COLS];
+            if (cells.empty()) {
+                tile = nullptr;
+                continue;
+            }
+            Size extent{0, 0};
+            for (const auto& cell : cells) extent = Extend(extent, {cell.first.row + 1, cell.first.col + 1});
+            tile = std::make_shared<const Tile>(Tile{std::move(cells), extent});
+        }
+        band->extent = {0, 0};
+        band->cell_count = 0;
+        for (const auto& tile : band->tiles) {
+            if (!tile) continue;
+            band->extent = Extend(band->extent, tile->extent);
+            band->cell_count += tile->cells.size();
+        }
+        slot = band->cell_count > 0 ? std::move(band) : nullptr;
+    }
+    view->size_ = {0, 0};
+    view->cell_count_ = 0;
+    for (const auto& band : view->bands_) {
+        if (!band) continue;
+        view->size_ = Extend(view->size_, band->extent);
+        view->cell_count_ += band->cell_count;
+    }
+    return view;
+}
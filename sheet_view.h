@@ -0,0 +1,79 @@
+#pragma once
+#include "common.h"
+#include "snapshot.h"
+
+#include <array>
+#include <iosfwd>
+#include <memory>
+#include <utility>
+#include <vector>
+
+class ExportSink;
+
+// Cell of a SheetView: text, value and references as they were when the view was taken
+class ViewCell : public CellInterface {
+public:
+    ViewCell(std::string text, Value value, std::vector<Position> referenced_cells, std::vector<Range> referenced_ranges, bool formula);
+
+    [[nodiscard]] Value GetValue() const override;
+
+    [[nodiscard]] std::string GetText() const override;
+
+    [[nodiscard]] std::vector<Position> GetReferencedCells() const override;
+
+    [[nodiscard]] std::vector<Range> GetReferencedRanges() const override;
+
+private:
+    std::string text_;
+    Value value_; // Formulas and empty cells --a text's value is its text
+    std::vector<Position> referenced_cells_;
+    std::vector<Range> referenced_ranges_;
+    bool formula_;
+};
+
+//// Immutable version of the cells of a sheet --SheetInterface::Snapshot(). Cells are kept in the tiles of
+//// snapshot.h, grouped by bands of tile rows: a new version shares every band and tile it doesn't replace with
+//// the previous one, so a version costs its changed tiles. Safe to read from any thread without locking
+class SheetView {
+public:
+    using TileCells = std::vector<std::pair<Position, ViewCell>>; // Cells of a tile sorted by position
+
+    // Throws InvalidPositionException. nullptr if there was no cell
+    [[nodiscard]] const CellInterface* GetCell(Position pos) const;
+
+    [[nodiscard]] Size GetPrintableSize() const;
+
+    [[nodiscard]] size_t GetCellCount() const;
+
+    void PrintValues(std::ostream& output) const; // As SheetInterface::PrintValues() printed the sheet
+
+    void PrintTexts(std::ostream& output) const;
+
+    void ExportValues(ExportSink& sink) const;
+
+    void ExportTexts(ExportSink& sink) const;
+
+    // A version with the cells of the given tiles replaced --an empty list removes the tile's cells
+    [[nodiscard]] std::shared_ptr<const SheetView> Update(std::vector<std::pair<uint32_t, TileCells>> tiles) const;
+
+private:
+    static constexpr size_t BAND_COUNT = Position::MAX_ROWS / SNAPSHOT_TILE_SIZE;
+
+    struct Tile {
+        TileCells cells;
+        Size extent; // Of the printable area of its cells
+    };
+
+    struct Band {
+        std::array<std::shared_ptr<const Tile>, SNAPSHOT_TILE_COLS> tiles{};
+        Size extent{0, 0};
+        size_t cell_count = 0;
+    };
+
+    template <typename PutCell>
+    void Export(ExportSink& sink, PutCell put_cell) const; // put_cell(sink, cell)
+
+    std::array<std::shared_ptr<const Band>, BAND_COUNT> bands_{}; // nullptr for bands without cells
+    Size size_{0, 0};
+    size_t cell_count_ = 0;
+};
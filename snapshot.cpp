@@ -0,0 +1,797 @@
+#include "snapshot.h"
+#include "checksum.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    //// Cell table. Integers are LEB128 varints, signed ones zigzag encoded:
+    ////   texts: count, then the size and bytes of each distinct text
+    ////   templates: per template its offset and size in the blob, then its precedent count and precedents as
+    ////     row and column offsets from the cell, then its range count and ranges as the offsets of both corners
+    ////   columns: count, then per column of the sheet in ascending order
+    ////     column as a gap from the previous one, cell count
+    ////     rows: (gap from the end of the previous run, length) runs
+    ////     kinds: (CellKind, length) runs
+    ////     texts: an index per Text cell
+    ////     integers: (delta from the previous one, length) runs over the Integer cells
+    ////     templates: (index, length) runs over the Formula cells
+    ////     states: (ValueState, length) runs over the Formula cells
+    ////     numbers: over the formulas with a Number state, (delta from the previous integral value shifted left
+    ////       by one, length) runs, or 1 and the raw double of a fractional value
+    //// Runs hold until the column's count of their cells is reached. A column of copied formulas costs a template
+    //// run and its values, a progression of numbers or ids costs a run, an error costs nothing beyond its state
+    enum class CellKind : uint8_t {
+        Empty,
+        Text,
+        Integer, // Text of a canonical integer below 2^53 --ids, codes, years
+        Formula,
+    };
+
+    // Value kind in the high bits --0 for a number, 1 + FormulaError::Category for an error--, stale flag in bit 0
+    using ValueState = uint8_t;
+    const ValueState STALE = 1;
+    const uint64_t STATE_COUNT = (static_cast<uint64_t>(FormulaError::Category::NA) + 2) << 1;
+
+    const int64_t MAX_EXACT = int64_t{1} << 53; // Integers beyond it aren't all doubles, deltas of smaller ones fit
+
+    // Formula compiled relative to its cell with the precedents it references, shared by all cells of the pattern
+    struct Template {
+        std::string_view compiled;
+        std::vector<Position> precedents; // Offsets from the cell
+        std::vector<Range> ranges; // Offsets of the corners from the cell
+        bool checked = false; // Compiled form read once at the first cell --load only
+    };
+
+    // A decoded cell of the table
+    struct CellRecord {
+        Position pos;
+        CellKind kind;
+        ValueState state; // Formula
+        uint32_t index; // Text: in the texts, Formula: in the templates
+        int64_t integer; // Integer
+        double number; // Formula with a Number state
+    };
+
+    std::optional<int64_t> GetInteger(const std::string& text) {
+        size_t sign = !text.empty() && text[0] == '-' ? 1 : 0;
+        if (text.size() == sign || text.size() > sign + 15 || (text[sign] == '0' && text.size() > 1)) return std::nullopt;
+        for (size_t i = sign; i < text.size(); i++) {
+            if (text[i] < '0' || text[i] > '9') return std::nullopt;
+        }
+        return std::stoll(text);
+    }
+
+    std::optional<int64_t> GetIntegral(double value) {
+        if (!(value >= -MAX_EXACT && value <= MAX_EXACT) || value != std::trunc(value) || (value == 0 && std::signbit(value))) {
+            return std::nullopt;
+        }
+        return static_cast<int64_t>(value);
+    }
+
+    uint64_t ZigZag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t UnZigZag(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    void PutVarint(std::string& out, uint64_t value) {
+        for (; value >= 0x80; value >>= 7) out += static_cast<char>(value | 0x80);
+        out += static_cast<char>(value);
+    }
+
+    // (encode(value), length) runs of equal values
+    template <typename T, typename Encode>
+    void PutRuns(std::string& out, const std::vector<T>& values, Encode encode) {
+        for (size_t i = 0; i < values.size();) {
+            size_t j = i + 1;
+            while (j < values.size() && values[j] == values[i]) j++;
+            PutVarint(out, encode(values[i]));
+            PutVarint(out, j - i);
+            i = j;
+        }
+    }
+
+    // Cells of a column of the sheet, split by stream
+    struct Column {
+        std::vector<int> rows;
+        std::vector<CellKind> kinds;
+        std::vector<uint64_t> texts;
+        std::vector<int64_t> integers;
+        std::vector<uint64_t> templates;
+        std::vector<ValueState> states;
+        std::vector<double> numbers;
+    };
+
+    //// Collects the cells in position order --rows ascend within every column-- and encodes them
+    class TableWriter {
+    public:
+        void AddCell(Position pos, const Cell& cell, bool dirty) {
+            Column& column = columns_[pos.col];
+            column.rows.push_back(pos.row);
+            cell_count_++;
+            if (cell.IsFormula()) {
+                column.kinds.push_back(CellKind::Formula);
+                std::string compiled;
+                cell.SerializeFormula(compiled);
+                auto [it, added] = template_indexes_.try_emplace(std::move(compiled), template_indexes_.size());
+                if (added) {
+                    PutVarint(template_table_, blob_.size());
+                    PutVarint(template_table_, it->first.size());
+                    blob_ += it->first;
+                    auto precedents = cell.GetReferencedCells();
+                    PutVarint(template_table_, precedents.size());
+                    for (auto prev : precedents) PutOffset(prev, pos);
+                    auto ranges = cell.GetReferencedRanges();
+                    PutVarint(template_table_, ranges.size());
+                    for (Range range : ranges) {
+                        PutOffset(range.from, pos);
+                        PutOffset(range.to, pos);
+                    }
+                }
+                column.templates.push_back(it->second);
+                auto value = cell.GetValue();
+                ValueState state = dirty ? STALE : 0;
+                if (std::holds_alternative<double>(value)) {
+                    column.numbers.push_back(std::get<double>(value));
+                } else {
+                    state |= static_cast<ValueState>((static_cast<int>(std::get<FormulaError>(value).GetCategory()) + 1) << 1);
+                }
+                column.states.push_back(state);
+                return;
+            }
+            std::string text = cell.GetText();
+            if (text.empty()) {
+                column.kinds.push_back(CellKind::Empty);
+            } else if (auto integer = GetInteger(text)) {
+                column.kinds.push_back(CellKind::Integer);
+                column.integers.push_back(*integer);
+            } else {
+                column.kinds.push_back(CellKind::Text);
+                auto [it, added] = text_indexes_.try_emplace(std::move(text), text_indexes_.size());
+                if (added) {
+                    PutVarint(text_table_, it->first.size());
+                    text_table_ += it->first;
+                }
+                column.texts.push_back(it->second);
+            }
+        }
+
+        [[nodiscard]] uint64_t GetCellCount() const {
+            return cell_count_;
+        }
+
+        [[nodiscard]] uint64_t GetTemplateCount() const {
+            return template_indexes_.size();
+        }
+
+        [[nodiscard]] const std::string& GetBlob() const {
+            return blob_;
+        }
+
+        [[nodiscard]] std::string Encode() const {
+            std::string out;
+            PutVarint(out, text_indexes_.size());
+            out += text_table_;
+            out += template_table_;
+            PutVarint(out, columns_.size());
+            int previous_col = 0;
+            for (const auto& [col, column] : columns_) {
+                PutVarint(out, static_cast<uint64_t>(col - previous_col));
+                previous_col = col;
+                PutVarint(out, column.rows.size());
+                int end = 0; // Row after the previous run
+                for (size_t i = 0; i < column.rows.size();) {
+                    size_t j = i + 1;
+                    while (j < column.rows.size() && column.rows[j] == column.rows[j - 1] + 1) j++;
+                    PutVarint(out, static_cast<uint64_t>(column.rows[i] - end));
+                    PutVarint(out, j - i);
+                    end = column.rows[j - 1] + 1;
+                    i = j;
+                }
+                PutRuns(out, column.kinds, [](CellKind kind) { return static_cast<uint64_t>(kind); });
+                for (uint64_t index : column.texts) PutVarint(out, index);
+                std::vector<int64_t> deltas(column.integers.size());
+                for (size_t i = 0; i < deltas.size(); i++) deltas[i] = column.integers[i] - (i > 0 ? column.integers[i - 1] : 0);
+                PutRuns(out, deltas, ZigZag);
+                PutRuns(out, column.templates, [](uint64_t index) { return index; });
+                PutRuns(out, column.states, [](ValueState state) { return uint64_t{state}; });
+                PutNumbers(out, column.numbers);
+            }
+            return out;
+        }
+
+    private:
+        void PutOffset(Position target, Position pos) {
+            PutVarint(template_table_, ZigZag(target.row - pos.row));
+            PutVarint(template_table_, ZigZag(target.col - pos.col));
+        }
+
+        static void PutNumbers(std::string& out, const std::vector<double>& numbers) {
+            int64_t previous = 0;
+            for (size_t i = 0; i < numbers.size();) {
+                auto integral = GetIntegral(numbers[i]);
+                if (!integral) {
+                    PutVarint(out, 1);
+                    out.append(reinterpret_cast<const char*>(&numbers[i]), sizeof(double));
+                    i++;
+                    continue;
+                }
+                int64_t delta = *integral - previous;
+                previous = *integral;
+                size_t j = i + 1;
+                for (; j < numbers.size(); j++) {
+                    auto next = GetIntegral(numbers[j]);
+                    if (!next || *next - previous != delta) break;
+                    previous = *next;
+                }
+                PutVarint(out, ZigZag(delta) << 1);
+                PutVarint(out, j - i);
+                i = j;
+            }
+        }
+
+        std::map<int, Column> columns_;
+        std::unordered_map<std::string, uint64_t> text_indexes_;
+        std::string text_table_;
+        std::unordered_map<std::string, uint64_t> template_indexes_; // By compiled form
+        std::string template_table_;
+        std::string blob_;
+        uint64_t cell_count_ = 0;
+    };
+
+    FileException Damaged(const std::string& path, const std::string& what) {
+        return FileException(path + " is not a valid snapshot: " + what);
+    }
+
+    //// Reads the table, every read is bounded by the end of the table
+    class TableReader {
+    public:
+        TableReader(std::string_view data, const std::string& path)
+            : data_(data)
+            , path_(path) {
+        }
+
+        uint64_t Get() {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (data_.empty()) throw Broken();
+                auto byte = static_cast<uint8_t>(data_[0]);
+                data_.remove_prefix(1);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return value;
+            }
+            throw Broken();
+        }
+
+        uint64_t Get(uint64_t limit) { // Below limit
+            uint64_t value = Get();
+            if (value >= limit) throw Broken();
+            return value;
+        }
+
+        std::string_view GetBytes(uint64_t size) {
+            if (size > data_.size()) throw Broken();
+            std::string_view bytes = data_.substr(0, size);
+            data_.remove_prefix(size);
+            return bytes;
+        }
+
+        double GetDouble() {
+            double value;
+            std::memcpy(&value, GetBytes(sizeof(value)).data(), sizeof(value));
+            return value;
+        }
+
+        // Calls put(value, length) for runs of value_limit values until count items are covered
+        template <typename Put>
+        void GetRuns(uint64_t count, uint64_t value_limit, Put put) {
+            while (count > 0) {
+                uint64_t value = Get(value_limit);
+                uint64_t length = Get(count + 1);
+                if (length == 0) throw Broken();
+                put(value, length);
+                count -= length;
+            }
+        }
+
+        Position GetOffset() { // Row and column offsets from a cell
+            int64_t row = UnZigZag(Get());
+            int64_t col = UnZigZag(Get());
+            if (std::abs(row) >= Position::MAX_ROWS || std::abs(col) >= Position::MAX_COLS) throw Broken();
+            return {static_cast<int>(row), static_cast<int>(col)};
+        }
+
+        [[nodiscard]] bool AtEnd() const {
+            return data_.empty();
+        }
+
+        [[nodiscard]] FileException Broken() const {
+            return Damaged(path_, "broken cell table");
+        }
+
+    private:
+        std::string_view data_;
+        const std::string& path_;
+    };
+
+    // A mapped snapshot with a checked header and its decoded table
+    struct MappedSnapshot {
+        std::string path;
+        std::shared_ptr<const MappedFile> file;
+        std::string_view data;
+        SnapshotHeader header;
+        std::vector<std::string_view> texts;
+        std::vector<Template> templates;
+        std::vector<CellRecord> cells; // Sorted by position
+    };
+
+    template <typename T>
+    void Append(std::string& out, const T* items, size_t count) {
+        out.append(reinterpret_cast<const char*>(items), count * sizeof(T));
+    }
+
+    template <typename T>
+    T Read(std::string_view data, uint64_t offset) {
+        T item;
+        std::memcpy(&item, data.data() + offset, sizeof(item));
+        return item;
+    }
+
+    // Lays out the file and completes the header: offsets and checksum
+    std::string Assemble(SnapshotHeader& header, const TableWriter& table, const std::vector<uint32_t>& tiles) {
+        std::string encoded = table.Encode();
+        const std::string& blob = table.GetBlob();
+        std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.byte_order = SNAPSHOT_BYTE_ORDER;
+        header.cell_count = table.GetCellCount();
+        header.table_offset = sizeof(SnapshotHeader);
+        header.template_count = table.GetTemplateCount();
+        header.tiles_offset = header.table_offset + encoded.size();
+        header.tile_count = tiles.size();
+        header.blob_offset = header.tiles_offset + tiles.size() * sizeof(uint32_t);
+        header.size = header.blob_offset + blob.size();
+
+        std::string data;
+        data.reserve(header.size);
+        Append(data, &header, 1);
+        data += encoded;
+        Append(data, tiles.data(), tiles.size());
+        data += blob;
+        header.checksum = Crc32(std::string_view(data).substr(sizeof(SnapshotHeader)));
+        std::memcpy(data.data(), &header, sizeof(header));
+        return data;
+    }
+
+    // Through a temporary file renamed over path, so a failed save keeps the old file
+#ifdef _WIN32
+    int CreateForWrite(const std::string& path) {
+        return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    }
+
+    long long WriteSome(int fd, const char* data, size_t size) {
+        return _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+    }
+
+    int SyncFile(int fd) {
+        return _commit(fd);
+    }
+
+    void CloseFile(int fd) {
+        _close(fd);
+    }
+
+    // The CRT can't open a directory to commit it, NTFS journals the rename itself
+    bool SyncDirectory(const std::string&) {
+        return true;
+    }
+#else
+    int CreateForWrite(const std::string& path) {
+        return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    long long WriteSome(int fd, const char* data, size_t size) {
+        return write(fd, data, size);
+    }
+
+    int SyncFile(int fd) {
+        return fsync(fd);
+    }
+
+    void CloseFile(int fd) {
+        close(fd);
+    }
+
+    // A rename is durable once the directory holding the entry is synced
+    bool SyncDirectory(const std::string& path) {
+        auto slash = path.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = open(directory.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+    }
+#endif
+
+    //// The temporary file is synced before the rename and the directory after it, so once this returns the
+    //// snapshot survives a crash and the journal it replaces may be reset
+    void WriteFile(const std::string& data, const std::string& path) {
+        const std::string temporary = path + ".tmp";
+        int fd = CreateForWrite(temporary);
+        if (fd < 0) throw FileException("Can't create " + temporary);
+        bool written = true;
+        for (size_t done = 0; written && done < data.size();) {
+            long long count = WriteSome(fd, data.data() + done, data.size() - done);
+            if (count < 0 && errno == EINTR) continue;
+            written = count > 0;
+            if (written) done += static_cast<size_t>(count);
+        }
+        written = written && SyncFile(fd) == 0;
+        CloseFile(fd);
+        if (!written) {
+            std::remove(temporary.c_str());
+            throw FileException("Can't write " + temporary);
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            throw FileException("Can't replace " + path);
+        }
+        if (!SyncDirectory(path)) throw FileException("Can't sync the directory of " + path);
+    }
+
+    void CheckHeader(const SnapshotHeader& header, size_t size, SnapshotKind kind, const std::string& path) {
+        if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) throw Damaged(path, "wrong magic");
+        if (header.version != SNAPSHOT_VERSION) throw Damaged(path, "unsupported version");
+        if (header.byte_order != SNAPSHOT_BYTE_ORDER) throw Damaged(path, "written with another byte order");
+        if (header.mode > static_cast<uint32_t>(CalculationMode::Manual)) throw Damaged(path, "unknown calculation mode");
+        if (header.kind != kind) throw Damaged(path, kind == SnapshotKind::Base ? "not a base" : "not a delta");
+        if (header.size != size) throw Damaged(path, "truncated");
+        if (header.table_offset != sizeof(SnapshotHeader)
+            || header.tiles_offset < header.table_offset || header.tiles_offset > size
+            || header.tile_count > (size - header.tiles_offset) / sizeof(uint32_t)
+            || header.blob_offset != header.tiles_offset + header.tile_count * sizeof(uint32_t)
+            // Every cell and template takes a byte of the table at least
+            || header.cell_count > header.tiles_offset - header.table_offset
+            || header.template_count > header.tiles_offset - header.table_offset
+            || (kind == SnapshotKind::Base && header.tile_count != 0)) {
+            throw Damaged(path, "broken section table");
+        }
+    }
+
+    void ReadColumn(TableReader& reader, int col, const MappedSnapshot& snapshot, std::vector<CellRecord>& cells) {
+        uint64_t count = reader.Get(snapshot.header.cell_count - cells.size() + 1);
+        size_t first = cells.size();
+        uint64_t row = 0;
+        reader.GetRuns(count, Position::MAX_ROWS, [&](uint64_t gap, uint64_t length) {
+            row += gap;
+            if (row + length > static_cast<uint64_t>(Position::MAX_ROWS)) throw reader.Broken();
+            for (; length > 0; length--) {
+                cells.push_back({{static_cast<int>(row++), col}, CellKind::Empty, 0, 0, 0, 0.0});
+            }
+        });
+        auto column = cells.begin() + static_cast<std::ptrdiff_t>(first);
+        auto kind_it = column;
+        reader.GetRuns(count, 4, [&](uint64_t kind, uint64_t length) {
+            for (; length > 0; length--) (kind_it++)->kind = static_cast<CellKind>(kind);
+        });
+        auto of_kind = [column, end = cells.end()](CellKind kind) {
+            std::vector<CellRecord*> records;
+            for (auto it = column; it != end; ++it) {
+                if (it->kind == kind) records.push_back(&*it);
+            }
+            return records;
+        };
+        for (CellRecord* record : of_kind(CellKind::Text)) record->index = static_cast<uint32_t>(reader.Get(snapshot.texts.size()));
+        auto integers = of_kind(CellKind::Integer);
+        int64_t integer = 0;
+        size_t next = 0;
+        reader.GetRuns(integers.size(), ZigZag(-2 * MAX_EXACT) + 1, [&](uint64_t delta, uint64_t length) {
+            for (; length > 0; length--) {
+                integer += UnZigZag(delta);
+                if (integer < -MAX_EXACT || integer > MAX_EXACT) throw reader.Broken();
+                integers[next++]->integer = integer;
+            }
+        });
+        auto formulas = of_kind(CellKind::Formula);
+        next = 0;
+        reader.GetRuns(formulas.size(), snapshot.templates.size(), [&](uint64_t index, uint64_t length) {
+            for (; length > 0; length--) formulas[next++]->index = static_cast<uint32_t>(index);
+        });
+        next = 0;
+        std::vector<CellRecord*> numbers;
+        reader.GetRuns(formulas.size(), STATE_COUNT, [&](uint64_t state, uint64_t length) {
+            for (; length > 0; length--) {
+                formulas[next]->state = static_cast<ValueState>(state);
+                if (state >> 1 == 0) numbers.push_back(formulas[next]);
+                next++;
+            }
+        });
+        int64_t previous = 0;
+        for (next = 0; next < numbers.size();) {
+            uint64_t tag = reader.Get();
+            if (tag & 1) {
+                if (tag != 1) throw reader.Broken();
+                numbers[next++]->number = reader.GetDouble();
+                continue;
+            }
+            int64_t delta = UnZigZag(tag >> 1);
+            uint64_t length = reader.Get(numbers.size() - next + 1);
+            if (length == 0) throw reader.Broken();
+            for (; length > 0; length--) {
+                previous += delta;
+                if (previous < -MAX_EXACT || previous > MAX_EXACT) throw reader.Broken();
+                numbers[next++]->number = static_cast<double>(previous);
+            }
+        }
+    }
+
+    // Decodes the table --it must describe exactly the cells and templates of the header
+    void ReadTable(MappedSnapshot& snapshot) {
+        const SnapshotHeader& header = snapshot.header;
+        TableReader reader(snapshot.data.substr(header.table_offset, header.tiles_offset - header.table_offset), snapshot.path);
+        snapshot.texts.resize(reader.Get(header.tiles_offset - header.table_offset));
+        for (auto& text : snapshot.texts) {
+            text = reader.GetBytes(reader.Get());
+            if (text.empty()) throw reader.Broken();
+        }
+        snapshot.templates.resize(header.template_count);
+        uint64_t blob_size = header.size - header.blob_offset;
+        for (auto& item : snapshot.templates) {
+            uint64_t offset = reader.Get(blob_size + 1);
+            uint64_t size = reader.Get(blob_size - offset + 1);
+            item.compiled = snapshot.data.substr(header.blob_offset + offset, size);
+            item.precedents.resize(reader.Get(header.tiles_offset - header.table_offset));
+            for (auto& prev : item.precedents) prev = reader.GetOffset();
+            item.ranges.resize(reader.Get(header.tiles_offset - header.table_offset));
+            for (auto& range : item.ranges) {
+                range.from = reader.GetOffset();
+                range.to = reader.GetOffset();
+            }
+        }
+        snapshot.cells.reserve(header.cell_count);
+        uint64_t col = 0;
+        for (uint64_t columns = reader.Get(Position::MAX_COLS + 1); columns > 0; columns--) {
+            col += reader.Get(Position::MAX_COLS);
+            if (col >= static_cast<uint64_t>(Position::MAX_COLS) || (!snapshot.cells.empty() && col == static_cast<uint64_t>(snapshot.cells.back().pos.col))) {
+                throw reader.Broken();
+            }
+            ReadColumn(reader, static_cast<int>(col), snapshot, snapshot.cells);
+        }
+        if (snapshot.cells.size() != header.cell_count || !reader.AtEnd()) throw reader.Broken();
+        std::sort(snapshot.cells.begin(), snapshot.cells.end(), [](const CellRecord& lhs, const CellRecord& rhs) {
+            return lhs.pos < rhs.pos;
+        });
+    }
+
+    MappedSnapshot OpenSnapshot(const std::string& path, SnapshotKind kind) {
+        MappedSnapshot snapshot{path, std::make_shared<const MappedFile>(path), {}, {}, {}, {}, {}};
+        snapshot.data = snapshot.file->GetData();
+        if (snapshot.data.size() < sizeof(SnapshotHeader)) throw Damaged(path, "truncated");
+        snapshot.header = Read<SnapshotHeader>(snapshot.data, 0);
+        CheckHeader(snapshot.header, snapshot.data.size(), kind, path);
+        // The table is decoded whole anyway: one more pass catches what bounds checks can't --a flipped value or text
+        if (Crc32(snapshot.data.substr(sizeof(SnapshotHeader))) != snapshot.header.checksum) throw Damaged(path, "checksum mismatch");
+        ReadTable(snapshot);
+        return snapshot;
+    }
+
+    CellInterface::Value ReadValue(const CellRecord& record) {
+        if (record.state >> 1 == 0) return record.number;
+        return FormulaError(static_cast<FormulaError::Category>((record.state >> 1) - 1));
+    }
+
+    //// A template is checked against its precedents at its first cell: the same bytes at another cell reference the
+    //// same cells moved with it, whose positions are checked with the links
+    std::unique_ptr<Impl> MakeImpl(MappedSnapshot& snapshot, const CellRecord& record, SheetInterface& sheet) {
+        switch (record.kind) {
+            case CellKind::Empty:
+                return std::make_unique<EmptyImpl>();
+            case CellKind::Text:
+                return std::make_unique<TextImpl>(std::string(snapshot.texts[record.index]));
+            case CellKind::Integer:
+                return std::make_unique<TextImpl>(std::to_string(record.integer));
+            case CellKind::Formula:
+                break;
+        }
+        Template& item = snapshot.templates[record.index];
+        std::vector<Position> precedents(item.precedents.size());
+        for (size_t i = 0; i < precedents.size(); i++) {
+            precedents[i] = {record.pos.row + item.precedents[i].row, record.pos.col + item.precedents[i].col};
+        }
+        std::vector<Range> ranges(item.ranges.size());
+        for (size_t i = 0; i < ranges.size(); i++) {
+            Range offsets = item.ranges[i];
+            ranges[i] = {{record.pos.row + offsets.from.row, record.pos.col + offsets.from.col},
+                         {record.pos.row + offsets.to.row, record.pos.col + offsets.to.col}};
+        }
+        if (!item.checked) {
+            bool valid;
+            try {
+                FormulaAST ast = DeserializeFormulaAST(item.compiled, record.pos);
+                valid = ast.GetCells() == precedents && ast.GetRanges() == ranges;
+            } catch (const ParsingError&) {
+                valid = false;
+            }
+            if (!valid) throw Damaged(snapshot.path, "broken formula template at " + record.pos.ToString());
+            item.checked = true;
+        }
+        CompiledFormula compiled{snapshot.file, item.compiled, record.pos};
+        return std::make_unique<FormulaImpl>(std::string(), ReadValue(record), std::move(precedents), std::move(ranges),
+                                             std::move(compiled), sheet);
+    }
+
+    uint64_t GetFileSize(const std::string& path) {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        return file ? static_cast<uint64_t>(file.tellg()) : 0;
+    }
+}  // namespace
+
+uint32_t TileSet::GetTile(Position pos) {
+    return static_cast<uint32_t>(pos.row / SNAPSHOT_TILE_SIZE) * SNAPSHOT_TILE_COLS + static_cast<uint32_t>(pos.col / SNAPSHOT_TILE_SIZE);
+}
+
+void TileSet::InsertTile(uint32_t tile) {
+    Insert({static_cast<int>(tile / SNAPSHOT_TILE_COLS) * SNAPSHOT_TILE_SIZE, static_cast<int>(tile % SNAPSHOT_TILE_COLS) * SNAPSHOT_TILE_SIZE});
+}
+
+bool TileSet::Contains(Position pos) const {
+    if (words_.empty()) return false;
+    uint32_t tile = GetTile(pos);
+    return (words_[tile / 64] >> (tile % 64)) & 1;
+}
+
+std::vector<uint32_t> TileSet::GetTiles() const {
+    std::vector<uint32_t> tiles;
+    tiles.reserve(count_);
+    for (size_t i = 0; i < words_.size(); i++) {
+        for (uint64_t word = words_[i]; word != 0; word &= word - 1) {
+            int bit = 0;
+            while (!((word >> bit) & 1)) bit++;
+            tiles.push_back(static_cast<uint32_t>(i * 64 + bit));
+        }
+    }
+    return tiles;
+}
+
+size_t TileSet::GetCount() const {
+    return count_;
+}
+
+void TileSet::Clear() {
+    words_.clear();
+    count_ = 0;
+}
+
+void WriteSnapshot(const Sheet& sheet, const std::string& path) {
+    TableWriter table;
+    for (const auto& [pos, cell] : sheet.sheet_) table.AddCell(pos, cell, sheet.dirty_.count(pos) > 0);
+    SnapshotHeader header{};
+    header.kind = SnapshotKind::Base;
+    header.mode = static_cast<uint32_t>(sheet.mode_);
+    WriteFile(Assemble(header, table, {}), path);
+    sheet.base_checksum_ = header.checksum;
+    sheet.changed_tiles_.Clear();
+}
+
+//// Rows of a band of tiles are scanned once for all its changed tiles, the cells of the others are skipped
+bool WriteDelta(const Sheet& sheet, const std::string& path) {
+    if (!sheet.base_checksum_) return false;
+    auto tiles = sheet.changed_tiles_.GetTiles();
+    TableWriter table;
+    for (size_t i = 0; i < tiles.size();) {
+        uint32_t band = tiles[i] / SNAPSHOT_TILE_COLS;
+        while (i < tiles.size() && tiles[i] / SNAPSHOT_TILE_COLS == band) i++;
+        int first_row = static_cast<int>(band) * SNAPSHOT_TILE_SIZE;
+        auto end = sheet.sheet_.lower_bound({first_row + SNAPSHOT_TILE_SIZE, 0});
+        for (auto it = sheet.sheet_.lower_bound({first_row, 0}); it != end; ++it) {
+            if (sheet.changed_tiles_.Contains(it->first)) table.AddCell(it->first, it->second, sheet.dirty_.count(it->first) > 0);
+        }
+    }
+    SnapshotHeader header{};
+    header.kind = SnapshotKind::Delta;
+    header.mode = static_cast<uint32_t>(sheet.mode_);
+    header.base_checksum = *sheet.base_checksum_;
+    WriteFile(Assemble(header, table, tiles), path);
+    return true;
+}
+
+//// Both tables are decoded and sorted, so their cells are merged in order and every cell is appended at the end
+//// of the map. Formulas keep a reference to their mapping until they are loaded; texts are copied out, so a sheet
+//// without formulas releases the files at once
+std::unique_ptr<Sheet> ReadSnapshot(const std::string& path, const std::string& delta_path) {
+    MappedSnapshot base = OpenSnapshot(path, SnapshotKind::Base);
+    std::optional<MappedSnapshot> delta;
+    if (!delta_path.empty() && std::ifstream(delta_path, std::ios::binary)) {
+        delta = OpenSnapshot(delta_path, SnapshotKind::Delta);
+        if (delta->header.base_checksum != base.header.checksum) delta.reset();
+    }
+
+    std::string name = delta ? path + " with " + delta_path : path;
+    auto damaged = [&name](Position pos, const char* what) {
+        return Damaged(name, what + (" at " + pos.ToString()));
+    };
+
+    TileSet replaced; // Tiles taken from the delta
+    if (delta) {
+        for (uint64_t i = 0; i < delta->header.tile_count; i++) {
+            auto tile = Read<uint32_t>(delta->data, delta->header.tiles_offset + i * sizeof(uint32_t));
+            uint32_t previous = i > 0 ? Read<uint32_t>(delta->data, delta->header.tiles_offset + (i - 1) * sizeof(uint32_t)) : 0;
+            if (tile >= SNAPSHOT_TILE_COUNT || (i > 0 && tile <= previous)) throw Damaged(delta_path, "broken tile list");
+            replaced.InsertTile(tile);
+        }
+    }
+
+    auto sheet = std::make_unique<Sheet>();
+    std::vector<Cell*> formulas;
+    auto restore = [&](MappedSnapshot& snapshot, const CellRecord& record) {
+        auto impl = MakeImpl(snapshot, record, *sheet);
+        if (record.kind == CellKind::Formula && (record.state & STALE)) sheet->dirty_.insert(sheet->dirty_.end(), record.pos);
+        auto it = sheet->sheet_.emplace_hint(sheet->sheet_.end(), std::piecewise_construct, std::forward_as_tuple(record.pos), std::forward_as_tuple());
+        it->second.Restore(record.pos, std::move(impl));
+        if (it->second.IsFormula()) formulas.push_back(&it->second);
+    };
+
+    auto base_it = base.cells.begin();
+    auto skip_replaced = [&] {
+        while (base_it != base.cells.end() && replaced.Contains(base_it->pos)) ++base_it;
+    };
+    skip_replaced();
+    auto delta_it = delta ? delta->cells.begin() : base.cells.end();
+    auto delta_end = delta ? delta->cells.end() : base.cells.end();
+    while (base_it != base.cells.end() || delta_it != delta_end) {
+        if (delta_it != delta_end && (base_it == base.cells.end() || delta_it->pos < base_it->pos)) {
+            if (!replaced.Contains(delta_it->pos)) throw damaged(delta_it->pos, "delta cell outside its tiles");
+            restore(*delta, *delta_it++);
+        } else {
+            restore(base, *base_it++);
+            skip_replaced();
+        }
+    }
+
+    for (Cell* cell : formulas) {
+        for (auto prev : cell->GetReferencedCells()) {
+            if (!prev.IsValid() || sheet->sheet_.count(prev) == 0) throw damaged(cell->GetPosition(), "missing precedent");
+        }
+        for (Range range : cell->GetReferencedRanges()) {
+            if (!range.IsValid()) throw damaged(cell->GetPosition(), "invalid range");
+        }
+        cell->RestoreLinks(*sheet);
+    }
+    sheet->mode_ = static_cast<CalculationMode>(delta ? delta->header.mode : base.header.mode);
+    sheet->base_checksum_ = base.header.checksum;
+    sheet->changed_tiles_ = std::move(replaced);
+    return sheet;
+}
+
+//// The delta is written first: its size tells whether a compaction pays off
+bool Autosave(const SheetInterface& sheet, const std::string& base_path, const std::string& delta_path, const AutosaveOptions& options) {
+    if (sheet.SaveDelta(delta_path)
+        && static_cast<double>(GetFileSize(delta_path)) <= options.max_delta_ratio * static_cast<double>(GetFileSize(base_path))) {
+        return false;
+    }
+    sheet.SaveSnapshot(base_path);
+    std::remove(delta_path.c_str());
+    return true;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "common.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class Sheet;
+
+//// Binary snapshot of a sheet:
+////   header | cell table | tile indexes | blob of compiled formula templates
+//// The cell table is stored column by column and compressed in place --see snapshot.cpp: runs of rows, a
+//// dictionary of texts, varint deltas for integers and formula values, one template for every formula of the
+//// same pattern and no payload for error values. It is decoded on load; templates are read from the mapped file
+//// when a formula is first evaluated. The header, tile indexes and fractional values are in the byte order of the
+//// writing machine, recorded in the header. Every cell of the sheet is stored, empty ones included --they keep
+//// the dependencies of formulas that use them.
+//// A base holds the whole sheet. A delta holds the cells of the tiles changed since its base and replaces those
+//// tiles of the base when both are loaded; every delta covers all changes since the base, only the newest is kept
+
+inline constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+inline constexpr uint32_t SNAPSHOT_VERSION = 4;
+inline constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+enum class SnapshotKind : uint32_t {
+    Base,
+    Delta,
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SNAPSHOT_BYTE_ORDER as written
+    uint32_t mode; // CalculationMode
+    SnapshotKind kind;
+    uint32_t checksum; // CRC-32 of the file after the header --verified on load, identifies a base
+    uint32_t base_checksum; // Delta: checksum of its base
+    uint64_t cell_count;
+    uint64_t table_offset; // Encoded cells, up to the tile indexes
+    uint64_t template_count; // Formula templates described by the table
+    uint64_t tiles_offset; // Delta: uint32_t[tile_count], ascending indexes of the replaced tiles
+    uint64_t tile_count;
+    uint64_t blob_offset;
+    uint64_t size; // Whole file
+};
+
+static_assert(sizeof(SnapshotHeader) == 88 && std::is_trivially_copyable_v<SnapshotHeader>);
+
+// Unit of change tracking: a square of SNAPSHOT_TILE_SIZE x SNAPSHOT_TILE_SIZE cells, numbered row by row
+inline constexpr int SNAPSHOT_TILE_SIZE = 64;
+inline constexpr uint32_t SNAPSHOT_TILE_COLS = Position::MAX_COLS / SNAPSHOT_TILE_SIZE;
+inline constexpr uint32_t SNAPSHOT_TILE_COUNT = SNAPSHOT_TILE_COLS * (Position::MAX_ROWS / SNAPSHOT_TILE_SIZE);
+
+//// Tiles changed since the base snapshot, one bit per tile. The bitmap is allocated by the first change
+class TileSet {
+public:
+    static uint32_t GetTile(Position pos);
+
+    void Insert(Position pos) {
+        uint32_t tile = GetTile(pos);
+        if (words_.empty()) words_.resize(SNAPSHOT_TILE_COUNT / 64);
+        uint64_t bit = uint64_t{1} << (tile % 64);
+        if (!(words_[tile / 64] & bit)) {
+            words_[tile / 64] |= bit;
+            count_++;
+        }
+    }
+
+    void InsertTile(uint32_t tile); // tile < SNAPSHOT_TILE_COUNT
+
+    [[nodiscard]] bool Contains(Position pos) const;
+
+    [[nodiscard]] std::vector<uint32_t> GetTiles() const; // Ascending
+
+    [[nodiscard]] size_t GetCount() const;
+
+    void Clear();
+
+private:
+    std::vector<uint64_t> words_;
+    size_t count_ = 0;
+};
+
+// Writes a base through a temporary file renamed over path, so a failed save keeps the old snapshot. The file and
+// the rename are synced before it returns. The sheet remembers it as its base and forgets its changed tiles.
+// Throws FileException
+void WriteSnapshot(const Sheet& sheet, const std::string& path);
+
+// Writes the tiles changed since the base of the sheet the same way. Returns false and writes nothing if the
+// sheet has no base. Throws FileException
+bool WriteDelta(const Sheet& sheet, const std::string& path);
+
+// Maps the base, and the delta if delta_path is not empty and exists, and restores all cells, values, dependencies
+// and the calculation mode at once, without parsing or evaluating anything. Formulas are loaded from their compiled form
+// on first evaluation. A delta of another base is ignored: it is left by a compaction interrupted before the old
+// delta was removed, its changes are in the new base. Throws FileException if a file can't be read or is damaged
+std::unique_ptr<Sheet> ReadSnapshot(const std::string& path, const std::string& delta_path = {});
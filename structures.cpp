@@ -1,11 +1,9 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = {-1, -1};
@@ -23,60 +21,116 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+size_t Position::ToChars(char* buffer) const {
     if (!IsValid()) {
-        return "";
+        return 0;
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    char letters[MAX_POS_LETTER_COUNT];
+    char* first = letters + MAX_POS_LETTER_COUNT;
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        *--first = static_cast<char>('A' + c % LETTERS);
     }
+    char* end = std::copy(first, letters + MAX_POS_LETTER_COUNT, buffer);
+    return std::to_chars(end, buffer + MAX_STRING_LENGTH, row + 1).ptr - buffer;
+}
 
-    result += std::to_string(row + 1);
+namespace {
+    // LETTER_VALUES[c] is 1 for 'A' ... 26 for 'Z', 0 for any other char
+    struct LetterTable {
+        constexpr LetterTable() : values() {
+            for (int i = 0; i < LETTERS; i++) values['A' + i] = static_cast<unsigned char>(i + 1);
+        }
 
-    return result;
-}
+        unsigned char values[256];
+    };
 
-Position Position::FromString(std::string_view str) {
-    auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
-    });
-    auto letters = str.substr(0, it - str.begin());
-    auto digits = str.substr(it - str.begin());
+    constexpr LetterTable LETTER_VALUES;
+}  // namespace
 
-    if (letters.empty() || digits.empty()) {
-        return Position::NONE;
+Position Position::FromString(std::string_view str) {
+    int col = 0;
+    size_t letter_count = 0;
+    for (; letter_count < str.size(); letter_count++) {
+        int value = LETTER_VALUES.values[static_cast<unsigned char>(str[letter_count])];
+        if (value == 0) {
+            break;
+        }
+        if (letter_count == MAX_POS_LETTER_COUNT) {
+            return Position::NONE;
+        }
+        col = col * LETTERS + value;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+
+    auto digits = str.substr(letter_count);
+    if (letter_count == 0 || digits.empty()) {
         return Position::NONE;
     }
-
-    if (!std::isdigit(digits[0])) {
+    if (digits[0] < '0' || digits[0] > '9') {
         return Position::NONE;
     }
 
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (ec != std::errc() || ptr != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
+    return {row - 1, col - 1};
+}
+
+void PositionsFromStrings(const std::string_view* texts, size_t count, Position* positions) {
+    for (size_t i = 0; i < count; i++) {
+        positions[i] = Position::FromString(texts[i]);
     }
+}
 
-    return {row - 1, col - 1};
+size_t PositionsToChars(const Position* positions, size_t count, char* buffer, size_t* ends) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        length += positions[i].ToChars(buffer + length);
+        ends[i] = length;
+    }
+    return length;
 }
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
 }
 
+bool Range::operator==(Range rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::operator<(Range rhs) const {
+    return std::tie(from, to) < std::tie(rhs.from, rhs.to);
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+Size Range::GetSize() const {
+    return {to.row - from.row + 1, to.col - from.col + 1};
+}
+
+std::string Range::ToString() const {
+    return from.ToString() + ':' + to.ToString();
+}
+
+Range Range::FromPositions(Position lhs, Position rhs) {
+    return {{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+            {std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 FormulaError::FormulaError(FormulaError::Category category): category_(category) {}
 
 FormulaError::Category FormulaError::GetCategory() const { return category_; }
@@ -87,5 +141,6 @@ std::string_view FormulaError::ToString() const {
     if (category_ == Category::Div0) return "#DIV0!";
     else if (category_ == Category::Ref) return "#REF!";
     else if (category_ == Category::Value) return "#VALUE!";
+    else if (category_ == Category::NA) return "#N/A";
     else return "#UNKNOWN ERROR!";
 }
\ No newline at end of file